@@ -0,0 +1,321 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "include/bandwidth_governor.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    using nlohmann::json;
+
+    BandwidthGovernor::BandwidthGovernor(const FileUploadSettings &settings) :
+        lastRefillTime_(std::chrono::steady_clock::now()), rateWindowStartTime_(lastRefillTime_)
+    {
+        limits_.LimitInBytesPerSecond = settings.BandwidthLimitInBytesPerSecond;
+        if (settings.BandwidthPriorityWeights.empty())
+        {
+            return;
+        }
+
+        try
+        {
+            limits_.PriorityWeights = ParsePriorityWeights(json::parse(settings.BandwidthPriorityWeights));
+        }
+        catch (json::exception &e)
+        {
+            throw std::invalid_argument("Invalid bandwidth priority weights, " + std::string(e.what()));
+        }
+    }
+
+    BandwidthLimits BandwidthGovernor::GetLimits() const
+    {
+        std::scoped_lock<std::mutex> governorLock(governorMutex_);
+        return limits_;
+    }
+
+    void BandwidthGovernor::SetLimits(const BandwidthLimits &limits)
+    {
+        std::scoped_lock<std::mutex> governorLock(governorMutex_);
+
+        // Tokens accrued under the old limit are handed out first.
+        Refill(std::chrono::steady_clock::now());
+        limits_ = limits;
+    }
+
+    BandwidthLimits BandwidthGovernor::UpdateLimits(const std::string &payload)
+    {
+        json message = json::parse(payload);
+
+        std::scoped_lock<std::mutex> governorLock(governorMutex_);
+        BandwidthLimits limits = limits_;
+        if (message.contains(BandwidthLimits::LimitProperty))
+        {
+            limits.LimitInBytesPerSecond = message.at(BandwidthLimits::LimitProperty).get<uint64_t>();
+        }
+        if (message.contains(BandwidthLimits::PriorityWeightsProperty))
+        {
+            limits.PriorityWeights = ParsePriorityWeights(message.at(BandwidthLimits::PriorityWeightsProperty));
+        }
+
+        Refill(std::chrono::steady_clock::now());
+        limits_ = limits;
+        return limits_;
+    }
+
+    void BandwidthGovernor::AddTransfer(int priority)
+    {
+        std::scoped_lock<std::mutex> governorLock(governorMutex_);
+
+        // Tokens accrued before the priority became active belong to the priorities active then.
+        Refill(std::chrono::steady_clock::now());
+        classes_[priority].ActiveTransfers++;
+    }
+
+    void BandwidthGovernor::RemoveTransfer(int priority)
+    {
+        std::scoped_lock<std::mutex> governorLock(governorMutex_);
+        Refill(std::chrono::steady_clock::now());
+
+        BandwidthClass &bandwidthClass = classes_[priority];
+        if (bandwidthClass.ActiveTransfers > 0)
+        {
+            bandwidthClass.ActiveTransfers--;
+        }
+
+        // Tokens of a priority without transfers would allow a burst above the limit later.
+        if (bandwidthClass.ActiveTransfers == 0)
+        {
+            bandwidthClass.Tokens = 0;
+        }
+    }
+
+    size_t BandwidthGovernor::Acquire(int priority, size_t length)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        std::scoped_lock<std::mutex> governorLock(governorMutex_);
+        Refill(now);
+        UpdateRates(now);
+
+        BandwidthClass &bandwidthClass = classes_[priority];
+        if (limits_.LimitInBytesPerSecond > 0)
+        {
+            if (bandwidthClass.Tokens < (double)std::min(length, MinReadInBytes))
+            {
+                bandwidthClass.ThrottledCount++;
+                return 0;
+            }
+
+            // The transfer resumed first would otherwise empty the bucket, and starve the others until
+            // their low speed timeout aborts them.
+            size_t activeTransfers = std::max<size_t>(1, bandwidthClass.ActiveTransfers);
+            size_t fairShare = std::max((size_t)(GetBucketSize() / (double)activeTransfers), MinReadInBytes);
+            length = std::min({length, (size_t)bandwidthClass.Tokens, fairShare});
+            bandwidthClass.Tokens -= (double)length;
+        }
+
+        bandwidthClass.BytesSent += length;
+        bandwidthClass.WindowBytes += length;
+        return length;
+    }
+
+    void BandwidthGovernor::Release(int priority, size_t length)
+    {
+        std::scoped_lock<std::mutex> governorLock(governorMutex_);
+
+        BandwidthClass &bandwidthClass = classes_[priority];
+        if (limits_.LimitInBytesPerSecond > 0 && bandwidthClass.ActiveTransfers > 0)
+        {
+            bandwidthClass.Tokens = std::min(bandwidthClass.Tokens + (double)length, GetBucketSize());
+        }
+
+        bandwidthClass.BytesSent -= std::min<uint64_t>(length, bandwidthClass.BytesSent);
+        bandwidthClass.WindowBytes -= std::min<uint64_t>(length, bandwidthClass.WindowBytes);
+    }
+
+    bool BandwidthGovernor::CanResume(int priority)
+    {
+        std::scoped_lock<std::mutex> governorLock(governorMutex_);
+        if (limits_.LimitInBytesPerSecond == 0)
+        {
+            return true;
+        }
+
+        Refill(std::chrono::steady_clock::now());
+        return classes_[priority].Tokens >= (double)MinReadInBytes;
+    }
+
+    std::chrono::milliseconds BandwidthGovernor::GetResumeDelay(int priority)
+    {
+        std::scoped_lock<std::mutex> governorLock(governorMutex_);
+        if (limits_.LimitInBytesPerSecond == 0)
+        {
+            return std::chrono::milliseconds(0);
+        }
+
+        Refill(std::chrono::steady_clock::now());
+        double missingTokens = (double)MinReadInBytes - classes_[priority].Tokens;
+        if (missingTokens <= 0)
+        {
+            return std::chrono::milliseconds(0);
+        }
+
+        // The priority gets its weighted share of the limit while the other buckets aren't full, so this
+        // is the longest the transfer has to wait.
+        double bucketSize = GetBucketSize();
+        double totalWeight = 0;
+        for (const auto &[classPriority, bandwidthClass] : classes_)
+        {
+            if (bandwidthClass.ActiveTransfers > 0 && bandwidthClass.Tokens < bucketSize)
+            {
+                totalWeight += GetWeight(classPriority);
+            }
+        }
+
+        double rate = (double)limits_.LimitInBytesPerSecond * GetWeight(priority) / std::max(totalWeight, 1.0);
+        return std::chrono::milliseconds((int64_t)std::ceil(missingTokens * 1000 / rate));
+    }
+
+    std::vector<BandwidthClassMetrics> BandwidthGovernor::GetMetrics()
+    {
+        std::scoped_lock<std::mutex> governorLock(governorMutex_);
+        UpdateRates(std::chrono::steady_clock::now());
+
+        std::vector<BandwidthClassMetrics> metrics;
+        for (const auto &[priority, bandwidthClass] : classes_)
+        {
+            BandwidthClassMetrics classMetrics;
+            classMetrics.Priority = priority;
+            classMetrics.Weight = GetWeight(priority);
+            classMetrics.ActiveTransfers = bandwidthClass.ActiveTransfers;
+            classMetrics.BytesSent = bandwidthClass.BytesSent;
+            classMetrics.RateInBytesPerSecond = bandwidthClass.RateInBytesPerSecond;
+            classMetrics.ThrottledCount = bandwidthClass.ThrottledCount;
+            metrics.push_back(classMetrics);
+        }
+
+        return metrics;
+    }
+
+    std::map<int, unsigned int> BandwidthGovernor::ParsePriorityWeights(const json &weights)
+    {
+        if (!weights.is_object())
+        {
+            throw std::invalid_argument("The priority weights must be a JSON object of weights by priority.");
+        }
+
+        std::map<int, unsigned int> priorityWeights;
+        for (const auto &[key, value] : weights.items())
+        {
+            int priority = 0;
+            try
+            {
+                size_t parsedLength = 0;
+                priority = std::stoi(key, &parsedLength);
+                if (parsedLength != key.size())
+                {
+                    throw std::invalid_argument(key);
+                }
+            }
+            catch (const std::exception &)
+            {
+                throw std::invalid_argument("Invalid priority, " + key + ", in the priority weights.");
+            }
+
+            if (!value.is_number_unsigned() || value.get<uint64_t>() == 0 || value.get<uint64_t>() > UINT32_MAX)
+            {
+                throw std::invalid_argument("The weight of priority " + key + " must be a number bigger than zero.");
+            }
+            priorityWeights[priority] = value.get<unsigned int>();
+        }
+
+        return priorityWeights;
+    }
+
+    void BandwidthGovernor::Refill(std::chrono::steady_clock::time_point now)
+    {
+        double elapsedSeconds = std::chrono::duration<double>(now - lastRefillTime_).count();
+        lastRefillTime_ = now;
+        if (limits_.LimitInBytesPerSecond == 0 || elapsedSeconds <= 0)
+        {
+            return;
+        }
+
+        // The tokens are shared by weight among the active priorities whose bucket isn't full. What overflows a
+        // bucket is shared again among the others, and every round fills at least one bucket, so this ends.
+        double bucketSize = GetBucketSize();
+        double tokens = (double)limits_.LimitInBytesPerSecond * elapsedSeconds;
+        while (tokens > 0)
+        {
+            double totalWeight = 0;
+            for (const auto &[priority, bandwidthClass] : classes_)
+            {
+                if (bandwidthClass.ActiveTransfers > 0 && bandwidthClass.Tokens < bucketSize)
+                {
+                    totalWeight += GetWeight(priority);
+                }
+            }
+            if (totalWeight == 0)
+            {
+                break;
+            }
+
+            double overflow = 0;
+            for (auto &[priority, bandwidthClass] : classes_)
+            {
+                if (bandwidthClass.ActiveTransfers == 0 || bandwidthClass.Tokens >= bucketSize)
+                {
+                    continue;
+                }
+
+                bandwidthClass.Tokens += tokens * GetWeight(priority) / totalWeight;
+                if (bandwidthClass.Tokens > bucketSize)
+                {
+                    overflow += bandwidthClass.Tokens - bucketSize;
+                    bandwidthClass.Tokens = bucketSize;
+                }
+            }
+            tokens = overflow;
+        }
+
+        // A lowered limit also shrinks the buckets.
+        for (auto &[priority, bandwidthClass] : classes_)
+        {
+            bandwidthClass.Tokens = std::min(bandwidthClass.Tokens, bucketSize);
+        }
+    }
+
+    void BandwidthGovernor::UpdateRates(std::chrono::steady_clock::time_point now)
+    {
+        std::chrono::steady_clock::duration elapsed = now - rateWindowStartTime_;
+        if (elapsed < RateWindow)
+        {
+            return;
+        }
+
+        double elapsedSeconds = std::chrono::duration<double>(elapsed).count();
+        for (auto &[priority, bandwidthClass] : classes_)
+        {
+            bandwidthClass.RateInBytesPerSecond = (uint64_t)((double)bandwidthClass.WindowBytes / elapsedSeconds);
+            bandwidthClass.WindowBytes = 0;
+        }
+        rateWindowStartTime_ = now;
+    }
+
+    unsigned int BandwidthGovernor::GetWeight(int priority) const
+    {
+        auto weight = limits_.PriorityWeights.find(priority);
+        return weight != limits_.PriorityWeights.end() ? weight->second : 1;
+    }
+
+    double BandwidthGovernor::GetBucketSize() const
+    {
+        return std::max((double)limits_.LimitInBytesPerSecond * BurstInSeconds, (double)MinReadInBytes);
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -4,82 +4,876 @@
 //  </copyright>
 // ---------------------------------------------------------------------------------
 
+#include <algorithm>
 #include <curl/curl.h>
 #include <fcntl.h>
 #include <logging.h>
+#include <map>
 #include <memory>
+#include <set>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "include/blob_upload_handler.h"
 
 namespace microsoft::azure::connectedcar::fileuploadmodule
 {
-    static size_t ReadCallback(void *ptr, size_t size, size_t numElements, void *data)
+    /**
+     * @brief State of a blob upload. Only accessed on the upload engine thread.
+     */
+    struct BlobUploadOperation
     {
-        FILE *stream = (FILE *)data;
-        size_t retcode = fread(ptr, size, numElements, stream);
+        std::string FileName;
+        std::string Uri;
+        std::string UploadId;
+        std::string BlobPath;
+        std::string Compression;
+        int Priority = 0;
+        bool HashContent = false;
+        UploadCompletionHandler OnComplete;
 
-        return (curl_off_t)retcode;
+        int FileDescriptor = -1;
+        uint64_t FileSize = 0;
+        bool Chunked = false;
+        std::chrono::steady_clock::time_point StartTime;
+
+        uint64_t BlockSize = 0;
+        size_t BlockCount = 0;
+        std::vector<std::string> BlockIds;
+        std::shared_ptr<BlockManifest> Manifest;
+        size_t NextBlock = 0;
+        size_t BlocksInFlight = 0;
+        bool Failed = false;
+
+        // Streaming state of compressed files and packs. Blocks are produced while the source is read, and
+        // kept in memory until they are uploaded, so a failed block can be retried.
+        bool Streamed = false;
+        std::unique_ptr<StreamCompressor> Compressor;
+        std::unique_ptr<TarPackStream> Pack;
+        uint64_t StreamOffset = 0;
+        uint64_t StreamedSize = 0;
+        std::string StreamOutput;
+        std::map<size_t, std::string> StreamBlocks;
+        bool StreamScheduled = false;
+        bool StreamFinished = false;
+
+        // Content hash of the file, computed from the data read for the upload.
+        std::unique_ptr<SegmentedContentHash> ContentHash;
+
+        // CRC64 and length of each uploaded block, combined into the CRC64 of the blob once every block has
+        // one. Blocks uploaded by an earlier attempt have none.
+        std::map<size_t, std::pair<uint64_t, uint64_t>> BlockChecksums;
+        std::string BlobCrc64;
+
+        ~BlobUploadOperation()
+        {
+            if (FileDescriptor >= 0)
+            {
+                close(FileDescriptor);
+            }
+        }
+    };
+
+    static std::string Base64Encode(const std::string &value)
+    {
+        static const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        std::string encoded;
+        int bits = 0;
+        unsigned int buffer = 0;
+        for (unsigned char c : value)
+        {
+            buffer = (buffer << 8) | c;
+            bits += 8;
+            while (bits >= 6)
+            {
+                bits -= 6;
+                encoded.push_back(alphabet[(buffer >> bits) & 0x3F]);
+            }
+        }
+
+        if (bits > 0)
+        {
+            encoded.push_back(alphabet[(buffer << (6 - bits)) & 0x3F]);
+        }
+
+        while (encoded.size() % 4 != 0)
+        {
+            encoded.push_back('=');
+        }
+
+        return encoded;
+    }
+
+    static std::string CreateBlockId(size_t blockIndex)
+    {
+        // Block ids of a blob must have the same length, so the index is zero-padded.
+        char blockName[16];
+        snprintf(blockName, sizeof(blockName), "block-%09zu", blockIndex);
+
+        return Base64Encode(blockName);
+    }
+
+    static std::string AppendQuery(const std::string &uri, const std::string &query)
+    {
+        return uri + (uri.find('?') == std::string::npos ? "?" : "&") + query;
+    }
+
+    static std::string UrlEncode(const std::string &value)
+    {
+        std::string encoded;
+        for (char c : value)
+        {
+            switch (c)
+            {
+            case '+':
+                encoded += "%2B";
+                break;
+            case '/':
+                encoded += "%2F";
+                break;
+            case '=':
+                encoded += "%3D";
+                break;
+            default:
+                encoded.push_back(c);
+                break;
+            }
+        }
+
+        return encoded;
+    }
+
+    BlobUploadHandler::BlobUploadHandler(const FileUploadSettings &settings) :
+        settings_(settings), curlHandlePool_(settings.MaxPooledCurlHandles),
+        uploadEngine_(curlHandlePool_, settings)
+    {
+        manifestThread_ = std::thread(&BlobUploadHandler::RunManifestTasks, this);
+    }
+
+    BlobUploadHandler::~BlobUploadHandler()
+    {
+        Stop();
+    }
+
+    void BlobUploadHandler::Stop()
+    {
+        // The manifest thread finishes its queued tasks first, which may post work to the engine, and the engine
+        // then fails what is left.
+        {
+            std::scoped_lock<std::mutex> manifestLock(manifestMutex_);
+            manifestStopping_ = true;
+        }
+        manifestCondition_.notify_one();
+        if (manifestThread_.joinable())
+        {
+            manifestThread_.join();
+        }
+
+        uploadEngine_.Stop();
+    }
+
+    void BlobUploadHandler::RunManifestTasks()
+    {
+        while (true)
+        {
+            std::deque<ManifestTask> tasks;
+            {
+                std::unique_lock<std::mutex> manifestLock(manifestMutex_);
+                manifestCondition_.wait(manifestLock, [this] { return manifestStopping_ || !manifestTasks_.empty(); });
+                if (manifestTasks_.empty())
+                {
+                    return;
+                }
+                tasks.swap(manifestTasks_);
+            }
+
+            std::set<std::shared_ptr<BlockManifest>> manifests;
+            for (ManifestTask &task : tasks)
+            {
+                task.Run();
+                manifests.insert(task.Manifest);
+            }
+
+            // The blocks recorded while the last batch was synced are synced together, one sync per manifest.
+            for (const std::shared_ptr<BlockManifest> &manifest : manifests)
+            {
+                manifest->Sync();
+            }
+        }
+    }
+
+    void BlobUploadHandler::PostManifestTask(const std::shared_ptr<BlockManifest> &manifest, std::function<void()> run)
+    {
+        {
+            std::scoped_lock<std::mutex> manifestLock(manifestMutex_);
+            if (!manifestStopping_)
+            {
+                manifestTasks_.push_back(ManifestTask{manifest, std::move(run)});
+                manifestCondition_.notify_one();
+                return;
+            }
+        }
+
+        run();
+        manifest->Sync();
+    }
+
+    void BlobUploadHandler::SetManifestDirectory(const std::string &hostDataContainerPath)
+    {
+        manifestDirectory_ = hostDataContainerPath + "/" + ManifestDirectoryName;
     }
 
-    static bool UploadFile(CURL *curl, const std::string &fileName, const std::string &uri)
+    void BlobUploadHandler::DiscardProgress(const std::string &blobPath)
     {
-        CURLcode result;
+        if (!manifestDirectory_.empty())
+        {
+            unlink(BlockManifest::GetManifestPath(manifestDirectory_, blobPath).c_str());
+        }
+    }
+
+    void BlobUploadHandler::SetBandwidthGovernor(const std::shared_ptr<BandwidthGovernor> &bandwidthGovernor)
+    {
+        uploadEngine_.SetBandwidthGovernor(bandwidthGovernor);
+    }
+
+    void BlobUploadHandler::UploadBlobAsync(
+        const std::string &fileName,
+        const std::string &uri,
+        const std::string &uploadId,
+        const std::string &blobPath,
+        const std::string &compression,
+        int priority,
+        bool hashContent,
+        UploadCompletionHandler onComplete)
+    {
+        std::shared_ptr<BlobUploadOperation> operation = std::make_shared<BlobUploadOperation>();
+        operation->FileName = fileName;
+        operation->Uri = uri;
+        operation->UploadId = uploadId;
+        operation->BlobPath = blobPath;
+        operation->Compression = compression;
+        operation->Priority = priority;
+        operation->HashContent = hashContent;
+        operation->OnComplete = std::move(onComplete);
+        operation->StartTime = std::chrono::steady_clock::now();
+
+        uploadEngine_.Post([this, operation]() { StartUpload(operation); });
+    }
+
+    void BlobUploadHandler::UploadPackAsync(
+        std::vector<PackEntry> entries,
+        const std::string &uri,
+        const std::string &uploadId,
+        const std::string &blobPath,
+        const std::string &compression,
+        int priority,
+        UploadCompletionHandler onComplete)
+    {
+        std::shared_ptr<BlobUploadOperation> operation = std::make_shared<BlobUploadOperation>();
+        operation->FileName = blobPath;
+        operation->Uri = uri;
+        operation->UploadId = uploadId;
+        operation->BlobPath = blobPath;
+        operation->Compression = compression;
+        operation->Priority = priority;
+        operation->Pack = std::make_unique<TarPackStream>(std::move(entries));
+        operation->OnComplete = std::move(onComplete);
+        operation->StartTime = std::chrono::steady_clock::now();
+
+        uploadEngine_.Post([this, operation]() { StartUpload(operation); });
+    }
+
+    void BlobUploadHandler::StartUpload(const std::shared_ptr<BlobUploadOperation> &operation)
+    {
+        operation->Compressor = StreamCompressor::Create(operation->Compression, (int)settings_.CompressionLevel);
+        if (operation->Pack)
+        {
+            // The packed files are opened one after the other while the pack is streamed.
+            operation->FileSize = operation->Pack->GetSize();
+            StartStreamedUpload(operation);
+            return;
+        }
+
+        operation->FileDescriptor = open(operation->FileName.c_str(), O_RDONLY | O_CLOEXEC);
+        if (operation->FileDescriptor < 0)
+        {
+            LogError("Failed to open the file %s\n", operation->FileName.c_str());
+            CompleteUpload(operation, false);
+            return;
+        }
+
         struct stat fileInfo;
-        stat(fileName.c_str(), &fileInfo);
+        if (fstat(operation->FileDescriptor, &fileInfo) != 0)
+        {
+            LogError("Failed to get the file size of %s\n", operation->FileName.c_str());
+            CompleteUpload(operation, false);
+            return;
+        }
+
+        operation->FileSize = (uint64_t)fileInfo.st_size;
+        operation->Chunked = operation->FileSize >= settings_.ChunkedUploadThresholdInBytes;
+        if (operation->HashContent)
+        {
+            operation->ContentHash =
+                std::make_unique<SegmentedContentHash>(operation->FileSize, GetHashSegmentSize(operation->FileSize));
+        }
 
-        FILE *file = fopen(fileName.c_str(), "rb");
+        if (operation->Compressor)
+        {
+            posix_fadvise(operation->FileDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+            StartStreamedUpload(operation);
+            return;
+        }
 
-        if (!file)
+        if (!operation->Chunked)
         {
-            LogError("Failed to open the file %s\n", fileName.c_str());
-            return false;
+            UploadTransfer transfer;
+            transfer.Uri = operation->Uri;
+            transfer.Priority = operation->Priority;
+            transfer.Headers.push_back("x-ms-blob-type: BlockBlob");
+            transfer.FileDescriptor = operation->FileDescriptor;
+            transfer.Length = operation->FileSize;
+            if (operation->ContentHash)
+            {
+                transfer.Hasher = std::make_shared<ContentHasher>();
+            }
+            if (settings_.ContentCrc64)
+            {
+                transfer.Checksum = std::make_shared<Crc64>();
+            }
+            transfer.Description = operation->FileName;
+            std::shared_ptr<ContentHasher> hasher = transfer.Hasher;
+            std::shared_ptr<Crc64> checksum = transfer.Checksum;
+            transfer.OnComplete = [this, operation, hasher, checksum](bool succeeded, long) {
+                if (succeeded)
+                {
+                    if (hasher)
+                    {
+                        operation->ContentHash->SetSegmentHash(0, hasher->Finish());
+                    }
+                    if (checksum)
+                    {
+                        operation->BlobCrc64 = Crc64::Encode(checksum->GetValue());
+                    }
+                }
+
+                CompleteUpload(operation, succeeded);
+            };
+
+            uploadEngine_.Submit(std::move(transfer));
+            return;
         }
 
-        curl_easy_setopt(curl, CURLOPT_READFUNCTION, ReadCallback);
-        curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
-        curl_easy_setopt(curl, CURLOPT_PUT, 1L);
+        operation->BlockSize = GetBlockSize(operation->FileSize);
+        operation->BlockCount = (size_t)((operation->FileSize + operation->BlockSize - 1) / operation->BlockSize);
+        for (size_t blockIndex = 0; blockIndex < operation->BlockCount; blockIndex++)
+        {
+            operation->BlockIds.push_back(CreateBlockId(blockIndex));
+        }
+
+        // Block ids are derived from the block index, so blocks uploaded by an earlier
+        // attempt are still staged on the blob under the same id and don't need to be sent again.
+        if (!manifestDirectory_.empty())
+        {
+            BlockManifestHeader manifestHeader;
+            manifestHeader.UploadId = operation->UploadId;
+            manifestHeader.BlobPath = operation->BlobPath;
+            manifestHeader.FileSize = operation->FileSize;
+            manifestHeader.ModifiedTime = (int64_t)fileInfo.st_mtime;
+            manifestHeader.BlockSize = operation->BlockSize;
 
-        // Set blob-type header.
-        struct curl_slist *headers = nullptr;
-        headers = curl_slist_append(headers, "x-ms-blob-type: BlockBlob");
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+            // Opening a manifest creates and syncs files, so the blocks are submitted once the manifest thread
+            // opened it.
+            std::shared_ptr<BlockManifest> manifest =
+                std::make_shared<BlockManifest>(manifestDirectory_, manifestHeader);
+            PostManifestTask(manifest, [this, operation, manifest]() {
+                bool opened = manifest->Open();
+                uploadEngine_.Post([this, operation, manifest, opened]() {
+                    if (opened)
+                    {
+                        operation->Manifest = manifest;
+                        if (manifest->GetUploadedBlockCount() > 0)
+                        {
+                            LogInfo(
+                                "Resume uploading %s, %zu of %zu blocks already uploaded.",
+                                operation->FileName.c_str(),
+                                manifest->GetUploadedBlockCount(),
+                                operation->BlockCount);
+                        }
+                    }
 
-        // Set upload url & read callback.
-        curl_easy_setopt(curl, CURLOPT_URL, uri.c_str());
-        curl_easy_setopt(curl, CURLOPT_READDATA, file);
-        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)fileInfo.st_size);
+                    SubmitNextBlocks(operation);
+                });
+            });
+            return;
+        }
 
-        result = curl_easy_perform(curl);
-        if (result == CURLE_OK)
+        SubmitNextBlocks(operation);
+    }
+
+    void BlobUploadHandler::StartStreamedUpload(const std::shared_ptr<BlobUploadOperation> &operation)
+    {
+        // The uploaded size of a compressed stream is only known once it is complete. A stream that fits into
+        // a block is buffered in memory and sent with Put Blob, bigger streams in blocks. The block boundaries
+        // of a compressed stream can't be resumed, so no block manifest is kept.
+        operation->Streamed = true;
+        operation->BlockSize = GetBlockSize(operation->FileSize);
+        operation->Chunked =
+            operation->FileSize >= std::min(settings_.ChunkedUploadThresholdInBytes, operation->BlockSize);
+
+        SubmitNextBlocks(operation);
+    }
+
+    void BlobUploadHandler::SubmitNextBlocks(const std::shared_ptr<BlobUploadOperation> &operation)
+    {
+        if (operation->Streamed)
+        {
+            // Streamed blocks are submitted as the stream produces them.
+            if (!operation->Failed && !operation->StreamFinished && !operation->StreamScheduled &&
+                operation->BlocksInFlight < settings_.MaxParallelBlockUploads)
+            {
+                operation->StreamScheduled = true;
+                uploadEngine_.Post([this, operation]() { StreamNextPiece(operation); });
+            }
+
+            // Until the stream is complete, the streaming submits the blocks and continues the upload.
+            if (operation->StreamScheduled || (!operation->Failed && !operation->StreamFinished))
+            {
+                return;
+            }
+        }
+
+        while (!operation->Failed && operation->BlocksInFlight < settings_.MaxParallelBlockUploads &&
+               operation->NextBlock < operation->BlockCount)
         {
-            LogInfo("Successfully uploaded " + fileName + ".");
+            size_t blockIndex = operation->NextBlock++;
+            if (operation->Manifest && operation->Manifest->IsBlockUploaded(blockIndex))
+            {
+                continue;
+            }
+
+            SubmitBlock(operation, blockIndex, 0);
+        }
+
+        if (operation->BlocksInFlight > 0)
+        {
+            return;
+        }
+
+        if (operation->Failed)
+        {
+            CompleteUpload(operation, false);
+        }
+        else if (operation->NextBlock >= operation->BlockCount)
+        {
+            CommitBlockList(operation);
+        }
+    }
+
+    void BlobUploadHandler::StreamNextPiece(const std::shared_ptr<BlobUploadOperation> &operation)
+    {
+        operation->StreamScheduled = false;
+        if (operation->Failed)
+        {
+            SubmitNextBlocks(operation);
+            return;
+        }
+
+        uint64_t pieceSize = std::min(StreamPieceInBytes, operation->FileSize - operation->StreamOffset);
+        std::string piece(pieceSize, '\0');
+        bool read;
+        if (operation->Pack)
+        {
+            read = operation->Pack->Read(&piece[0], pieceSize);
         }
         else
         {
-            LogError("curl_easy_perform() failed: %s\n", curl_easy_strerror(result));
+            ssize_t readSize =
+                pread(operation->FileDescriptor, &piece[0], pieceSize, (off_t)operation->StreamOffset);
+            read = readSize >= 0 && (uint64_t)readSize == pieceSize;
+        }
+
+        if (!read)
+        {
+            LogError("Failed to read %s.", operation->FileName.c_str());
+            operation->Failed = true;
+            SubmitNextBlocks(operation);
+            return;
+        }
+
+        if (operation->ContentHash)
+        {
+            operation->ContentHash->Update(piece.data(), piece.size());
+        }
+
+        operation->StreamOffset += pieceSize;
+        bool finish = operation->StreamOffset >= operation->FileSize;
+        if (!operation->Compressor)
+        {
+            operation->StreamOutput += piece;
+        }
+        else if (!operation->Compressor->Compress(piece.data(), piece.size(), finish, operation->StreamOutput))
+        {
+            LogError("Failed to compress %s.", operation->FileName.c_str());
+            operation->Failed = true;
+            SubmitNextBlocks(operation);
+            return;
+        }
+
+        operation->StreamFinished = finish;
+        if (!operation->Chunked)
+        {
+            if (finish)
+            {
+                SubmitStreamedBlob(operation);
+            }
+            else
+            {
+                SubmitNextBlocks(operation);
+            }
+            return;
+        }
+
+        // Full blocks are cut off the output, and the rest once the stream is complete.
+        while (operation->StreamOutput.size() >= operation->BlockSize ||
+               (finish && !operation->StreamOutput.empty()))
+        {
+            size_t blockIndex = operation->BlockIds.size();
+            if (blockIndex >= MaxBlockCount)
+            {
+                LogError(
+                    "The streamed %s needs more than %llu blocks.",
+                    operation->FileName.c_str(),
+                    static_cast<unsigned long long>(MaxBlockCount));
+                operation->Failed = true;
+                break;
+            }
+
+            size_t blockSize = (size_t)std::min<uint64_t>(operation->BlockSize, operation->StreamOutput.size());
+            operation->StreamBlocks[blockIndex] = operation->StreamOutput.substr(0, blockSize);
+            operation->StreamOutput.erase(0, blockSize);
+            operation->StreamedSize += blockSize;
+
+            // The block is in memory, so its CRC64 is sent with it and checked by the storage service.
+            if (settings_.ContentCrc64)
+            {
+                Crc64 checksum;
+                checksum.Update(operation->StreamBlocks[blockIndex].data(), blockSize);
+                operation->BlockChecksums[blockIndex] = {checksum.GetValue(), blockSize};
+            }
+
+            operation->BlockIds.push_back(CreateBlockId(blockIndex));
+            operation->BlockCount++;
+            operation->NextBlock++;
+            SubmitBlock(operation, blockIndex, 0);
+        }
+
+        SubmitNextBlocks(operation);
+    }
+
+    void BlobUploadHandler::SubmitStreamedBlob(const std::shared_ptr<BlobUploadOperation> &operation)
+    {
+        operation->StreamedSize = operation->StreamOutput.size();
+
+        UploadTransfer transfer;
+        transfer.Uri = operation->Uri;
+        transfer.Priority = operation->Priority;
+
+        transfer.Headers = GetStreamHeaders(operation, false);
+        transfer.Headers.push_back("x-ms-blob-type: BlockBlob");
+        if (settings_.ContentCrc64)
+        {
+            Crc64 checksum;
+            checksum.Update(operation->StreamOutput.data(), operation->StreamOutput.size());
+            std::string blobCrc64 = Crc64::Encode(checksum.GetValue());
+            transfer.Headers.push_back("x-ms-content-crc64: " + blobCrc64);
+            transfer.Headers.push_back("x-ms-meta-contentcrc64: " + blobCrc64);
+            operation->BlobCrc64 = blobCrc64;
         }
+        transfer.Body = std::move(operation->StreamOutput);
+        transfer.Description = operation->FileName;
+        transfer.OnComplete = [this, operation](bool succeeded, long) { CompleteUpload(operation, succeeded); };
 
-        fclose(file);
-        return (result == CURLE_OK);
+        uploadEngine_.Submit(std::move(transfer));
     }
 
-    bool BlobUploadHandler::UploadBlob(const std::string &fileName, const std::string &uri)
+    std::vector<std::string> BlobUploadHandler::GetStreamHeaders(
+        const std::shared_ptr<BlobUploadOperation> &operation,
+        bool commit) const
     {
-        bool result = false;
+        // Put Block List sets the blob properties with x-ms-blob-* headers instead of the HTTP headers.
+        std::vector<std::string> headers;
+        if (operation->Compressor)
+        {
+            headers.push_back(
+                std::string(commit ? "x-ms-blob-content-encoding: " : "Content-Encoding: ") +
+                operation->Compressor->GetContentEncoding());
+            headers.push_back("x-ms-meta-uncompressedsize: " + std::to_string(operation->FileSize));
+        }
 
-        CURL *curl = curl_easy_init();
-        if (curl)
+        if (operation->Pack)
         {
-            result = UploadFile(curl, fileName, uri);
-            curl_easy_cleanup(curl);
+            headers.push_back(
+                std::string(commit ? "x-ms-blob-content-type: " : "Content-Type: ") + "application/x-tar");
+            headers.push_back("x-ms-meta-packindexoffset: " + std::to_string(operation->Pack->GetIndexOffset()));
+            headers.push_back("x-ms-meta-packfilecount: " + std::to_string(operation->Pack->GetFileCount()));
+        }
+
+        return headers;
+    }
+
+    void BlobUploadHandler::SubmitBlock(
+        const std::shared_ptr<BlobUploadOperation> &operation,
+        size_t blockIndex,
+        unsigned int attempt)
+    {
+        const std::string &blockId = operation->BlockIds[blockIndex];
+        uint64_t offset = blockIndex * operation->BlockSize;
+
+        UploadTransfer transfer;
+        transfer.Uri = AppendQuery(operation->Uri, "comp=block&blockid=" + UrlEncode(blockId));
+        transfer.Priority = operation->Priority;
+
+        if (operation->Streamed)
+        {
+            transfer.Body = operation->StreamBlocks[blockIndex];
+
+            auto blockChecksum = operation->BlockChecksums.find(blockIndex);
+            if (blockChecksum != operation->BlockChecksums.end())
+            {
+                transfer.Headers.push_back("x-ms-content-crc64: " + Crc64::Encode(blockChecksum->second.first));
+            }
         }
         else
         {
-            LogError("Can't initialize cUrl instance.");
+            transfer.FileDescriptor = operation->FileDescriptor;
+            transfer.Offset = offset;
+            transfer.Length = std::min(operation->BlockSize, operation->FileSize - offset);
+            if (operation->ContentHash)
+            {
+                transfer.Hasher = std::make_shared<ContentHasher>();
+            }
+            if (settings_.ContentCrc64)
+            {
+                transfer.Checksum = std::make_shared<Crc64>();
+            }
+        }
+        transfer.Description = "block " + std::to_string(blockIndex) + " of " + operation->FileName;
+        std::shared_ptr<ContentHasher> hasher = transfer.Hasher;
+        std::shared_ptr<Crc64> checksum = transfer.Checksum;
+        transfer.OnComplete = [this, operation, blockIndex, attempt, hasher, checksum](bool succeeded, long) {
+            operation->BlocksInFlight--;
+
+            if (succeeded)
+            {
+                if (operation->Manifest)
+                {
+                    std::shared_ptr<BlockManifest> manifest = operation->Manifest;
+                    PostManifestTask(manifest, [manifest, blockIndex]() { manifest->MarkBlockUploaded(blockIndex); });
+                }
+                if (hasher)
+                {
+                    operation->ContentHash->SetSegmentHash(blockIndex, hasher->Finish());
+                }
+                if (checksum)
+                {
+                    operation->BlockChecksums[blockIndex] = {checksum->GetValue(), checksum->GetLength()};
+                }
+                operation->StreamBlocks.erase(blockIndex);
+            }
+            else if (attempt + 1 < BlockUploadRetries && !operation->Failed)
+            {
+                SubmitBlock(operation, blockIndex, attempt + 1);
+                return;
+            }
+            else
+            {
+                LogError("Failed to upload block %zu of %s.", blockIndex, operation->FileName.c_str());
+                operation->Failed = true;
+            }
+
+            SubmitNextBlocks(operation);
+        };
+
+        operation->BlocksInFlight++;
+        uploadEngine_.Submit(std::move(transfer));
+    }
+
+    void BlobUploadHandler::CommitBlockList(const std::shared_ptr<BlobUploadOperation> &operation)
+    {
+        std::string blockList = "<?xml version=\"1.0\" encoding=\"utf-8\"?><BlockList>";
+        for (const std::string &blockId : operation->BlockIds)
+        {
+            blockList += "<Latest>" + blockId + "</Latest>";
+        }
+        blockList += "</BlockList>";
+
+        UploadTransfer transfer;
+        transfer.Uri = AppendQuery(operation->Uri, "comp=blocklist");
+        transfer.Priority = operation->Priority;
+
+        transfer.Headers = GetStreamHeaders(operation, true);
+        transfer.Headers.push_back("Content-Type: application/xml");
+
+        // The block CRC64s are combined in block list order, so the blob CRC64 needs no read of the blob.
+        if (operation->BlockCount > 0 && operation->BlockChecksums.size() == operation->BlockCount)
+        {
+            uint64_t blobCrc64 = 0;
+            for (const auto &[blockIndex, blockChecksum] : operation->BlockChecksums)
+            {
+                blobCrc64 = Crc64::Combine(blobCrc64, blockChecksum.first, blockChecksum.second);
+            }
+
+            operation->BlobCrc64 = Crc64::Encode(blobCrc64);
+            transfer.Headers.push_back("x-ms-meta-contentcrc64: " + operation->BlobCrc64);
+        }
+        transfer.Body = std::move(blockList);
+        transfer.Description = "block list of " + operation->FileName;
+        transfer.OnComplete = [this, operation](bool succeeded, long responseCode) {
+            // Once committed, or if the staged blocks are gone (uncommitted blocks expire
+            // after a week), the next attempt has to start from the first block.
+            if (operation->Manifest && (succeeded || responseCode == 400))
+            {
+                std::shared_ptr<BlockManifest> manifest = operation->Manifest;
+                PostManifestTask(manifest, [manifest]() { manifest->Remove(); });
+            }
+
+            CompleteUpload(operation, succeeded);
+        };
+
+        uploadEngine_.Submit(std::move(transfer));
+    }
+
+    void BlobUploadHandler::CompleteUpload(const std::shared_ptr<BlobUploadOperation> &operation, bool uploadResult)
+    {
+        if (operation->FileDescriptor >= 0)
+        {
+            close(operation->FileDescriptor);
+            operation->FileDescriptor = -1;
+        }
+
+        if (uploadResult)
+        {
+            std::chrono::steady_clock::duration latency = std::chrono::steady_clock::now() - operation->StartTime;
+            curlHandlePool_.RecordFileLatency(latency);
+
+            double seconds = std::chrono::duration<double>(latency).count();
+            LogInfo(
+                "Successfully uploaded %s, %llu bytes in %.3f s (%.2f MB/s, %s).",
+                operation->FileName.c_str(),
+                static_cast<unsigned long long>(operation->FileSize),
+                seconds,
+                seconds > 0 ? operation->FileSize / seconds / (1024 * 1024) : 0.0,
+                operation->Chunked ? "block upload" : "single upload");
+
+            if (operation->Compressor)
+            {
+                LogInfo(
+                    "Compressed %s with %s to %llu bytes (%.1f%%).",
+                    operation->FileName.c_str(),
+                    operation->Compressor->GetContentEncoding().c_str(),
+                    static_cast<unsigned long long>(operation->StreamedSize),
+                    operation->FileSize > 0 ? 100.0 * operation->StreamedSize / operation->FileSize : 100.0);
+            }
+
+            if (operation->Pack)
+            {
+                LogInfo("Packed %zu files into %s.", operation->Pack->GetFileCount(), operation->BlobPath.c_str());
+            }
+
+            CurlHandlePoolStatistics statistics = curlHandlePool_.GetStatistics();
+            LogTrace(
+                "Connection pool: %llu requests, %llu new connections, %llu TLS handshakes, %llu reused "
+                "connections, %.1f ms average file latency.",
+                static_cast<unsigned long long>(statistics.Requests),
+                static_cast<unsigned long long>(statistics.NewConnections),
+                static_cast<unsigned long long>(statistics.TlsHandshakes),
+                static_cast<unsigned long long>(statistics.ReusedConnections),
+                statistics.AverageFileLatencyInMs);
+        }
+
+        BlobUploadResult result;
+        result.Succeeded = uploadResult;
+        result.FileSize = operation->FileSize;
+        if (uploadResult && operation->ContentHash)
+        {
+            result.ContentHash = operation->ContentHash->Finish();
+        }
+        if (uploadResult)
+        {
+            result.ContentCrc64 = operation->BlobCrc64;
+        }
+
+        UploadCompletionHandler onComplete = std::move(operation->OnComplete);
+        if (onComplete)
+        {
+            onComplete(result);
+        }
+    }
+
+    bool BlobUploadHandler::ComputeContentHash(
+        const std::string &fileName,
+        uint64_t &fileSize,
+        std::string &contentHash) const
+    {
+        int fileDescriptor = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fileDescriptor < 0)
+        {
+            return false;
+        }
+
+        struct stat fileInfo;
+        if (fstat(fileDescriptor, &fileInfo) != 0)
+        {
+            close(fileDescriptor);
+            return false;
+        }
+
+        fileSize = (uint64_t)fileInfo.st_size;
+        posix_fadvise(fileDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        SegmentedContentHash hash(fileSize, GetHashSegmentSize(fileSize));
+        std::vector<char> buffer(HashReadSizeInBytes);
+        uint64_t offset = 0;
+        while (offset < fileSize)
+        {
+            ssize_t bytesRead = pread(fileDescriptor, buffer.data(), buffer.size(), (off_t)offset);
+            if (bytesRead <= 0)
+            {
+                close(fileDescriptor);
+                return false;
+            }
+
+            hash.Update(buffer.data(), (size_t)bytesRead);
+            offset += (uint64_t)bytesRead;
+        }
+
+        close(fileDescriptor);
+        contentHash = hash.Finish();
+
+        return !contentHash.empty();
+    }
+
+    uint64_t BlobUploadHandler::GetBlockSize(uint64_t fileSize) const
+    {
+        uint64_t blockSize = settings_.BlockSizeInBytes;
+        if ((fileSize + blockSize - 1) / blockSize > MaxBlockCount)
+        {
+            blockSize = (fileSize + MaxBlockCount - 1) / MaxBlockCount;
+        }
+
+        return blockSize;
+    }
+
+    uint64_t BlobUploadHandler::GetHashSegmentSize(uint64_t fileSize) const
+    {
+        if (fileSize >= settings_.ChunkedUploadThresholdInBytes)
+        {
+            return GetBlockSize(fileSize);
         }
 
-        return result;
+        return std::max<uint64_t>(fileSize, 1);
     }
-} // namespace microsoft::azure::connectedcar::fileuploadmodule
\ No newline at end of file
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -4,63 +4,113 @@
 //  </copyright>
 // ---------------------------------------------------------------------------------
 
+#include <algorithm>
 #include <assert.h>
+#include <cstdlib>
+#include <ctime>
 #include <logging.h>
-#include <thread>
-#include <threading_utils.h>
 
 #include "include/blob_uri_handler.h"
 
 namespace microsoft::azure::connectedcar::fileuploadmodule
 {
+    BlobUriHandler::BlobUriHandler(size_t cacheCapacity, std::chrono::seconds minRemainingValidity) :
+        cacheCapacity_(std::max<size_t>(1, cacheCapacity)), minRemainingValidity_(minRemainingValidity)
+    {
+    }
+
     void BlobUriHandler::AddBlobUri(
         const std::string &fileName,
         const std::string &uri,
         const CorrelationId &correlationId)
     {
-        OptimizeCache();
+        std::scoped_lock<std::mutex> cacheLock(cacheMutex_);
 
-        if (blobUriCache_.find(fileName) == blobUriCache_.end())
+        bool existingEntry = blobUriCache_.find(fileName) != blobUriCache_.end();
+        if (existingEntry)
         {
-            BlobUriCacheItem item;
-            item.FileName = fileName;
-            item.BlobUri = uri;
-            item.CreatedTime = std::chrono::steady_clock::now();
-            blobUriCache_[fileName] = item;
-
-            LogTrace(correlationId, "Add a new blob uri entry, %s.", fileName.c_str());
+            RemoveCacheItem(fileName);
         }
-        else
-        {
-            blobUriCache_[fileName].BlobUri = uri;
-            blobUriCache_[fileName].CreatedTime = std::chrono::steady_clock::now();
 
-            LogTrace(correlationId, "Update existing uri entry, %s.", fileName.c_str());
+        BlobUriCacheItem item;
+        item.FileName = fileName;
+        item.BlobUri = uri;
+        item.CreatedTime = std::chrono::steady_clock::now();
+
+        std::optional<std::chrono::system_clock::time_point> sasExpiryTime = GetSasExpiryTime(uri);
+        item.Lifetime = sasExpiryTime.has_value()
+                            ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                  *sasExpiryTime - std::chrono::system_clock::now())
+                            : std::chrono::duration_cast<std::chrono::steady_clock::duration>(DefaultUriLifetime);
+        item.ExpiryTime = item.CreatedTime + item.Lifetime;
+
+        // The token was just issued, so a lifetime this short usually means the local clock is ahead.
+        if (item.Lifetime < minRemainingValidity_)
+        {
+            LogWarn(
+                correlationId,
+                "The blob uri of %s expires in %lld seconds by the local clock, which may be wrong. The uri is "
+                "used for its upload, but not reused.",
+                fileName.c_str(),
+                (long long)std::chrono::duration_cast<std::chrono::seconds>(item.Lifetime).count());
         }
+
+        blobUriCache_[fileName] = item;
+        expiryIndex_.emplace(item.ExpiryTime, fileName);
+
+        LogTrace(
+            correlationId,
+            existingEntry ? "Update existing uri entry, %s." : "Add a new blob uri entry, %s.",
+            fileName.c_str());
+
+        OptimizeCache();
+
+        blobUriAdded_.notify_all();
+    }
+
+    bool BlobUriHandler::HasValidBlobUri(const std::string &fileName)
+    {
+        std::scoped_lock<std::mutex> cacheLock(cacheMutex_);
+
+        auto it = blobUriCache_.find(fileName);
+        return it != blobUriCache_.end() && IsUsable(it->second);
     }
 
     std::string BlobUriHandler::WaitForBlobUri(
         const std::string &fileName,
         int timeoutInSec,
-        const CorrelationId &correlationId)
+        const CorrelationId &correlationId,
+        const CancellationToken::Ptr &cancellationToken)
     {
-        std::chrono::time_point<std::chrono::steady_clock> current = std::chrono::steady_clock::now();
-        int durationInSeconds = 0;
+        std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(timeoutInSec);
 
-        do
+        std::unique_lock<std::mutex> cacheLock(cacheMutex_);
+        while (true)
         {
-            // Wait for blob uri return.
-            std::this_thread::sleep_for(std::chrono::seconds(BlobCacheLookupSleep));
-            durationInSeconds =
-                (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - current)).count();
-
+            // The uri may have arrived before the wait started, so look it up before sleeping.
             std::string blobUri = FindBlobUri(fileName, correlationId);
             if (!blobUri.empty())
             {
                 return blobUri;
             }
 
-        } while (timeoutInSec > durationInSeconds);
+            if (cancellationToken && cancellationToken->IsCancellationRequested())
+            {
+                LogInfo(correlationId, "Stop waiting for the upload token of %s, cancelled.", fileName.c_str());
+                return std::string();
+            }
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+            {
+                break;
+            }
+
+            blobUriAdded_.wait_until(
+                cacheLock,
+                std::min(deadline, now + std::chrono::milliseconds(CancellationCheckIntervalInMs)));
+        }
 
         LogWarn(correlationId, "BlobUploadRequest did not receive upload token for, %s.", fileName.c_str());
 
@@ -69,15 +119,21 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
 
     std::string BlobUriHandler::FindBlobUri(const std::string &fileName, const CorrelationId &correlationId)
     {
-        if (blobUriCache_.find(fileName) != blobUriCache_.end())
+        OptimizeCache();
+
+        auto it = blobUriCache_.find(fileName);
+        if (it != blobUriCache_.end())
         {
-            // Find the item from blobUriCache_, and remove it from the cache
-            // to keep the optimal size of cache. There is no chance to reuse
-            // the same item after being picked up.
-            std::string blobUri = blobUriCache_[fileName].BlobUri;
-            blobUriCache_.erase(fileName);
+            // The item stays in the cache until it expires or is evicted, so a retry of the
+            // same blob reuses the uri instead of requesting a new one.
+            if (IsUsable(it->second))
+            {
+                it->second.Fresh = false;
+                return it->second.BlobUri;
+            }
 
-            return blobUri;
+            LogTrace(correlationId, "The blob uri of %s expires soon, drop it.", fileName.c_str());
+            RemoveCacheItem(fileName);
         }
 
         LogTrace(correlationId, "%s is not found...", fileName.c_str());
@@ -85,29 +141,118 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         return std::string();
     }
 
-    void BlobUriHandler::OptimizeCache()
+    bool BlobUriHandler::IsUsable(const BlobUriCacheItem &item) const
     {
-        // Erase the oldest item from blobUriCache_.
-        if (blobUriCache_.size() > MaxCacheSize)
+        // A fresh uri was just issued for the upload waiting for it, so it is handed out even if the local clock
+        // makes it look expired, unless it waited for longer than the minimum remaining validity.
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (item.Fresh)
         {
-            std::map<std::string, BlobUriCacheItem>::iterator it = blobUriCache_.begin();
-            std::string key = it->second.FileName;
-            std::chrono::steady_clock::time_point timestamp = it->second.CreatedTime;
+            return item.ExpiryTime > now || now - item.CreatedTime < minRemainingValidity_;
+        }
 
-            while (it != blobUriCache_.end())
+        // A token issued with a short lifetime is reused for half of it.
+        std::chrono::steady_clock::duration minRemainingValidity = std::min(minRemainingValidity_, item.Lifetime / 2);
+        return item.Lifetime > std::chrono::steady_clock::duration::zero() &&
+               item.ExpiryTime > now + minRemainingValidity;
+    }
+
+    void BlobUriHandler::OptimizeCache()
+    {
+        // Drop expired items first, then the items expiring first while the cache is over capacity. An expired
+        // fresh item is kept while it can still be handed out.
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (auto indexIt = expiryIndex_.begin(); indexIt != expiryIndex_.end() && indexIt->first <= now;)
+        {
+            std::string key = indexIt->second;
+            ++indexIt;
+            if (!IsUsable(blobUriCache_.at(key)))
             {
-                assert(it != blobUriCache_.end());
-                if (timestamp > it->second.CreatedTime)
-                {
-                    key = it->second.FileName;
-                    timestamp = it->second.CreatedTime;
-                }
-                ++it;
+                RemoveCacheItem(key);
+                LogTrace("Remove expired item, %s, from the queue.", key.c_str());
             }
+        }
 
-            blobUriCache_.erase(key);
+        while (blobUriCache_.size() > cacheCapacity_)
+        {
+            std::string key = expiryIndex_.begin()->second;
+            RemoveCacheItem(key);
 
             LogTrace("Remove old item, %s, from the queue.", key.c_str());
         }
     }
-} // namespace microsoft::azure::connectedcar::fileuploadmodule
\ No newline at end of file
+
+    void BlobUriHandler::RemoveCacheItem(const std::string &fileName)
+    {
+        auto it = blobUriCache_.find(fileName);
+        if (it == blobUriCache_.end())
+        {
+            return;
+        }
+
+        auto [first, last] = expiryIndex_.equal_range(it->second.ExpiryTime);
+        for (auto indexIt = first; indexIt != last; ++indexIt)
+        {
+            if (indexIt->second == fileName)
+            {
+                expiryIndex_.erase(indexIt);
+                break;
+            }
+        }
+
+        blobUriCache_.erase(it);
+    }
+
+    std::optional<std::chrono::system_clock::time_point> BlobUriHandler::GetSasExpiryTime(const std::string &uri)
+    {
+        size_t queryStart = uri.find('?');
+        if (queryStart == std::string::npos)
+        {
+            return std::nullopt;
+        }
+
+        // Find the se parameter of the query, and decode its percent-encoded characters.
+        std::string encodedExpiry;
+        size_t parameterStart = queryStart + 1;
+        while (parameterStart < uri.size())
+        {
+            size_t parameterEnd = uri.find('&', parameterStart);
+            if (parameterEnd == std::string::npos)
+            {
+                parameterEnd = uri.size();
+            }
+
+            if (uri.compare(parameterStart, 3, "se=") == 0)
+            {
+                encodedExpiry = uri.substr(parameterStart + 3, parameterEnd - parameterStart - 3);
+                break;
+            }
+
+            parameterStart = parameterEnd + 1;
+        }
+
+        std::string expiry;
+        for (size_t i = 0; i < encodedExpiry.size(); i++)
+        {
+            if (encodedExpiry[i] == '%' && i + 2 < encodedExpiry.size())
+            {
+                expiry.push_back((char)strtol(encodedExpiry.substr(i + 1, 2).c_str(), nullptr, 16));
+                i += 2;
+            }
+            else
+            {
+                expiry.push_back(encodedExpiry[i]);
+            }
+        }
+
+        // The signed expiry is an ISO 8601 UTC time, or a date.
+        struct tm expiryTime = {};
+        if (expiry.empty() || (strptime(expiry.c_str(), "%Y-%m-%dT%H:%M:%S", &expiryTime) == nullptr &&
+                               strptime(expiry.c_str(), "%Y-%m-%d", &expiryTime) == nullptr))
+        {
+            return std::nullopt;
+        }
+
+        return std::chrono::system_clock::from_time_t(timegm(&expiryTime));
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -0,0 +1,260 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <logging.h>
+#include <sstream>
+#include <unistd.h>
+
+#include "include/block_manifest.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    static const std::string ManifestVersion = "FileUploadBlockManifest 1";
+    static const std::string ManifestExtension = ".manifest";
+    static const size_t MaxManifestFileNameLength = 200;
+
+    static std::string SerializeHeader(const BlockManifestHeader &header)
+    {
+        std::ostringstream stream;
+        stream << ManifestVersion << "\n"
+               << "UploadId=" << header.UploadId << "\n"
+               << "BlobPath=" << header.BlobPath << "\n"
+               << "FileSize=" << header.FileSize << "\n"
+               << "ModifiedTime=" << header.ModifiedTime << "\n"
+               << "BlockSize=" << header.BlockSize << "\n";
+
+        return stream.str();
+    }
+
+    static bool WriteAll(int fileDescriptor, const std::string &data)
+    {
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t result = write(fileDescriptor, data.data() + written, data.size() - written);
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            written += result;
+        }
+
+        return true;
+    }
+
+    BlockManifest::BlockManifest(const std::string &manifestDirectory, const BlockManifestHeader &header) :
+        manifestPath_(GetManifestPath(manifestDirectory, header.BlobPath)), header_(header)
+    {
+    }
+
+    BlockManifest::~BlockManifest()
+    {
+        if (fileDescriptor_ >= 0)
+        {
+            close(fileDescriptor_);
+        }
+    }
+
+    std::string BlockManifest::GetManifestPath(const std::string &manifestDirectory, const std::string &blobPath)
+    {
+        // Escape the blob path into a single file name so that different blob paths never
+        // share a manifest. Long names fall back to a hash, the header check rejects collisions.
+        std::string fileName;
+        for (unsigned char c : blobPath)
+        {
+            if (isalnum(c) || c == '.' || c == '-' || c == '_')
+            {
+                fileName.push_back(c);
+            }
+            else
+            {
+                char escaped[4];
+                snprintf(escaped, sizeof(escaped), "%%%02X", c);
+                fileName += escaped;
+            }
+        }
+
+        if (fileName.size() > MaxManifestFileNameLength)
+        {
+            std::ostringstream stream;
+            stream << std::hex << std::hash<std::string>{}(blobPath);
+            fileName = stream.str();
+        }
+
+        return manifestDirectory + "/" + fileName + ManifestExtension;
+    }
+
+    bool BlockManifest::Open()
+    {
+        std::scoped_lock<std::mutex> manifestLock(manifestMutex_);
+
+        try
+        {
+            boost::filesystem::create_directories(boost::filesystem::path(manifestPath_).parent_path());
+        }
+        catch (boost::filesystem::filesystem_error &e)
+        {
+            LogWarn("Failed to create the manifest directory, %s.", e.what());
+            return false;
+        }
+
+        if (!Load() && !Create())
+        {
+            return false;
+        }
+
+        fileDescriptor_ = open(manifestPath_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fileDescriptor_ < 0)
+        {
+            LogWarn("Failed to open the manifest, %s.", manifestPath_.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    bool BlockManifest::Load()
+    {
+        std::ifstream manifestFile(manifestPath_);
+        if (!manifestFile.is_open())
+        {
+            return false;
+        }
+
+        std::string expectedHeader = SerializeHeader(header_);
+        std::string header;
+        std::string line;
+        for (int i = 0; i < 6 && std::getline(manifestFile, line); i++)
+        {
+            header += line + "\n";
+        }
+
+        if (header != expectedHeader)
+        {
+            LogInfo("Discard the outdated block manifest of %s.", header_.BlobPath.c_str());
+            return false;
+        }
+
+        // A line can be partially written if the module stopped during an append, so
+        // anything that is not a complete block index is ignored.
+        while (std::getline(manifestFile, line))
+        {
+            try
+            {
+                size_t parsed = 0;
+                size_t blockIndex = std::stoull(line, &parsed);
+                if (parsed == line.size())
+                {
+                    uploadedBlocks_.insert(blockIndex);
+                }
+            }
+            catch (const std::exception &)
+            {
+                LogTrace("Skipped an invalid manifest entry of %s.", header_.BlobPath.c_str());
+            }
+        }
+
+        return true;
+    }
+
+    bool BlockManifest::Create()
+    {
+        uploadedBlocks_.clear();
+
+        // Write the header to a temporary file first, so a crash never leaves a manifest
+        // without a complete header behind.
+        std::string temporaryPath = manifestPath_ + ".tmp";
+        int fileDescriptor = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fileDescriptor < 0)
+        {
+            LogWarn("Failed to create the manifest, %s.", temporaryPath.c_str());
+            return false;
+        }
+
+        bool written = WriteAll(fileDescriptor, SerializeHeader(header_)) && fdatasync(fileDescriptor) == 0;
+        close(fileDescriptor);
+
+        if (!written || rename(temporaryPath.c_str(), manifestPath_.c_str()) != 0)
+        {
+            LogWarn("Failed to write the manifest, %s.", manifestPath_.c_str());
+            unlink(temporaryPath.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    bool BlockManifest::IsBlockUploaded(size_t blockIndex)
+    {
+        std::scoped_lock<std::mutex> manifestLock(manifestMutex_);
+        return uploadedBlocks_.find(blockIndex) != uploadedBlocks_.end();
+    }
+
+    void BlockManifest::MarkBlockUploaded(size_t blockIndex)
+    {
+        std::scoped_lock<std::mutex> manifestLock(manifestMutex_);
+
+        uploadedBlocks_.insert(blockIndex);
+        if (fileDescriptor_ < 0)
+        {
+            return;
+        }
+
+        if (!WriteAll(fileDescriptor_, std::to_string(blockIndex) + "\n"))
+        {
+            // The upload itself continues, only the ability to resume this block is lost.
+            LogWarn("Failed to record block %zu in the manifest, %s.", blockIndex, manifestPath_.c_str());
+            return;
+        }
+
+        unsynced_ = true;
+    }
+
+    void BlockManifest::Sync()
+    {
+        std::scoped_lock<std::mutex> manifestLock(manifestMutex_);
+        if (fileDescriptor_ < 0 || !unsynced_)
+        {
+            return;
+        }
+
+        unsynced_ = false;
+        if (fdatasync(fileDescriptor_) != 0)
+        {
+            LogWarn("Failed to sync the manifest, %s.", manifestPath_.c_str());
+        }
+    }
+
+    size_t BlockManifest::GetUploadedBlockCount()
+    {
+        std::scoped_lock<std::mutex> manifestLock(manifestMutex_);
+        return uploadedBlocks_.size();
+    }
+
+    void BlockManifest::Remove()
+    {
+        std::scoped_lock<std::mutex> manifestLock(manifestMutex_);
+
+        if (fileDescriptor_ >= 0)
+        {
+            close(fileDescriptor_);
+            fileDescriptor_ = -1;
+        }
+        unsynced_ = false;
+
+        unlink(manifestPath_.c_str());
+        uploadedBlocks_.clear();
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
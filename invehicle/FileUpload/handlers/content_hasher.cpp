@@ -0,0 +1,224 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cstring>
+
+#include "include/content_hasher.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    static const uint64_t C1 = 0x87c37b91114253d5ULL;
+    static const uint64_t C2 = 0x4cf5ad432745937fULL;
+
+    static inline uint64_t RotateLeft(uint64_t value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    static inline uint64_t FinalMix(uint64_t k)
+    {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+
+        return k;
+    }
+
+    static inline uint64_t ReadLittleEndian(const uint8_t *data)
+    {
+        // The module runs on little endian targets, x86_64 and aarch64.
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+
+        return value;
+    }
+
+    ContentHasher::ContentHasher(uint32_t seed) : h1_(seed), h2_(seed)
+    {
+    }
+
+    void ContentHasher::Update(const char *data, size_t size)
+    {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+        length_ += size;
+
+        if (tailSize_ > 0)
+        {
+            size_t fill = std::min(size, sizeof(tail_) - tailSize_);
+            memcpy(tail_ + tailSize_, bytes, fill);
+            tailSize_ += fill;
+            bytes += fill;
+            size -= fill;
+
+            if (tailSize_ < sizeof(tail_))
+            {
+                return;
+            }
+
+            MixBlock(tail_);
+            tailSize_ = 0;
+        }
+
+        for (; size >= sizeof(tail_); bytes += sizeof(tail_), size -= sizeof(tail_))
+        {
+            MixBlock(bytes);
+        }
+
+        memcpy(tail_, bytes, size);
+        tailSize_ = size;
+    }
+
+    void ContentHasher::Finish(uint8_t digest[16])
+    {
+        uint64_t k1 = 0;
+        uint64_t k2 = 0;
+        for (size_t i = 8; i < tailSize_; i++)
+        {
+            k2 ^= (uint64_t)tail_[i] << ((i - 8) * 8);
+        }
+        for (size_t i = 0; i < std::min<size_t>(tailSize_, 8); i++)
+        {
+            k1 ^= (uint64_t)tail_[i] << (i * 8);
+        }
+
+        if (tailSize_ > 8)
+        {
+            k2 *= C2;
+            k2 = RotateLeft(k2, 33);
+            k2 *= C1;
+            h2_ ^= k2;
+        }
+
+        if (tailSize_ > 0)
+        {
+            k1 *= C1;
+            k1 = RotateLeft(k1, 31);
+            k1 *= C2;
+            h1_ ^= k1;
+        }
+
+        h1_ ^= length_;
+        h2_ ^= length_;
+        h1_ += h2_;
+        h2_ += h1_;
+        h1_ = FinalMix(h1_);
+        h2_ = FinalMix(h2_);
+        h1_ += h2_;
+        h2_ += h1_;
+
+        memcpy(digest, &h1_, sizeof(h1_));
+        memcpy(digest + 8, &h2_, sizeof(h2_));
+    }
+
+    std::string ContentHasher::Finish()
+    {
+        static const char *digits = "0123456789abcdef";
+
+        uint8_t digest[16];
+        Finish(digest);
+
+        std::string hash;
+        for (uint8_t byte : digest)
+        {
+            hash.push_back(digits[byte >> 4]);
+            hash.push_back(digits[byte & 0x0F]);
+        }
+
+        return hash;
+    }
+
+    void ContentHasher::MixBlock(const uint8_t *block)
+    {
+        uint64_t k1 = ReadLittleEndian(block);
+        uint64_t k2 = ReadLittleEndian(block + 8);
+
+        k1 *= C1;
+        k1 = RotateLeft(k1, 31);
+        k1 *= C2;
+        h1_ ^= k1;
+
+        h1_ = RotateLeft(h1_, 27);
+        h1_ += h2_;
+        h1_ = h1_ * 5 + 0x52dce729;
+
+        k2 *= C2;
+        k2 = RotateLeft(k2, 33);
+        k2 *= C1;
+        h2_ ^= k2;
+
+        h2_ = RotateLeft(h2_, 31);
+        h2_ += h1_;
+        h2_ = h2_ * 5 + 0x38495ab5;
+    }
+
+    SegmentedContentHash::SegmentedContentHash(uint64_t size, uint64_t segmentSize) :
+        size_(size), segmentSize_(std::max<uint64_t>(segmentSize, 1)),
+        segmentHashes_(size == 0 ? 1 : (size_t)((size + segmentSize_ - 1) / segmentSize_))
+    {
+    }
+
+    size_t SegmentedContentHash::GetSegmentCount() const
+    {
+        return segmentHashes_.size();
+    }
+
+    void SegmentedContentHash::SetSegmentHash(size_t segmentIndex, const std::string &hash)
+    {
+        if (segmentIndex < segmentHashes_.size())
+        {
+            segmentHashes_[segmentIndex] = hash;
+        }
+    }
+
+    void SegmentedContentHash::Update(const char *data, size_t size)
+    {
+        while (size > 0 && offset_ < size_)
+        {
+            size_t segmentIndex = (size_t)(offset_ / segmentSize_);
+            uint64_t segmentEnd = std::min((segmentIndex + 1) * segmentSize_, size_);
+            size_t pieceSize = (size_t)std::min<uint64_t>(size, segmentEnd - offset_);
+
+            segmentHasher_.Update(data, pieceSize);
+            offset_ += pieceSize;
+            data += pieceSize;
+            size -= pieceSize;
+
+            if (offset_ == segmentEnd)
+            {
+                segmentHashes_[segmentIndex] = segmentHasher_.Finish();
+                segmentHasher_ = ContentHasher();
+            }
+        }
+    }
+
+    std::string SegmentedContentHash::Finish()
+    {
+        if (size_ == 0 && segmentHashes_[0].empty())
+        {
+            segmentHashes_[0] = segmentHasher_.Finish();
+        }
+
+        if (segmentHashes_.size() == 1)
+        {
+            return segmentHashes_[0];
+        }
+
+        ContentHasher combinedHasher;
+        for (const std::string &segmentHash : segmentHashes_)
+        {
+            if (segmentHash.empty())
+            {
+                return std::string();
+            }
+            combinedHasher.Update(segmentHash.data(), segmentHash.size());
+        }
+
+        return combinedHasher.Finish();
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -0,0 +1,178 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <cstring>
+
+#include "include/crc64.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    static const uint64_t Polynomial = 0x9A6C9329AC4BC9B5ULL;
+
+    /**
+     * @brief Lookup tables to process eight bytes per step. Table 0 holds the CRC of each byte value,
+     * and table n the CRC of a byte followed by n zero bytes.
+     */
+    struct Crc64Tables
+    {
+        uint64_t Values[8][256];
+
+        Crc64Tables()
+        {
+            for (uint64_t byte = 0; byte < 256; byte++)
+            {
+                uint64_t crc = byte;
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    crc = (crc & 1) ? (crc >> 1) ^ Polynomial : crc >> 1;
+                }
+                Values[0][byte] = crc;
+            }
+
+            for (int table = 1; table < 8; table++)
+            {
+                for (size_t byte = 0; byte < 256; byte++)
+                {
+                    uint64_t crc = Values[table - 1][byte];
+                    Values[table][byte] = (crc >> 8) ^ Values[0][crc & 0xFF];
+                }
+            }
+        }
+    };
+
+    static const Crc64Tables Tables;
+
+    /**
+     * @brief Multiply a 64x64 matrix over GF(2), given as its columns, with a vector
+     */
+    static uint64_t MultiplyMatrix(const uint64_t *matrix, uint64_t vector)
+    {
+        uint64_t result = 0;
+        for (; vector != 0; vector >>= 1, matrix++)
+        {
+            if (vector & 1)
+            {
+                result ^= *matrix;
+            }
+        }
+
+        return result;
+    }
+
+    static void SquareMatrix(uint64_t *square, const uint64_t *matrix)
+    {
+        for (int column = 0; column < 64; column++)
+        {
+            square[column] = MultiplyMatrix(matrix, matrix[column]);
+        }
+    }
+
+    void Crc64::Update(const char *data, size_t size)
+    {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+        uint64_t crc = ~crc_;
+        length_ += size;
+
+        // The module runs on little endian targets, x86_64 and aarch64.
+        for (; size >= 8; bytes += 8, size -= 8)
+        {
+            uint64_t value;
+            memcpy(&value, bytes, sizeof(value));
+            crc ^= value;
+            crc = Tables.Values[7][crc & 0xFF] ^ Tables.Values[6][(crc >> 8) & 0xFF] ^
+                  Tables.Values[5][(crc >> 16) & 0xFF] ^ Tables.Values[4][(crc >> 24) & 0xFF] ^
+                  Tables.Values[3][(crc >> 32) & 0xFF] ^ Tables.Values[2][(crc >> 40) & 0xFF] ^
+                  Tables.Values[1][(crc >> 48) & 0xFF] ^ Tables.Values[0][crc >> 56];
+        }
+
+        for (; size > 0; bytes++, size--)
+        {
+            crc = (crc >> 8) ^ Tables.Values[0][(crc ^ *bytes) & 0xFF];
+        }
+
+        crc_ = ~crc;
+    }
+
+    uint64_t Crc64::GetValue() const
+    {
+        return crc_;
+    }
+
+    uint64_t Crc64::GetLength() const
+    {
+        return length_;
+    }
+
+    uint64_t Crc64::Combine(uint64_t first, uint64_t second, uint64_t secondLength)
+    {
+        // Appending the second range shifts the first CRC by its length in zero bytes, which is applied with
+        // operator matrices for 2^n zero bits, squared up from one zero bit (the zlib crc32_combine approach).
+        if (secondLength == 0)
+        {
+            return first;
+        }
+
+        uint64_t even[64];
+        uint64_t odd[64];
+
+        odd[0] = Polynomial;
+        for (int column = 1; column < 64; column++)
+        {
+            odd[column] = 1ULL << (column - 1);
+        }
+
+        SquareMatrix(even, odd);
+        SquareMatrix(odd, even);
+
+        do
+        {
+            SquareMatrix(even, odd);
+            if (secondLength & 1)
+            {
+                first = MultiplyMatrix(even, first);
+            }
+            secondLength >>= 1;
+            if (secondLength == 0)
+            {
+                break;
+            }
+
+            SquareMatrix(odd, even);
+            if (secondLength & 1)
+            {
+                first = MultiplyMatrix(odd, first);
+            }
+            secondLength >>= 1;
+        } while (secondLength != 0);
+
+        return first ^ second;
+    }
+
+    std::string Crc64::Encode(uint64_t crc)
+    {
+        static const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        // Eight bytes are two full groups of three bytes and a group of two, padded with one '='.
+        uint8_t bytes[9] = {};
+        for (int index = 0; index < 8; index++)
+        {
+            bytes[index] = (uint8_t)(crc >> (8 * index));
+        }
+
+        std::string encoded;
+        for (int index = 0; index < 9; index += 3)
+        {
+            uint32_t group = ((uint32_t)bytes[index] << 16) | ((uint32_t)bytes[index + 1] << 8) | bytes[index + 2];
+            encoded.push_back(alphabet[(group >> 18) & 0x3F]);
+            encoded.push_back(alphabet[(group >> 12) & 0x3F]);
+            encoded.push_back(alphabet[(group >> 6) & 0x3F]);
+            encoded.push_back(alphabet[group & 0x3F]);
+        }
+        encoded.back() = '=';
+
+        return encoded;
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
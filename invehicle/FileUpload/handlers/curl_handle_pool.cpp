@@ -0,0 +1,152 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <logging.h>
+
+#include "include/curl_handle_pool.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    CurlHandlePool::CurlHandlePool(size_t maxIdleHandles) : maxIdleHandles_(maxIdleHandles)
+    {
+        // curl_global_init is not thread safe, so it must run before any upload worker creates a handle.
+        static std::once_flag curlInitFlag;
+        std::call_once(curlInitFlag, []() { curl_global_init(CURL_GLOBAL_ALL); });
+
+        share_ = curl_share_init();
+        if (share_)
+        {
+            curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, LockShare);
+            curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, UnlockShare);
+            curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        }
+        else
+        {
+            LogWarn("Can't initialize cUrl share instance. Connections will not be shared between handles.");
+        }
+    }
+
+    CurlHandlePool::~CurlHandlePool()
+    {
+        for (CURL *curl : idleHandles_)
+        {
+            curl_easy_cleanup(curl);
+        }
+
+        if (share_)
+        {
+            curl_share_cleanup(share_);
+        }
+    }
+
+    void CurlHandlePool::LockShare(CURL *curl, curl_lock_data data, curl_lock_access access, void *pool)
+    {
+        static_cast<CurlHandlePool *>(pool)->shareMutexes_[data].lock();
+    }
+
+    void CurlHandlePool::UnlockShare(CURL *curl, curl_lock_data data, void *pool)
+    {
+        static_cast<CurlHandlePool *>(pool)->shareMutexes_[data].unlock();
+    }
+
+    CURL *CurlHandlePool::Acquire()
+    {
+        CURL *curl = nullptr;
+        {
+            std::scoped_lock<std::mutex> poolLock(poolMutex_);
+            if (!idleHandles_.empty())
+            {
+                curl = idleHandles_.back();
+                idleHandles_.pop_back();
+            }
+        }
+
+        if (curl)
+        {
+            // Reset clears the options of the previous request, the live connections
+            // and caches of the handle are kept.
+            curl_easy_reset(curl);
+        }
+        else
+        {
+            curl = curl_easy_init();
+            if (!curl)
+            {
+                LogError("Can't initialize cUrl instance.");
+                return nullptr;
+            }
+        }
+
+        if (share_)
+        {
+            curl_easy_setopt(curl, CURLOPT_SHARE, share_);
+        }
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, KeepAliveIdleInSeconds);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, KeepAliveIdleInSeconds);
+
+        return curl;
+    }
+
+    void CurlHandlePool::Release(CURL *curl)
+    {
+        if (!curl)
+        {
+            return;
+        }
+
+        {
+            std::scoped_lock<std::mutex> poolLock(poolMutex_);
+            if (idleHandles_.size() < maxIdleHandles_)
+            {
+                idleHandles_.push_back(curl);
+                return;
+            }
+        }
+
+        curl_easy_cleanup(curl);
+    }
+
+    void CurlHandlePool::RecordTransfer(CURL *curl)
+    {
+        long connects = 0;
+        curl_off_t appConnectTime = 0;
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appConnectTime);
+
+        requests_++;
+        newConnections_ += connects;
+        if (connects > 0 && appConnectTime > 0)
+        {
+            tlsHandshakes_++;
+        }
+    }
+
+    void CurlHandlePool::RecordFileLatency(std::chrono::steady_clock::duration latency)
+    {
+        files_++;
+        totalFileLatencyInUs_ += std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    }
+
+    CurlHandlePoolStatistics CurlHandlePool::GetStatistics() const
+    {
+        CurlHandlePoolStatistics statistics;
+        statistics.Requests = requests_;
+        statistics.NewConnections = newConnections_;
+        statistics.TlsHandshakes = tlsHandshakes_;
+        statistics.ReusedConnections =
+            statistics.Requests > statistics.NewConnections ? statistics.Requests - statistics.NewConnections : 0;
+        statistics.Files = files_;
+        statistics.AverageFileLatencyInMs =
+            statistics.Files > 0 ? totalFileLatencyInUs_ / 1000.0 / statistics.Files : 0;
+
+        return statistics;
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -0,0 +1,223 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef BANDWIDTH_GOVERNOR_H
+#define BANDWIDTH_GOVERNOR_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+#include "file_upload_settings.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Upload bandwidth limits, set from the settings and changed by bandwidth limits messages
+     */
+    struct BandwidthLimits
+    {
+        // Upload rate of all transfers together, 0 is unlimited.
+        uint64_t LimitInBytesPerSecond = 0;
+
+        // Weight of the share of the rate of each request priority. Priorities without a weight weigh 1.
+        std::map<int, unsigned int> PriorityWeights;
+
+        // Message type of a bandwidth limits message. Its payload has the optional properties
+        // LimitInBytesPerSecond and PriorityWeights, a JSON object of weights by priority.
+        static inline const std::string MessageType = "FileUploadBandwidthLimits";
+        static inline const std::string LimitProperty = "LimitInBytesPerSecond";
+        static inline const std::string PriorityWeightsProperty = "PriorityWeights";
+    };
+
+    /**
+     * @brief Upload rate achieved by the transfers of a request priority
+     */
+    struct BandwidthClassMetrics
+    {
+        int Priority = 0;
+        unsigned int Weight = 0;
+        size_t ActiveTransfers = 0;
+        uint64_t BytesSent = 0;
+        uint64_t RateInBytesPerSecond = 0;
+
+        // Reads of the transfers that were paused because the priority had no tokens left.
+        uint64_t ThrottledCount = 0;
+    };
+
+    /**
+     * @brief Process-wide upload bandwidth governor. Every request priority with transfers in flight has a token
+     * bucket, and the limit refills the buckets in proportion to their weights. The share of a bucket that is full
+     * goes to the other buckets, so the limit is used up as long as any transfer has data to send. Transfers take
+     * tokens for the data they read on the upload engine thread, while the limits can be changed and the metrics
+     * read from any thread.
+     */
+    class BandwidthGovernor
+    {
+      public:
+        /**
+         * @brief Construct BandwidthGovernor object
+         *
+         * @param settings File upload settings with the bandwidth limit and the priority weights
+         */
+        explicit BandwidthGovernor(const FileUploadSettings &settings = FileUploadSettings());
+
+        /**
+         * @brief Get the current limits
+         *
+         * @return the bandwidth limits
+         */
+        BandwidthLimits GetLimits() const;
+
+        /**
+         * @brief Replace the limits. Transfers pick up the new limits with their next turn.
+         *
+         * @param limits The bandwidth limits
+         */
+        void SetLimits(const BandwidthLimits &limits);
+
+        /**
+         * @brief Change the limits set by a bandwidth limits message. Limits the message doesn't have are kept.
+         *
+         * @param payload The JSON payload of the message, see BandwidthLimits::MessageType
+         *
+         * @return the bandwidth limits in effect
+         */
+        BandwidthLimits UpdateLimits(const std::string &payload);
+
+        /**
+         * @brief Register a transfer in flight, so its priority gets a share of the limit
+         *
+         * @param priority Priority of the upload request of the transfer
+         */
+        void AddTransfer(int priority);
+
+        /**
+         * @brief Unregister a finished transfer
+         *
+         * @param priority Priority of the upload request of the transfer
+         */
+        void RemoveTransfer(int priority);
+
+        /**
+         * @brief Take tokens for data a transfer is about to send. A transfer gets at most its fair share of
+         * the bucket of its priority, so the other transfers of the priority get tokens as well.
+         *
+         * @param priority Priority of the upload request of the transfer
+         * @param length Bytes the transfer wants to send
+         *
+         * @return bytes the transfer may send, 0 if it must pause until its priority has tokens again
+         */
+        size_t Acquire(int priority, size_t length);
+
+        /**
+         * @brief Give back tokens a transfer acquired but didn't send, such as after a short read
+         *
+         * @param priority Priority of the upload request of the transfer
+         * @param length Bytes acquired but not sent
+         */
+        void Release(int priority, size_t length);
+
+        /**
+         * @brief Check if a paused transfer can send again
+         *
+         * @param priority Priority of the upload request of the transfer
+         *
+         * @return true if the priority has tokens for a read
+         */
+        bool CanResume(int priority);
+
+        /**
+         * @brief Get the time until a paused transfer can send again, at the current share of its priority
+         *
+         * @param priority Priority of the upload request of the transfer
+         *
+         * @return the time until the priority has tokens for a read
+         */
+        std::chrono::milliseconds GetResumeDelay(int priority);
+
+        /**
+         * @brief Get the achieved upload rate of each priority that sent data
+         *
+         * @return the metrics by priority
+         */
+        std::vector<BandwidthClassMetrics> GetMetrics();
+
+        /**
+         * @brief Parse priority weights
+         *
+         * @param weights JSON object of weights by priority, like {"0": 4, "1": 2}
+         *
+         * @return the weights by priority
+         */
+        static std::map<int, unsigned int> ParsePriorityWeights(const nlohmann::json &weights);
+
+      private:
+        /**
+         * @brief Token bucket and counters of a request priority
+         */
+        struct BandwidthClass
+        {
+            double Tokens = 0;
+            size_t ActiveTransfers = 0;
+            uint64_t BytesSent = 0;
+            uint64_t WindowBytes = 0;
+            uint64_t RateInBytesPerSecond = 0;
+            uint64_t ThrottledCount = 0;
+        };
+
+        /**
+         * @brief Hand out the tokens accrued since the last refill. The caller must hold governorMutex_.
+         *
+         * @param now The current time
+         */
+        void Refill(std::chrono::steady_clock::time_point now);
+
+        /**
+         * @brief Update the rates once the rate window elapsed. The caller must hold governorMutex_.
+         *
+         * @param now The current time
+         */
+        void UpdateRates(std::chrono::steady_clock::time_point now);
+
+        /**
+         * @brief Get the weight of a priority. The caller must hold governorMutex_.
+         *
+         * @param priority The request priority
+         *
+         * @return the weight
+         */
+        unsigned int GetWeight(int priority) const;
+
+        /**
+         * @brief Get the size of a token bucket. The caller must hold governorMutex_.
+         *
+         * @return the bucket size in bytes
+         */
+        double GetBucketSize() const;
+
+        mutable std::mutex governorMutex_;
+        BandwidthLimits limits_;
+        std::map<int, BandwidthClass> classes_;
+        std::chrono::steady_clock::time_point lastRefillTime_;
+        std::chrono::steady_clock::time_point rateWindowStartTime_;
+
+        // A bucket holds the tokens of this much time at the limit, so a burst stays short.
+        const double BurstInSeconds = 0.1;
+
+        // A read takes at least this many tokens unless less data is left, so a tight limit doesn't
+        // turn into tiny reads and requests.
+        const size_t MinReadInBytes = 16 * 1024;
+
+        const std::chrono::seconds RateWindow = std::chrono::seconds(5);
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // BANDWIDTH_GOVERNOR_H
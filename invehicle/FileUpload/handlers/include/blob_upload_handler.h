@@ -8,23 +8,291 @@
 #define BLOB_UPLOAD_HANDLER_H
 
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block_manifest.h"
+#include "curl_handle_pool.h"
+#include "file_upload_settings.h"
+#include "stream_compressor.h"
+#include "tar_pack_stream.h"
+#include "upload_engine.h"
 
 namespace microsoft::azure::connectedcar::fileuploadmodule
 {
+    /**
+     * @brief Final upload state of a blob
+     */
+    struct BlobUploadResult
+    {
+        bool Succeeded = false;
+        uint64_t FileSize = 0;
+
+        // Content hash of the file read for the upload, see SegmentedContentHash. Empty for packs, uploads
+        // without content hashing, failed uploads, and resumed uploads whose earlier blocks were not read again.
+        std::string ContentHash;
+
+        // CRC64 of the blob content as stored, compressed if the blob is compressed, encoded like the
+        // x-ms-content-crc64 header. Empty for failed uploads, and resumed uploads whose earlier blocks
+        // were not read again.
+        std::string ContentCrc64;
+    };
+
+    /**
+     * @brief Called on the upload engine thread with the final upload state of a blob
+     */
+    using UploadCompletionHandler = std::function<void(const BlobUploadResult &result)>;
+
+    struct BlobUploadOperation;
+
     class BlobUploadHandler
     {
       public:
         /**
-         * @brief Upload blob request by Upload Processor
+         * @brief Construct BlobUploadHandler object
+         *
+         * @param settings File upload settings for block size and parallelism
+         */
+        explicit BlobUploadHandler(const FileUploadSettings &settings = FileUploadSettings());
+
+        /**
+         * @brief Destructor. Stops the upload engine while the state its completions use still exists.
+         */
+        ~BlobUploadHandler();
+
+        /**
+         * @brief Stop the manifest thread and the upload engine. Uploads that didn't complete fail through their
+         * completion handler.
+         */
+        void Stop();
+
+        /**
+         * @brief Start uploading a blob by Upload Processor. The upload runs on the upload engine
+         * and the completion handler is called once the blob is uploaded or failed.
          *
          * @param fileName Upload file name
          * @param uri Blob uri string with access token
+         * @param uploadId Upload id of the request, used to resume block uploads
+         * @param blobPath Destination blob path, used to resume block uploads
+         * @param compression Content encoding to compress the file with, see CompressionNames
+         * @param priority Priority of the upload request, which the bandwidth governor shares the upload rate by
+         * @param hashContent Compute the content hash of the file while it is read, see BlobUploadResult
+         * @param onComplete Completion handler with the upload state
+         */
+        void UploadBlobAsync(
+            const std::string &fileName,
+            const std::string &uri,
+            const std::string &uploadId,
+            const std::string &blobPath,
+            const std::string &compression,
+            int priority,
+            bool hashContent,
+            UploadCompletionHandler onComplete);
+
+        /**
+         * @brief Start uploading several files as one tar pack blob, see TarPackStream. The pack is streamed
+         * from the files, and the completion handler is called once the whole pack is uploaded or failed.
+         *
+         * @param entries The files to pack
+         * @param uri Blob uri string with access token
+         * @param uploadId Upload id of the request
+         * @param blobPath Destination blob path of the pack
+         * @param compression Content encoding to compress the pack with, see CompressionNames
+         * @param priority Priority of the upload request, which the bandwidth governor shares the upload rate by
+         * @param onComplete Completion handler with the upload state of the pack
+         */
+        void UploadPackAsync(
+            std::vector<PackEntry> entries,
+            const std::string &uri,
+            const std::string &uploadId,
+            const std::string &blobPath,
+            const std::string &compression,
+            int priority,
+            UploadCompletionHandler onComplete);
+
+        /**
+         * @brief Compute the content hash of a file the way an upload of the file computes it, by reading the
+         * file on the calling thread
+         *
+         * @param fileName Name of the file
+         * @param fileSize Set to the size of the file
+         * @param contentHash Set to the content hash of the file
+         *
+         * @return false if the file could not be read
+         */
+        bool ComputeContentHash(const std::string &fileName, uint64_t &fileSize, std::string &contentHash) const;
+
+        /**
+         * @brief Set the directory to keep block manifests of resumable uploads
+         *
+         * @param hostDataContainerPath container data path
+         */
+        void SetManifestDirectory(const std::string &hostDataContainerPath);
+
+        /**
+         * @brief Discard the block upload progress of a blob that will not be retried
+         *
+         * @param blobPath Destination blob path
+         */
+        void DiscardProgress(const std::string &blobPath);
+
+        /**
+         * @brief Set the bandwidth governor that limits the upload rate
+         *
+         * @param bandwidthGovernor The bandwidth governor
+         */
+        void SetBandwidthGovernor(const std::shared_ptr<BandwidthGovernor> &bandwidthGovernor);
+
+      private:
+        /**
+         * @brief Work on a block manifest, run on the manifest thread
+         */
+        struct ManifestTask
+        {
+            std::shared_ptr<BlockManifest> Manifest;
+            std::function<void()> Run;
+        };
+
+        /**
+         * @brief Manifest thread loop. Runs the queued manifest tasks in batches, and syncs every manifest
+         * the batch wrote to once, until the handler stops.
+         */
+        void RunManifestTasks();
+
+        /**
+         * @brief Queue work on a block manifest for the manifest thread, so the upload engine thread never
+         * waits for the disk. Once the handler stopped, the work runs on the calling thread.
+         *
+         * @param manifest The block manifest
+         * @param run The work
+         */
+        void PostManifestTask(const std::shared_ptr<BlockManifest> &manifest, std::function<void()> run);
+
+        /**
+         * @brief Open the file and submit its first requests. Runs on the upload engine thread.
+         *
+         * @param operation The blob upload operation
+         */
+        void StartUpload(const std::shared_ptr<BlobUploadOperation> &operation);
+
+        /**
+         * @brief Start uploading a compressed file or a pack, whose blocks are produced while it is read.
+         * Runs on the upload engine thread.
+         *
+         * @param operation The blob upload operation
+         */
+        void StartStreamedUpload(const std::shared_ptr<BlobUploadOperation> &operation);
+
+        /**
+         * @brief Submit pending blocks while block slots of the operation are free, and commit the
+         * block list once every block is uploaded. Runs on the upload engine thread.
+         *
+         * @param operation The blob upload operation
+         */
+        void SubmitNextBlocks(const std::shared_ptr<BlobUploadOperation> &operation);
+
+        /**
+         * @brief Read and compress the next piece of the file or pack, and submit the blocks it completed.
+         * The stream is read in pieces, so transfers of other files progress in between. Runs on the
+         * upload engine thread.
          *
-         * @return True/flase of upload state
+         * @param operation The blob upload operation
          */
-        bool UploadBlob(const std::string &fileName, const std::string &uri);
+        void StreamNextPiece(const std::shared_ptr<BlobUploadOperation> &operation);
+
+        /**
+         * @brief Submit a Put Blob request with the buffered stream. Runs on the upload engine thread.
+         *
+         * @param operation The blob upload operation
+         */
+        void SubmitStreamedBlob(const std::shared_ptr<BlobUploadOperation> &operation);
+
+        /**
+         * @brief Get the headers describing the content encoding of a compressed blob and the index of a pack
+         *
+         * @param operation The blob upload operation
+         * @param commit Whether the headers are sent with Put Block List rather than Put Blob
+         *
+         * @return the blob property and metadata headers, empty if the blob is neither compressed nor a pack
+         */
+        std::vector<std::string> GetStreamHeaders(const std::shared_ptr<BlobUploadOperation> &operation, bool commit)
+            const;
+
+        /**
+         * @brief Submit a Put Block request. Runs on the upload engine thread.
+         *
+         * @param operation The blob upload operation
+         * @param blockIndex Index of the block in the file
+         * @param attempt Number of earlier attempts of this block
+         */
+        void SubmitBlock(const std::shared_ptr<BlobUploadOperation> &operation, size_t blockIndex, unsigned int attempt);
+
+        /**
+         * @brief Submit the Put Block List request. Runs on the upload engine thread.
+         *
+         * @param operation The blob upload operation
+         */
+        void CommitBlockList(const std::shared_ptr<BlobUploadOperation> &operation);
+
+        /**
+         * @brief Finish the operation and call its completion handler. Runs on the upload engine thread.
+         *
+         * @param operation The blob upload operation
+         * @param uploadResult Final upload state
+         */
+        void CompleteUpload(const std::shared_ptr<BlobUploadOperation> &operation, bool uploadResult);
+
+        /**
+         * @brief Get the block size for a file, grown if needed to stay within the maximum block count
+         *
+         * @param fileSize Size of the upload file in bytes
+         *
+         * @return block size in bytes
+         */
+        uint64_t GetBlockSize(uint64_t fileSize) const;
+
+        /**
+         * @brief Get the segment size of the content hash of a file, the block size of a file uploaded in blocks,
+         * so every block hashes one segment, or the whole file otherwise. Compressed files are hashed with the
+         * layout of their uncompressed upload, so the content hash only depends on the file and the settings.
+         *
+         * @param fileSize Size of the file in bytes
+         *
+         * @return segment size in bytes
+         */
+        uint64_t GetHashSegmentSize(uint64_t fileSize) const;
+
+        FileUploadSettings settings_;
+        std::string manifestDirectory_;
+
+        // The engine must be destroyed before the pool its transfers take handles from.
+        CurlHandlePool curlHandlePool_;
+        UploadEngine uploadEngine_;
+
+        // Block manifests are opened, written and synced on the manifest thread.
+        std::mutex manifestMutex_;
+        std::condition_variable manifestCondition_;
+        std::deque<ManifestTask> manifestTasks_;
+        bool manifestStopping_ = false;
+        std::thread manifestThread_;
+
+        const unsigned int BlockUploadRetries = 3;
+        const uint64_t MaxBlockCount = 50000;
+        const std::string ManifestDirectoryName = ".upload-manifests";
+
+        // Compressed files and packs are read and compressed in pieces of this size per engine task.
+        const uint64_t StreamPieceInBytes = 256 * 1024;
+
+        // Files are hashed for ComputeContentHash in reads of this size.
+        const size_t HashReadSizeInBytes = 1024 * 1024;
     };
 } // namespace microsoft::azure::connectedcar::fileuploadmodule
 
-#endif
\ No newline at end of file
+#endif
@@ -8,11 +8,15 @@
 #define BLOB_URI_HANDLER_H
 
 #include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string.h>
+#include <threading_utils.h>
 
 #include "correlation_id.h"
 
@@ -27,15 +31,29 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         std::string FileName;
         std::string BlobUri;
         std::chrono::steady_clock::time_point CreatedTime;
+
+        // Lifetime of the token measured by the local clock when the uri arrived, and the expiry time it gives,
+        // so a later jump of the local clock doesn't change it.
+        std::chrono::steady_clock::duration Lifetime;
+        std::chrono::steady_clock::time_point ExpiryTime;
+
+        // Whether the uri was not handed out yet. A fresh uri is used for the upload it was requested for,
+        // even if the local clock makes its token look expired, see BlobUriHandler::IsUsable.
+        bool Fresh = true;
     };
 
     class BlobUriHandler
     {
       public:
         /**
-         * @brief Default constructor
+         * @brief Construct BlobUriHandler object
+         *
+         * @param cacheCapacity Maximum number of blob uris kept in the cache
+         * @param minRemainingValidity Validity a cached uri must have left to be reused
          */
-        BlobUriHandler() = default;
+        explicit BlobUriHandler(
+            size_t cacheCapacity = DefaultCacheCapacity,
+            std::chrono::seconds minRemainingValidity = DefaultMinRemainingValidity);
 
         /**
          * @brief Virtual destructor
@@ -43,7 +61,8 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         virtual ~BlobUriHandler() = default;
 
         /**
-         * @brief Add blob uri from Cloud2Device(command module) to blob uri cache
+         * @brief Add blob uri from Cloud2Device(command module) to blob uri cache, and wake up
+         * the upload processor waiting for it
          *
          * @param fileName upload file name
          * @param uri blob uri with access token
@@ -52,27 +71,77 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         void AddBlobUri(const std::string &fileName, const std::string &uri, const CorrelationId &correlationId);
 
         /**
-         * @brief Wait blob uri call by upload processor
+         * @brief Check whether the cache holds a fresh blob uri, or a used one that is still valid long enough to
+         * upload with again
+         *
+         * @param fileName upload file name
+         *
+         * @return true if a valid blob uri is cached
+         */
+        bool HasValidBlobUri(const std::string &fileName);
+
+        /**
+         * @brief Wait blob uri call by upload processor. Returns as soon as the uri is added.
          *
          * @param fileName upload file name
          * @param seconds wait for blob uri
          * @param correlationId The correlation id
+         * @param cancellationToken Stops waiting once cancellation is requested
          *
-         * @return blob uri string
+         * @return blob uri string, or an empty string on timeout or cancellation
+         */
+        std::string WaitForBlobUri(
+            const std::string &fileName,
+            int seconds,
+            const CorrelationId &correlationId,
+            const CancellationToken::Ptr &cancellationToken = nullptr);
+
+        /**
+         * @brief Get the expiry time of a SAS uri from its signed expiry (se) parameter
+         *
+         * @param uri blob uri with access token
+         *
+         * @return the expiry time, or std::nullopt if the uri has no valid se parameter
          */
-        std::string WaitForBlobUri(const std::string &fileName, int seconds, const CorrelationId &correlationId);
+        static std::optional<std::chrono::system_clock::time_point> GetSasExpiryTime(const std::string &uri);
+
+        static const size_t DefaultCacheCapacity = 64;
+        static constexpr std::chrono::seconds DefaultMinRemainingValidity = std::chrono::minutes(5);
 
       protected:
         std::map<std::string, BlobUriCacheItem> blobUriCache_;
 
+        // Cache keys ordered by the expiry time of their uri, to evict and expire entries without a scan.
+        std::multimap<std::chrono::steady_clock::time_point, std::string> expiryIndex_;
+        std::mutex cacheMutex_;
+
       private:
         /**
-         * @brief Optimize BlobUri Cache. Delete old uri if the size of cache is bigger than MaxCacheSize
+         * @brief Optimize BlobUri Cache. Drop expired uris that were handed out, and the uris expiring first
+         * while the size of the cache is bigger than the capacity. The caller must hold cacheMutex_.
          */
         void OptimizeCache();
 
         /**
-         * @brief Find blob uri from blob uri cache
+         * @brief Remove a cache entry and its expiry index entry. The caller must hold cacheMutex_.
+         *
+         * @param fileName upload file name
+         */
+        void RemoveCacheItem(const std::string &fileName);
+
+        /**
+         * @brief Check whether a uri can be handed out. A fresh uri can be until it expired and waited for the
+         * minimum remaining validity. A used uri must stay valid for at least the minimum remaining validity, or
+         * half of its lifetime if that is shorter. The caller must hold cacheMutex_.
+         *
+         * @param item The cache item of the uri
+         *
+         * @return true if the uri can be used
+         */
+        bool IsUsable(const BlobUriCacheItem &item) const;
+
+        /**
+         * @brief Find a fresh or valid blob uri from blob uri cache. The caller must hold cacheMutex_.
          *
          * @param fileName upload file name
          * @param correlationId The correlation id
@@ -81,9 +150,19 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
          */
         std::string FindBlobUri(const std::string &fileName, const CorrelationId &correlationId);
 
-        const unsigned int MaxCacheSize = 10;
-        const int BlobCacheLookupSleep = 2;
+        std::condition_variable blobUriAdded_;
+        size_t cacheCapacity_;
+
+        // A used uri is only handed out again while it stays valid for at least this long, so an upload
+        // doesn't start with a token that expires midway.
+        std::chrono::steady_clock::duration minRemainingValidity_;
+
+        // The cancellation token can't notify the waiter, so it is checked at this interval.
+        const int CancellationCheckIntervalInMs = 500;
+
+        // Lifetime assumed for a uri without a signed expiry.
+        const std::chrono::minutes DefaultUriLifetime = std::chrono::minutes(60);
     };
 } // namespace microsoft::azure::connectedcar::fileuploadmodule
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,126 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef BLOCK_MANIFEST_H
+#define BLOCK_MANIFEST_H
+
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief The identity of a block upload. A manifest is only resumed when all fields match,
+     * so a changed file or block size always restarts the upload from the first block.
+     */
+    struct BlockManifestHeader
+    {
+        std::string UploadId;
+        std::string BlobPath;
+        uint64_t FileSize = 0;
+        int64_t ModifiedTime = 0;
+        uint64_t BlockSize = 0;
+    };
+
+    /**
+     * @brief On-disk record of the blocks of a file that were already uploaded with Put Block.
+     * Each uploaded block is appended to the manifest file, and synced by Sync, so the progress
+     * survives retries and module restarts.
+     */
+    class BlockManifest
+    {
+      public:
+        /**
+         * @brief Construct BlockManifest object
+         *
+         * @param manifestDirectory Directory to keep manifest files
+         * @param header Identity of the block upload
+         */
+        BlockManifest(const std::string &manifestDirectory, const BlockManifestHeader &header);
+
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~BlockManifest();
+
+        /**
+         * @brief Load the uploaded blocks of an existing manifest, or create a new manifest
+         * if none exists or the existing one belongs to a different upload.
+         *
+         * @return True/false of manifest open state
+         */
+        bool Open();
+
+        /**
+         * @brief Check if a block was already uploaded
+         *
+         * @param blockIndex Index of the block in the file
+         *
+         * @return True/false of block upload state
+         */
+        bool IsBlockUploaded(size_t blockIndex);
+
+        /**
+         * @brief Record an uploaded block in the manifest. The record is written but not synced.
+         *
+         * @param blockIndex Index of the block in the file
+         */
+        void MarkBlockUploaded(size_t blockIndex);
+
+        /**
+         * @brief Sync the records written since the last sync, so several records cost one sync
+         */
+        void Sync();
+
+        /**
+         * @brief Get the number of blocks already uploaded
+         *
+         * @return count of uploaded blocks
+         */
+        size_t GetUploadedBlockCount();
+
+        /**
+         * @brief Delete the manifest file once the block list is committed or the upload is abandoned
+         */
+        void Remove();
+
+        /**
+         * @brief Get the manifest file path for a blob
+         *
+         * @param manifestDirectory Directory to keep manifest files
+         * @param blobPath Destination blob path
+         *
+         * @return manifest file path string
+         */
+        static std::string GetManifestPath(const std::string &manifestDirectory, const std::string &blobPath);
+
+      private:
+        /**
+         * @brief Read the manifest file and load uploaded blocks if the header matches
+         *
+         * @return True/false if the manifest file is resumable
+         */
+        bool Load();
+
+        /**
+         * @brief Create a new manifest file with the header only
+         *
+         * @return True/false of manifest creation state
+         */
+        bool Create();
+
+        std::string manifestPath_;
+        BlockManifestHeader header_;
+        std::set<size_t> uploadedBlocks_;
+        std::mutex manifestMutex_;
+        int fileDescriptor_ = -1;
+        bool unsynced_ = false;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // BLOCK_MANIFEST_H
@@ -0,0 +1,123 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef CONTENT_HASHER_H
+#define CONTENT_HASHER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Streaming 128 bit MurmurHash3 (x64 variant). It is not a cryptographic hash, but it hashes
+     * several GB/s, so it can be computed on the data read for an upload without slowing the upload down.
+     */
+    class ContentHasher
+    {
+      public:
+        /**
+         * @brief Construct ContentHasher object
+         *
+         * @param seed Seed of the hash
+         */
+        explicit ContentHasher(uint32_t seed = 0);
+
+        /**
+         * @brief Hash the next piece of the data
+         *
+         * @param data The next piece of the data
+         * @param size Size of the piece in bytes
+         */
+        void Update(const char *data, size_t size);
+
+        /**
+         * @brief Finish the hash. The hasher must not be updated afterwards.
+         *
+         * @param digest Set to the 16 bytes of the hash
+         */
+        void Finish(uint8_t digest[16]);
+
+        /**
+         * @brief Finish the hash. The hasher must not be updated afterwards.
+         *
+         * @return the hash as 32 lowercase hex digits
+         */
+        std::string Finish();
+
+      private:
+        /**
+         * @brief Mix a 16 byte block into the hash state
+         *
+         * @param block The block
+         */
+        void MixBlock(const uint8_t *block);
+
+        uint64_t h1_;
+        uint64_t h2_;
+        uint64_t length_ = 0;
+        uint8_t tail_[16];
+        size_t tailSize_ = 0;
+    };
+
+    /**
+     * @brief Content hash of a file hashed in segments of a fixed size. The segment hashes are combined into
+     * the content hash, so segments can be hashed out of order, such as blocks uploaded in parallel. A file of
+     * a single segment is hashed as a whole.
+     */
+    class SegmentedContentHash
+    {
+      public:
+        /**
+         * @brief Construct SegmentedContentHash object
+         *
+         * @param size Size of the file in bytes
+         * @param segmentSize Size of a segment in bytes
+         */
+        SegmentedContentHash(uint64_t size, uint64_t segmentSize);
+
+        /**
+         * @brief Get the number of segments of the file
+         *
+         * @return the number of segments
+         */
+        size_t GetSegmentCount() const;
+
+        /**
+         * @brief Set the hash of a segment hashed on its own
+         *
+         * @param segmentIndex Index of the segment
+         * @param hash Hash of the segment, see ContentHasher
+         */
+        void SetSegmentHash(size_t segmentIndex, const std::string &hash);
+
+        /**
+         * @brief Hash the next piece of the file, when the file is read in order from its start
+         *
+         * @param data The next piece of the file
+         * @param size Size of the piece in bytes
+         */
+        void Update(const char *data, size_t size);
+
+        /**
+         * @brief Combine the segment hashes into the content hash
+         *
+         * @return the content hash, empty if a segment was not hashed
+         */
+        std::string Finish();
+
+      private:
+        uint64_t size_;
+        uint64_t segmentSize_;
+        std::vector<std::string> segmentHashes_;
+
+        uint64_t offset_ = 0;
+        ContentHasher segmentHasher_;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // CONTENT_HASHER_H
@@ -0,0 +1,74 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef CRC64_H
+#define CRC64_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Streaming CRC64 of the Azure storage service, the reflected CRC-64 with polynomial
+     * 0x9A6C9329AC4BC9B5 that the service checks x-ms-content-crc64 against. It is computed eight bytes
+     * at a time with lookup tables, and CRCs of consecutive ranges can be combined, so ranges uploaded
+     * in parallel yield the CRC of the whole blob.
+     */
+    class Crc64
+    {
+      public:
+        /**
+         * @brief Add the next piece of the data to the CRC
+         *
+         * @param data The next piece of the data
+         * @param size Size of the piece in bytes
+         */
+        void Update(const char *data, size_t size);
+
+        /**
+         * @brief Get the CRC of the data added so far
+         *
+         * @return the CRC
+         */
+        uint64_t GetValue() const;
+
+        /**
+         * @brief Get the number of bytes added so far
+         *
+         * @return the length of the data in bytes
+         */
+        uint64_t GetLength() const;
+
+        /**
+         * @brief Combine the CRCs of two consecutive ranges into the CRC of both
+         *
+         * @param first CRC of the first range
+         * @param second CRC of the second range
+         * @param secondLength Length of the second range in bytes
+         *
+         * @return the CRC of the first range followed by the second
+         */
+        static uint64_t Combine(uint64_t first, uint64_t second, uint64_t secondLength);
+
+        /**
+         * @brief Encode a CRC the way the x-ms-content-crc64 header carries it, as its eight little endian
+         * bytes in base64
+         *
+         * @param crc The CRC
+         *
+         * @return the encoded CRC
+         */
+        static std::string Encode(uint64_t crc);
+
+      private:
+        uint64_t crc_ = 0;
+        uint64_t length_ = 0;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // CRC64_H
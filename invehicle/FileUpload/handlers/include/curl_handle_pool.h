@@ -0,0 +1,112 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef CURL_HANDLE_POOL_H
+#define CURL_HANDLE_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <curl/curl.h>
+#include <mutex>
+#include <vector>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Snapshot of the connection reuse counters of CurlHandlePool
+     *
+     */
+    struct CurlHandlePoolStatistics
+    {
+        uint64_t Requests = 0;
+        uint64_t NewConnections = 0;
+        uint64_t TlsHandshakes = 0;
+        uint64_t ReusedConnections = 0;
+        uint64_t Files = 0;
+        double AverageFileLatencyInMs = 0;
+    };
+
+    /**
+     * @brief Long-lived pool of curl easy handles. All handles share one connection cache,
+     * DNS cache and TLS session cache, so consecutive requests to the same storage account
+     * reuse kept-alive connections instead of paying a new TCP and TLS handshake.
+     */
+    class CurlHandlePool
+    {
+      public:
+        /**
+         * @brief Construct CurlHandlePool object
+         *
+         * @param maxIdleHandles Maximum number of idle handles kept for reuse
+         */
+        explicit CurlHandlePool(size_t maxIdleHandles);
+
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~CurlHandlePool();
+
+        CurlHandlePool(const CurlHandlePool &) = delete;
+        CurlHandlePool &operator=(const CurlHandlePool &) = delete;
+
+        /**
+         * @brief Take a handle from the pool, or create one if no idle handle is left.
+         * The handle is reset and attached to the shared caches.
+         *
+         * @return curl handle, or nullptr if curl can't create one
+         */
+        CURL *Acquire();
+
+        /**
+         * @brief Return a handle to the pool
+         *
+         * @param curl The handle taken by Acquire
+         */
+        void Release(CURL *curl);
+
+        /**
+         * @brief Record the connection usage of the last transfer of a handle
+         *
+         * @param curl The handle that performed a transfer
+         */
+        void RecordTransfer(CURL *curl);
+
+        /**
+         * @brief Record the end-to-end latency of a file upload
+         *
+         * @param latency Time taken to upload the file
+         */
+        void RecordFileLatency(std::chrono::steady_clock::duration latency);
+
+        /**
+         * @brief Get the connection reuse counters
+         *
+         * @return statistics snapshot
+         */
+        CurlHandlePoolStatistics GetStatistics() const;
+
+      private:
+        static void LockShare(CURL *curl, curl_lock_data data, curl_lock_access access, void *pool);
+        static void UnlockShare(CURL *curl, curl_lock_data data, void *pool);
+
+        CURLSH *share_ = nullptr;
+        std::mutex shareMutexes_[CURL_LOCK_DATA_LAST];
+
+        std::vector<CURL *> idleHandles_;
+        std::mutex poolMutex_;
+        size_t maxIdleHandles_;
+
+        std::atomic<uint64_t> requests_{0};
+        std::atomic<uint64_t> newConnections_{0};
+        std::atomic<uint64_t> tlsHandshakes_{0};
+        std::atomic<uint64_t> files_{0};
+        std::atomic<uint64_t> totalFileLatencyInUs_{0};
+
+        const long KeepAliveIdleInSeconds = 60;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // CURL_HANDLE_POOL_H
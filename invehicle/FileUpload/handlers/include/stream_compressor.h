@@ -0,0 +1,78 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef STREAM_COMPRESSOR_H
+#define STREAM_COMPRESSOR_H
+
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Content encoding of the files whose name matches a glob pattern
+     */
+    struct CompressionRule
+    {
+        // Glob pattern matched against the file name relative to the data container path. A * also
+        // matches across directories.
+        std::string Pattern;
+        std::string Encoding;
+    };
+
+    /**
+     * @brief Parse a compression rule. Pattern and Encoding are required.
+     *
+     * @param j JSON object of the rule
+     * @param rule The compression rule
+     */
+    void from_json(const nlohmann::json &j, CompressionRule &rule);
+
+    /**
+     * @brief Compresses a stream of file data in pieces, so a file is compressed while it is read and
+     * uploaded, without a compressed copy on disk.
+     */
+    class StreamCompressor
+    {
+      public:
+        /**
+         * @brief Create a compressor. zstd falls back to gzip if the module is built without zstd.
+         *
+         * @param encoding Content encoding, see CompressionNames
+         * @param level Compression level, clamped to the levels of the encoding
+         *
+         * @return the compressor, or nullptr for no or an unknown encoding
+         */
+        static std::unique_ptr<StreamCompressor> Create(const std::string &encoding, int level);
+
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~StreamCompressor() = default;
+
+        /**
+         * @brief Compress the next piece of the stream and append the compressed data produced so far
+         *
+         * @param data The next piece of the stream
+         * @param size Size of the piece in bytes
+         * @param finish Whether this is the last piece. The rest of the compressed stream is appended.
+         * @param output Compressed data is appended to this string
+         *
+         * @return false if the compression failed
+         */
+        virtual bool Compress(const char *data, size_t size, bool finish, std::string &output) = 0;
+
+        /**
+         * @brief Get the HTTP content encoding of the compressed stream
+         *
+         * @return the content encoding
+         */
+        virtual const std::string &GetContentEncoding() const = 0;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // STREAM_COMPRESSOR_H
@@ -0,0 +1,152 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef TAR_PACK_STREAM_H
+#define TAR_PACK_STREAM_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief A file packed into a tar pack
+     */
+    struct PackEntry
+    {
+        // Name of the file in the pack, relative to the container data path.
+        std::string FileName;
+        std::string LocalPath;
+        uint64_t Size = 0;
+        int64_t ModifiedTime = 0;
+    };
+
+    /**
+     * @brief Produces a tar archive of several files as a stream, reading each file only when the stream
+     * reaches it, so no archive is written to disk. The last member of the archive is a JSON index listing
+     * the name, data offset and size of every file, so single files can be read from the blob with range
+     * requests. The layout is computed up front from the file sizes, so the size of the stream and the
+     * offset of the index are known before the first byte is read.
+     */
+    class TarPackStream
+    {
+      public:
+        /**
+         * @brief Construct TarPackStream object
+         *
+         * @param entries The files to pack, with their sizes when they were picked
+         */
+        explicit TarPackStream(std::vector<PackEntry> entries);
+
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~TarPackStream();
+
+        /**
+         * @brief Check if a file name fits into a ustar header, which holds up to 255 characters split
+         * at a directory separator
+         *
+         * @param fileName Name of the file, relative to the container data path
+         *
+         * @return true if the file can be packed
+         */
+        static bool CanPack(const std::string &fileName);
+
+        /**
+         * @brief Get the size of a file in a pack, with its header and padding
+         *
+         * @param fileSize Size of the file in bytes
+         *
+         * @return the size the file takes in the pack in bytes
+         */
+        static uint64_t GetPackedSize(uint64_t fileSize);
+
+        /**
+         * @brief Read the next bytes of the stream
+         *
+         * @param buffer Buffer to read into
+         * @param size Number of bytes to read, not beyond the end of the stream
+         *
+         * @return false if a file could not be read or changed its size since it was picked
+         */
+        bool Read(char *buffer, size_t size);
+
+        /**
+         * @brief Get the size of the stream
+         *
+         * @return the size of the stream in bytes
+         */
+        uint64_t GetSize() const;
+
+        /**
+         * @brief Get the offset of the index member's header in the stream
+         *
+         * @return the offset of the index in bytes
+         */
+        uint64_t GetIndexOffset() const;
+
+        /**
+         * @brief Get the number of packed files
+         *
+         * @return the number of packed files
+         */
+        size_t GetFileCount() const;
+
+        static inline const std::string IndexFileName = ".pack-index.json";
+
+      private:
+        /**
+         * @brief A contiguous range of the stream: a header or the index, a packed file, or zero padding
+         */
+        struct Segment
+        {
+            uint64_t Offset = 0;
+            uint64_t Length = 0;
+            std::string Bytes;
+
+            // Index of the packed file, or -1 for Bytes, which are zeros if empty.
+            int64_t EntryIndex = -1;
+        };
+
+        /**
+         * @brief Append a segment at the end of the stream
+         *
+         * @param segment The segment, whose offset is set
+         */
+        void AddSegment(Segment segment);
+
+        /**
+         * @brief Append the zero padding up to the next tar record boundary
+         */
+        void AddPadding();
+
+        /**
+         * @brief Create a ustar header
+         *
+         * @param fileName Name of the member
+         * @param size Size of the member in bytes
+         * @param modifiedTime Modification time of the member in seconds since the epoch
+         *
+         * @return the 512 byte header
+         */
+        static std::string CreateHeader(const std::string &fileName, uint64_t size, int64_t modifiedTime);
+
+        std::vector<PackEntry> entries_;
+        std::vector<Segment> segments_;
+        uint64_t size_ = 0;
+        uint64_t indexOffset_ = 0;
+
+        uint64_t position_ = 0;
+        size_t segmentIndex_ = 0;
+        int fileDescriptor_ = -1;
+
+        static const uint64_t RecordSize = 512;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // TAR_PACK_STREAM_H
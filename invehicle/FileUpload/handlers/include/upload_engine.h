@@ -0,0 +1,220 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef UPLOAD_ENGINE_H
+#define UPLOAD_ENGINE_H
+
+#include <atomic>
+#include <curl/curl.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bandwidth_governor.h"
+#include "content_hasher.h"
+#include "crc64.h"
+#include "curl_handle_pool.h"
+#include "file_upload_settings.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief A single HTTP PUT request run by the UploadEngine
+     *
+     */
+    struct UploadTransfer
+    {
+        std::string Uri;
+        std::vector<std::string> Headers;
+
+        // The request body is read from the file range when FileDescriptor is set, or from Body otherwise.
+        int FileDescriptor = -1;
+        uint64_t Offset = 0;
+        uint64_t Length = 0;
+        std::string Body;
+
+        // Hashes the file range as it is read, if set. Curl reads the body once from its start.
+        std::shared_ptr<ContentHasher> Hasher;
+
+        // Computes the CRC64 of the file range as it is read, if set. The transfer fails if the storage
+        // service returns a different x-ms-content-crc64 for the body it received.
+        std::shared_ptr<Crc64> Checksum;
+
+        // Priority of the upload request, which the bandwidth governor shares the upload rate by.
+        int Priority = 0;
+
+        std::string Description;
+
+        // Called on the engine thread once the request completed or failed.
+        std::function<void(bool succeeded, long responseCode)> OnComplete;
+    };
+
+    /**
+     * @brief Event-driven upload engine. A single thread drives all transfers with curl_multi,
+     * keeping up to a configured number of requests in flight across files and upload requests.
+     */
+    class UploadEngine
+    {
+      public:
+        /**
+         * @brief Construct UploadEngine object and start the engine thread
+         *
+         * @param curlHandlePool Pool to take curl handles from
+         * @param settings File upload settings for concurrency and the read path
+         */
+        UploadEngine(CurlHandlePool &curlHandlePool, const FileUploadSettings &settings);
+
+        /**
+         * @brief Virtual destructor. Stops the engine, see Stop.
+         */
+        virtual ~UploadEngine();
+
+        UploadEngine(const UploadEngine &) = delete;
+        UploadEngine &operator=(const UploadEngine &) = delete;
+
+        /**
+         * @brief Queue a transfer. It starts as soon as a transfer slot is free.
+         *
+         * @param transfer The transfer to run
+         */
+        void Submit(UploadTransfer transfer);
+
+        /**
+         * @brief Run a task on the engine thread, so it can share state with transfer completions without locking.
+         *
+         * @param task The task to run
+         */
+        void Post(std::function<void()> task);
+
+        /**
+         * @brief Stop the engine thread, and fail the transfers in flight or queued through their completion, so
+         * their owners release what they hold. Tasks queued or posted by the completions run on the calling
+         * thread, and the transfers they submit fail as well, until nothing is left.
+         */
+        void Stop();
+
+        /**
+         * @brief Set the bandwidth governor that transfers take tokens from for the data they send
+         *
+         * @param bandwidthGovernor The bandwidth governor
+         */
+        void SetBandwidthGovernor(const std::shared_ptr<BandwidthGovernor> &bandwidthGovernor);
+
+      private:
+        /**
+         * @brief State of a transfer attached to the curl multi handle
+         */
+        struct ActiveTransfer
+        {
+            UploadTransfer Transfer;
+            CURL *Curl = nullptr;
+            struct curl_slist *HeaderList = nullptr;
+            uint64_t ReadOffset = 0;
+            uint64_t Remaining = 0;
+
+            // Start of the file range that is read but not yet dropped from the page cache.
+            uint64_t CachedOffset = 0;
+            bool DropPageCache = false;
+
+            // The x-ms-content-crc64 response header, base64 encoded.
+            std::string ResponseCrc64;
+
+            // The governor the transfer takes tokens from, the tokens left of its turn, whether it pauses for its
+            // next turn once they are sent, whether it is paused, and whether its low speed timeout is turned off
+            // while it is paused.
+            BandwidthGovernor *Governor = nullptr;
+            uint64_t Allowance = 0;
+            bool Yielding = false;
+            bool Paused = false;
+            bool SpeedCheckSuspended = false;
+        };
+
+        /**
+         * @brief Engine thread loop
+         */
+        void Run();
+
+        /**
+         * @brief Attach queued transfers to the multi handle while transfer slots are free
+         */
+        void StartPendingTransfers();
+
+        /**
+         * @brief Resume the transfers paused by the bandwidth governor whose priority has tokens again. The
+         * transfers of a priority take turns, and each turn is at most a fair share of the tokens of the priority.
+         */
+        void ResumePausedTransfers();
+
+        /**
+         * @brief Turn off the low speed timeout of the transfers paused by the bandwidth governor, so a transfer
+         * waiting for tokens isn't aborted as stalled, and get the time until the first of them can resume
+         *
+         * @return the poll timeout in milliseconds
+         */
+        int SuspendPausedTransfers();
+
+        /**
+         * @brief Detach completed transfers and call their completion
+         */
+        void CompleteTransfers();
+
+        /**
+         * @brief Detach a transfer and return its handle to the pool
+         *
+         * @param activeTransfer The transfer to detach
+         */
+        void DetachTransfer(ActiveTransfer &activeTransfer);
+
+        static size_t ReadCallback(void *ptr, size_t size, size_t numElements, void *data);
+
+        static size_t HeaderCallback(char *buffer, size_t size, size_t numElements, void *data);
+
+        /**
+         * @brief Check the CRC64 the storage service computed for the received body against the CRC64
+         * of the body that was sent
+         *
+         * @param activeTransfer The completed transfer
+         *
+         * @return false if the service received different data
+         */
+        static bool VerifyChecksum(const ActiveTransfer &activeTransfer);
+
+        CurlHandlePool &curlHandlePool_;
+        size_t maxConcurrentTransfers_;
+        long uploadBufferSize_;
+        bool dropPageCache_;
+        CURLM *multi_ = nullptr;
+
+        std::mutex queueMutex_;
+        std::deque<UploadTransfer> pendingTransfers_;
+        std::deque<std::function<void()>> pendingTasks_;
+        bool stopping_ = false;
+
+        std::map<CURL *, std::unique_ptr<ActiveTransfer>> activeTransfers_;
+
+        // The transfer of each priority resumed last by ResumePausedTransfers.
+        std::map<int, CURL *> lastResumedTransfers_;
+        std::shared_ptr<BandwidthGovernor> bandwidthGovernor_;
+        std::thread engineThread_;
+
+        const int PollTimeoutInMs = 1000;
+
+        // Tokens a transfer asks the bandwidth governor for at once, so a changed limit applies soon.
+        static constexpr uint64_t MaxTurnInBytes = 4 * 1024 * 1024;
+        const long ConnectTimeoutInSeconds = 30;
+        const long LowSpeedTimeInSeconds = 60;
+
+        // Read pages are dropped from the page cache in ranges of at least this size.
+        static const uint64_t PageCacheDropRangeInBytes = 1024 * 1024;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // UPLOAD_ENGINE_H
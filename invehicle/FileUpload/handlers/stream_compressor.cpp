@@ -0,0 +1,179 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <logging.h>
+#include <mutex>
+#include <zlib.h>
+
+#ifdef FILE_UPLOAD_MODULE_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "file_upload_settings.h"
+#include "include/stream_compressor.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    using namespace nlohmann;
+
+    void from_json(const json &j, CompressionRule &rule)
+    {
+        rule.Pattern = j.at("Pattern").get<std::string>();
+        rule.Encoding = j.at("Encoding").get<std::string>();
+    }
+
+    /**
+     * @brief gzip stream compressor on zlib
+     */
+    class GzipCompressor : public StreamCompressor
+    {
+      public:
+        explicit GzipCompressor(int level)
+        {
+            // 16 added to the window bits writes a gzip header and trailer instead of a zlib wrapper.
+            initialized_ =
+                deflateInit2(&stream_, std::clamp(level, 1, 9), Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        }
+
+        ~GzipCompressor() override
+        {
+            if (initialized_)
+            {
+                deflateEnd(&stream_);
+            }
+        }
+
+        bool Compress(const char *data, size_t size, bool finish, std::string &output) override
+        {
+            if (!initialized_)
+            {
+                return false;
+            }
+
+            stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+            stream_.avail_in = static_cast<uInt>(size);
+
+            int result;
+            do
+            {
+                size_t outputSize = output.size();
+                output.resize(outputSize + OutputChunkInBytes);
+                stream_.next_out = reinterpret_cast<Bytef *>(&output[outputSize]);
+                stream_.avail_out = static_cast<uInt>(OutputChunkInBytes);
+
+                result = deflate(&stream_, finish ? Z_FINISH : Z_NO_FLUSH);
+                output.resize(outputSize + OutputChunkInBytes - stream_.avail_out);
+
+                if (result == Z_STREAM_ERROR)
+                {
+                    return false;
+                }
+            } while (stream_.avail_out == 0 || (finish && result != Z_STREAM_END));
+
+            return true;
+        }
+
+        const std::string &GetContentEncoding() const override
+        {
+            return CompressionNames::Gzip;
+        }
+
+      private:
+        z_stream stream_{};
+        bool initialized_ = false;
+
+        const size_t OutputChunkInBytes = 64 * 1024;
+    };
+
+#ifdef FILE_UPLOAD_MODULE_WITH_ZSTD
+    /**
+     * @brief zstd stream compressor
+     */
+    class ZstdCompressor : public StreamCompressor
+    {
+      public:
+        explicit ZstdCompressor(int level) : context_(ZSTD_createCCtx())
+        {
+            if (context_)
+            {
+                ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, std::clamp(level, 1, ZSTD_maxCLevel()));
+            }
+        }
+
+        ~ZstdCompressor() override
+        {
+            ZSTD_freeCCtx(context_);
+        }
+
+        bool Compress(const char *data, size_t size, bool finish, std::string &output) override
+        {
+            if (!context_)
+            {
+                return false;
+            }
+
+            ZSTD_inBuffer input = {data, size, 0};
+            size_t remaining;
+            do
+            {
+                size_t outputSize = output.size();
+                size_t outputChunkSize = ZSTD_CStreamOutSize();
+                output.resize(outputSize + outputChunkSize);
+                ZSTD_outBuffer outputBuffer = {&output[outputSize], outputChunkSize, 0};
+
+                remaining =
+                    ZSTD_compressStream2(context_, &outputBuffer, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+                output.resize(outputSize + outputBuffer.pos);
+
+                if (ZSTD_isError(remaining))
+                {
+                    return false;
+                }
+            } while (finish ? remaining != 0 : input.pos < input.size);
+
+            return true;
+        }
+
+        const std::string &GetContentEncoding() const override
+        {
+            return CompressionNames::Zstd;
+        }
+
+      private:
+        ZSTD_CCtx *context_;
+    };
+#endif
+
+    std::unique_ptr<StreamCompressor> StreamCompressor::Create(const std::string &encoding, int level)
+    {
+        if (encoding == CompressionNames::Zstd)
+        {
+#ifdef FILE_UPLOAD_MODULE_WITH_ZSTD
+            return std::make_unique<ZstdCompressor>(level);
+#else
+            static std::once_flag fallbackLogged;
+            std::call_once(
+                fallbackLogged,
+                []() { LogWarn("The module is built without zstd, gzip is used instead."); });
+
+            return std::make_unique<GzipCompressor>(level);
+#endif
+        }
+
+        if (encoding == CompressionNames::Gzip)
+        {
+            return std::make_unique<GzipCompressor>(level);
+        }
+
+        if (!encoding.empty() && encoding != CompressionNames::None)
+        {
+            LogWarn("Unknown content encoding %s, the file is uploaded uncompressed.", encoding.c_str());
+        }
+
+        return nullptr;
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -0,0 +1,256 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <logging.h>
+#include <nlohmann/json.hpp>
+#include <unistd.h>
+
+#include "include/tar_pack_stream.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    using namespace nlohmann;
+
+    /**
+     * @brief Split a member name into the ustar prefix and name fields
+     *
+     * @param fileName Name of the member
+     * @param prefix Set to the part before the directory separator, empty if the name fits on its own
+     * @param name Set to the rest of the name
+     *
+     * @return false if the name does not fit into the header
+     */
+    static bool SplitName(const std::string &fileName, std::string &prefix, std::string &name)
+    {
+        const size_t NameLength = 100;
+        const size_t PrefixLength = 155;
+
+        if (fileName.empty())
+        {
+            return false;
+        }
+
+        if (fileName.size() <= NameLength)
+        {
+            prefix.clear();
+            name = fileName;
+            return true;
+        }
+
+        // The prefix ends at a separator that leaves at most 100 characters for the name.
+        size_t separator = fileName.find('/', fileName.size() - NameLength - 1);
+        if (separator == std::string::npos || separator == 0 || separator > PrefixLength ||
+            separator + 1 == fileName.size())
+        {
+            return false;
+        }
+
+        prefix = fileName.substr(0, separator);
+        name = fileName.substr(separator + 1);
+        return true;
+    }
+
+    static void WriteOctal(char *field, size_t fieldSize, uint64_t value)
+    {
+        // Zero-padded octal digits followed by a NUL terminator.
+        snprintf(field, fieldSize, "%0*llo", (int)fieldSize - 1, static_cast<unsigned long long>(value));
+    }
+
+    TarPackStream::TarPackStream(std::vector<PackEntry> entries) : entries_(std::move(entries))
+    {
+        json index = json::array();
+        for (size_t entryIndex = 0; entryIndex < entries_.size(); entryIndex++)
+        {
+            const PackEntry &entry = entries_[entryIndex];
+
+            Segment header;
+            header.Bytes = CreateHeader(entry.FileName, entry.Size, entry.ModifiedTime);
+            AddSegment(std::move(header));
+
+            index.push_back({{"FileName", entry.FileName}, {"Offset", size_}, {"Size", entry.Size}});
+
+            Segment data;
+            data.Length = entry.Size;
+            data.EntryIndex = (int64_t)entryIndex;
+            AddSegment(std::move(data));
+            AddPadding();
+        }
+
+        indexOffset_ = size_;
+        std::string indexText = index.dump();
+
+        Segment indexHeader;
+        indexHeader.Bytes = CreateHeader(IndexFileName, indexText.size(), time(nullptr));
+        AddSegment(std::move(indexHeader));
+
+        Segment indexData;
+        indexData.Bytes = std::move(indexText);
+        AddSegment(std::move(indexData));
+        AddPadding();
+
+        // A tar archive ends with two zero records.
+        Segment trailer;
+        trailer.Length = 2 * RecordSize;
+        AddSegment(std::move(trailer));
+    }
+
+    TarPackStream::~TarPackStream()
+    {
+        if (fileDescriptor_ >= 0)
+        {
+            close(fileDescriptor_);
+        }
+    }
+
+    bool TarPackStream::CanPack(const std::string &fileName)
+    {
+        std::string prefix;
+        std::string name;
+        return SplitName(fileName, prefix, name);
+    }
+
+    uint64_t TarPackStream::GetPackedSize(uint64_t fileSize)
+    {
+        return RecordSize + (fileSize + RecordSize - 1) / RecordSize * RecordSize;
+    }
+
+    bool TarPackStream::Read(char *buffer, size_t size)
+    {
+        while (size > 0 && segmentIndex_ < segments_.size())
+        {
+            const Segment &segment = segments_[segmentIndex_];
+            uint64_t segmentOffset = position_ - segment.Offset;
+            size_t readSize = (size_t)std::min<uint64_t>(size, segment.Length - segmentOffset);
+
+            if (segment.EntryIndex >= 0)
+            {
+                const PackEntry &entry = entries_[segment.EntryIndex];
+                if (fileDescriptor_ < 0)
+                {
+                    fileDescriptor_ = open(entry.LocalPath.c_str(), O_RDONLY | O_CLOEXEC);
+                    if (fileDescriptor_ < 0)
+                    {
+                        LogError("Failed to open the packed file %s.", entry.LocalPath.c_str());
+                        return false;
+                    }
+                    posix_fadvise(fileDescriptor_, 0, 0, POSIX_FADV_SEQUENTIAL);
+                }
+
+                size_t fileRead = 0;
+                while (fileRead < readSize)
+                {
+                    ssize_t result = pread(
+                        fileDescriptor_,
+                        buffer + fileRead,
+                        readSize - fileRead,
+                        (off_t)(segmentOffset + fileRead));
+                    if (result <= 0)
+                    {
+                        LogError("Failed to read the packed file %s, or it shrank.", entry.LocalPath.c_str());
+                        return false;
+                    }
+                    fileRead += (size_t)result;
+                }
+            }
+            else if (segment.Bytes.empty())
+            {
+                memset(buffer, 0, readSize);
+            }
+            else
+            {
+                memcpy(buffer, segment.Bytes.data() + segmentOffset, readSize);
+            }
+
+            buffer += readSize;
+            size -= readSize;
+            position_ += readSize;
+
+            if (position_ == segment.Offset + segment.Length)
+            {
+                if (fileDescriptor_ >= 0)
+                {
+                    close(fileDescriptor_);
+                    fileDescriptor_ = -1;
+                }
+                segmentIndex_++;
+            }
+        }
+
+        return size == 0;
+    }
+
+    uint64_t TarPackStream::GetSize() const
+    {
+        return size_;
+    }
+
+    uint64_t TarPackStream::GetIndexOffset() const
+    {
+        return indexOffset_;
+    }
+
+    size_t TarPackStream::GetFileCount() const
+    {
+        return entries_.size();
+    }
+
+    void TarPackStream::AddSegment(Segment segment)
+    {
+        if (!segment.Bytes.empty())
+        {
+            segment.Length = segment.Bytes.size();
+        }
+
+        if (segment.Length == 0)
+        {
+            return;
+        }
+
+        segment.Offset = size_;
+        size_ += segment.Length;
+        segments_.push_back(std::move(segment));
+    }
+
+    void TarPackStream::AddPadding()
+    {
+        Segment padding;
+        padding.Length = (RecordSize - size_ % RecordSize) % RecordSize;
+        AddSegment(std::move(padding));
+    }
+
+    std::string TarPackStream::CreateHeader(const std::string &fileName, uint64_t size, int64_t modifiedTime)
+    {
+        std::string prefix;
+        std::string name;
+        SplitName(fileName, prefix, name);
+
+        char header[RecordSize] = {};
+        memcpy(header, name.data(), name.size());
+        WriteOctal(header + 100, 8, 0644);
+        WriteOctal(header + 108, 8, 0);
+        WriteOctal(header + 116, 8, 0);
+        WriteOctal(header + 124, 12, size);
+        WriteOctal(header + 136, 12, (uint64_t)std::max<int64_t>(modifiedTime, 0));
+        header[156] = '0';
+        memcpy(header + 257, "ustar", 6);
+        memcpy(header + 263, "00", 2);
+        memcpy(header + 345, prefix.data(), prefix.size());
+
+        // The checksum is the sum of the header bytes, with the checksum field counted as spaces.
+        memset(header + 148, ' ', 8);
+        unsigned int checksum = 0;
+        for (unsigned char c : header)
+        {
+            checksum += c;
+        }
+        snprintf(header + 148, 8, "%06o", checksum);
+
+        return std::string(header, RecordSize);
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
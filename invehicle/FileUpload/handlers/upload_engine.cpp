@@ -0,0 +1,497 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <logging.h>
+#include <stdexcept>
+#include <strings.h>
+#include <unistd.h>
+
+#include "include/upload_engine.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    UploadEngine::UploadEngine(CurlHandlePool &curlHandlePool, const FileUploadSettings &settings) :
+        curlHandlePool_(curlHandlePool), maxConcurrentTransfers_(std::max<size_t>(1, settings.MaxConcurrentTransfers)),
+        uploadBufferSize_((long)settings.UploadBufferSizeInBytes), dropPageCache_(settings.DropPageCacheAfterRead)
+    {
+        multi_ = curl_multi_init();
+        if (!multi_)
+        {
+            throw std::runtime_error("Can't initialize cUrl multi instance.");
+        }
+
+        engineThread_ = std::thread(&UploadEngine::Run, this);
+    }
+
+    UploadEngine::~UploadEngine()
+    {
+        Stop();
+        curl_multi_cleanup(multi_);
+    }
+
+    void UploadEngine::Stop()
+    {
+        {
+            std::scoped_lock<std::mutex> queueLock(queueMutex_);
+            if (stopping_)
+            {
+                return;
+            }
+            stopping_ = true;
+        }
+
+        curl_multi_wakeup(multi_);
+        engineThread_.join();
+
+        std::map<CURL *, std::unique_ptr<ActiveTransfer>> activeTransfers;
+        activeTransfers.swap(activeTransfers_);
+        for (auto &[curl, activeTransfer] : activeTransfers)
+        {
+            DetachTransfer(*activeTransfer);
+        }
+
+        size_t failedTransfers = 0;
+        for (auto &[curl, activeTransfer] : activeTransfers)
+        {
+            activeTransfer->Transfer.OnComplete(false, 0);
+            failedTransfers++;
+        }
+
+        // The completions may retry or continue their uploads, so the queues are drained until they stay empty.
+        while (true)
+        {
+            std::deque<std::function<void()>> tasks;
+            std::deque<UploadTransfer> transfers;
+            {
+                std::scoped_lock<std::mutex> queueLock(queueMutex_);
+                tasks.swap(pendingTasks_);
+                transfers.swap(pendingTransfers_);
+            }
+
+            if (tasks.empty() && transfers.empty())
+            {
+                break;
+            }
+
+            for (std::function<void()> &task : tasks)
+            {
+                task();
+            }
+
+            for (UploadTransfer &transfer : transfers)
+            {
+                transfer.OnComplete(false, 0);
+                failedTransfers++;
+            }
+        }
+
+        if (failedTransfers > 0)
+        {
+            LogInfo("Stopped the upload engine, %zu transfers failed because they didn't complete.", failedTransfers);
+        }
+    }
+
+    void UploadEngine::Submit(UploadTransfer transfer)
+    {
+        {
+            std::scoped_lock<std::mutex> queueLock(queueMutex_);
+            pendingTransfers_.push_back(std::move(transfer));
+        }
+
+        curl_multi_wakeup(multi_);
+    }
+
+    void UploadEngine::Post(std::function<void()> task)
+    {
+        {
+            std::scoped_lock<std::mutex> queueLock(queueMutex_);
+            pendingTasks_.push_back(std::move(task));
+        }
+
+        curl_multi_wakeup(multi_);
+    }
+
+    void UploadEngine::SetBandwidthGovernor(const std::shared_ptr<BandwidthGovernor> &bandwidthGovernor)
+    {
+        Post([this, bandwidthGovernor]() { bandwidthGovernor_ = bandwidthGovernor; });
+    }
+
+    void UploadEngine::Run()
+    {
+        while (true)
+        {
+            std::deque<std::function<void()>> tasks;
+            {
+                std::scoped_lock<std::mutex> queueLock(queueMutex_);
+                if (stopping_)
+                {
+                    break;
+                }
+                tasks.swap(pendingTasks_);
+            }
+
+            for (std::function<void()> &task : tasks)
+            {
+                task();
+            }
+
+            StartPendingTransfers();
+            ResumePausedTransfers();
+
+            int runningTransfers = 0;
+            curl_multi_perform(multi_, &runningTransfers);
+
+            CompleteTransfers();
+
+            // Sleeps until a socket is ready, a transfer or task is queued, or the poll timeout
+            // elapses so curl can handle its internal timers, and paused transfers can be resumed.
+            curl_multi_poll(multi_, nullptr, 0, SuspendPausedTransfers(), nullptr);
+        }
+    }
+
+    void UploadEngine::StartPendingTransfers()
+    {
+        while (activeTransfers_.size() < maxConcurrentTransfers_)
+        {
+            std::unique_ptr<ActiveTransfer> activeTransfer = std::make_unique<ActiveTransfer>();
+            {
+                std::scoped_lock<std::mutex> queueLock(queueMutex_);
+                if (pendingTransfers_.empty())
+                {
+                    return;
+                }
+
+                activeTransfer->Transfer = std::move(pendingTransfers_.front());
+                pendingTransfers_.pop_front();
+            }
+
+            UploadTransfer &transfer = activeTransfer->Transfer;
+            activeTransfer->Curl = curlHandlePool_.Acquire();
+            if (!activeTransfer->Curl)
+            {
+                transfer.OnComplete(false, 0);
+                continue;
+            }
+
+            activeTransfer->ReadOffset = transfer.FileDescriptor >= 0 ? transfer.Offset : 0;
+            activeTransfer->Remaining = transfer.FileDescriptor >= 0 ? transfer.Length : transfer.Body.size();
+            activeTransfer->CachedOffset = activeTransfer->ReadOffset;
+            activeTransfer->DropPageCache = dropPageCache_ && transfer.FileDescriptor >= 0;
+            activeTransfer->Governor = bandwidthGovernor_.get();
+            if (activeTransfer->Governor)
+            {
+                activeTransfer->Governor->AddTransfer(transfer.Priority);
+            }
+
+            // The range is read front to back exactly once, which lets the kernel read ahead aggressively.
+            if (transfer.FileDescriptor >= 0)
+            {
+                posix_fadvise(
+                    transfer.FileDescriptor,
+                    (off_t)transfer.Offset,
+                    (off_t)transfer.Length,
+                    POSIX_FADV_SEQUENTIAL);
+            }
+
+            for (const std::string &header : transfer.Headers)
+            {
+                activeTransfer->HeaderList = curl_slist_append(activeTransfer->HeaderList, header.c_str());
+            }
+
+            CURL *curl = activeTransfer->Curl;
+            curl_easy_setopt(curl, CURLOPT_URL, transfer.Uri.c_str());
+            curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, activeTransfer->HeaderList);
+            curl_easy_setopt(curl, CURLOPT_READFUNCTION, ReadCallback);
+            curl_easy_setopt(curl, CURLOPT_READDATA, activeTransfer.get());
+            curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)activeTransfer->Remaining);
+            curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, uploadBufferSize_);
+            if (transfer.Checksum)
+            {
+                curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+                curl_easy_setopt(curl, CURLOPT_HEADERDATA, activeTransfer.get());
+            }
+
+            // Abort stalled transfers, so a dead link can't hold a transfer slot forever.
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, ConnectTimeoutInSeconds);
+            curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+            curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, LowSpeedTimeInSeconds);
+
+            curl_multi_add_handle(multi_, curl);
+            activeTransfers_[curl] = std::move(activeTransfer);
+        }
+    }
+
+    void UploadEngine::ResumePausedTransfers()
+    {
+        std::map<int, std::vector<CURL *>> pausedTransfers;
+        for (auto &[curl, activeTransfer] : activeTransfers_)
+        {
+            if (activeTransfer->Paused)
+            {
+                pausedTransfers[activeTransfer->Transfer.Priority].push_back(curl);
+            }
+        }
+
+        for (auto &[priority, curls] : pausedTransfers)
+        {
+            // The transfers of a priority take turns, starting after the transfer resumed last. That handle
+            // may be gone already, its key still orders the turns.
+            CURL *&lastResumedTransfer = lastResumedTransfers_[priority];
+            std::rotate(
+                curls.begin(),
+                std::upper_bound(curls.begin(), curls.end(), lastResumedTransfer, std::less<CURL *>()),
+                curls.end());
+
+            for (CURL *curl : curls)
+            {
+                ActiveTransfer &activeTransfer = *activeTransfers_[curl];
+                if (!activeTransfer.Governor->CanResume(priority))
+                {
+                    break;
+                }
+
+                // The turn is taken before the transfer is resumed, since curl doesn't read the resumed
+                // transfers in this order.
+                uint64_t turnLength = std::min(activeTransfer.Remaining, MaxTurnInBytes);
+                activeTransfer.Allowance = activeTransfer.Governor->Acquire(priority, turnLength);
+                if (activeTransfer.Allowance == 0)
+                {
+                    break;
+                }
+                activeTransfer.Yielding = activeTransfer.Allowance < turnLength;
+
+                if (activeTransfer.SpeedCheckSuspended)
+                {
+                    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, LowSpeedTimeInSeconds);
+                    activeTransfer.SpeedCheckSuspended = false;
+                }
+
+                activeTransfer.Paused = false;
+                lastResumedTransfer = curl;
+                curl_easy_pause(curl, CURLPAUSE_CONT);
+            }
+        }
+    }
+
+    int UploadEngine::SuspendPausedTransfers()
+    {
+        std::chrono::milliseconds pollTimeout = std::chrono::milliseconds(PollTimeoutInMs);
+        for (auto &[curl, activeTransfer] : activeTransfers_)
+        {
+            if (!activeTransfer->Paused)
+            {
+                continue;
+            }
+
+            if (!activeTransfer->SpeedCheckSuspended)
+            {
+                curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 0L);
+                activeTransfer->SpeedCheckSuspended = true;
+            }
+
+            pollTimeout =
+                std::min(pollTimeout, activeTransfer->Governor->GetResumeDelay(activeTransfer->Transfer.Priority));
+        }
+
+        return (int)std::max<int64_t>(1, pollTimeout.count());
+    }
+
+    void UploadEngine::CompleteTransfers()
+    {
+        CURLMsg *message = nullptr;
+        int messagesInQueue = 0;
+        while ((message = curl_multi_info_read(multi_, &messagesInQueue)) != nullptr)
+        {
+            if (message->msg != CURLMSG_DONE)
+            {
+                continue;
+            }
+
+            auto it = activeTransfers_.find(message->easy_handle);
+            if (it == activeTransfers_.end())
+            {
+                continue;
+            }
+
+            std::unique_ptr<ActiveTransfer> activeTransfer = std::move(it->second);
+            activeTransfers_.erase(it);
+
+            CURLcode result = message->data.result;
+            long responseCode = 0;
+            curl_easy_getinfo(activeTransfer->Curl, CURLINFO_RESPONSE_CODE, &responseCode);
+            curlHandlePool_.RecordTransfer(activeTransfer->Curl);
+
+            bool succeeded = false;
+            if (result != CURLE_OK)
+            {
+                LogError(
+                    "Transfer failed for %s: %s",
+                    activeTransfer->Transfer.Description.c_str(),
+                    curl_easy_strerror(result));
+            }
+            else if (responseCode < 200 || responseCode >= 300)
+            {
+                LogError(
+                    "Storage service rejected %s with HTTP status %ld.",
+                    activeTransfer->Transfer.Description.c_str(),
+                    responseCode);
+            }
+            else
+            {
+                succeeded = VerifyChecksum(*activeTransfer);
+            }
+
+            // The message points into the multi handle, so it must not be used after detaching.
+            DetachTransfer(*activeTransfer);
+            activeTransfer->Transfer.OnComplete(succeeded, responseCode);
+        }
+    }
+
+    void UploadEngine::DetachTransfer(ActiveTransfer &activeTransfer)
+    {
+        curl_multi_remove_handle(multi_, activeTransfer.Curl);
+        curlHandlePool_.Release(activeTransfer.Curl);
+        activeTransfer.Curl = nullptr;
+
+        if (activeTransfer.Governor)
+        {
+            activeTransfer.Governor->Release(activeTransfer.Transfer.Priority, activeTransfer.Allowance);
+            activeTransfer.Allowance = 0;
+            activeTransfer.Governor->RemoveTransfer(activeTransfer.Transfer.Priority);
+            activeTransfer.Governor = nullptr;
+        }
+
+        curl_slist_free_all(activeTransfer.HeaderList);
+        activeTransfer.HeaderList = nullptr;
+    }
+
+    size_t UploadEngine::ReadCallback(void *ptr, size_t size, size_t numElements, void *data)
+    {
+        ActiveTransfer *activeTransfer = static_cast<ActiveTransfer *>(data);
+        size_t length = std::min<uint64_t>(size * numElements, activeTransfer->Remaining);
+        if (length == 0)
+        {
+            return 0;
+        }
+
+        const UploadTransfer &transfer = activeTransfer->Transfer;
+        if (activeTransfer->Governor)
+        {
+            // A transfer sends the tokens of a turn, at most a fair share of its priority, and then pauses until
+            // ResumePausedTransfers gives it the next turn, so the transfers of a priority take turns instead of
+            // the first one taking every token.
+            if (activeTransfer->Allowance == 0)
+            {
+                uint64_t turnLength = std::min(activeTransfer->Remaining, MaxTurnInBytes);
+                if (!activeTransfer->Yielding)
+                {
+                    activeTransfer->Allowance = activeTransfer->Governor->Acquire(transfer.Priority, turnLength);
+                }
+
+                activeTransfer->Yielding = activeTransfer->Allowance < turnLength;
+                if (activeTransfer->Allowance == 0)
+                {
+                    activeTransfer->Yielding = false;
+                    activeTransfer->Paused = true;
+                    return CURL_READFUNC_PAUSE;
+                }
+            }
+
+            length = std::min<uint64_t>(length, activeTransfer->Allowance);
+        }
+        if (transfer.FileDescriptor < 0)
+        {
+            memcpy(ptr, transfer.Body.data() + activeTransfer->ReadOffset, length);
+            activeTransfer->ReadOffset += length;
+            activeTransfer->Remaining -= length;
+            activeTransfer->Allowance -= activeTransfer->Governor ? length : 0;
+            return length;
+        }
+
+        // The file is read straight into the curl upload buffer, so every byte is copied once
+        // from the page cache. A memory map would add page faults without saving that copy.
+        ssize_t bytesRead = pread(transfer.FileDescriptor, ptr, length, (off_t)activeTransfer->ReadOffset);
+        if (bytesRead <= 0)
+        {
+            return CURL_READFUNC_ABORT;
+        }
+
+        // Tokens of data a short read didn't return stay with the turn, and go back to the priority when the
+        // transfer is detached.
+        activeTransfer->ReadOffset += bytesRead;
+        activeTransfer->Remaining -= bytesRead;
+        activeTransfer->Allowance -= activeTransfer->Governor ? (uint64_t)bytesRead : 0;
+
+        // The data is hashed while it is in the CPU cache, instead of reading the file a second time.
+        if (transfer.Hasher)
+        {
+            transfer.Hasher->Update(static_cast<const char *>(ptr), (size_t)bytesRead);
+        }
+        if (transfer.Checksum)
+        {
+            transfer.Checksum->Update(static_cast<const char *>(ptr), (size_t)bytesRead);
+        }
+
+        uint64_t cachedLength = activeTransfer->ReadOffset - activeTransfer->CachedOffset;
+        bool rangeComplete = cachedLength >= PageCacheDropRangeInBytes || activeTransfer->Remaining == 0;
+        if (activeTransfer->DropPageCache && rangeComplete)
+        {
+            posix_fadvise(
+                transfer.FileDescriptor,
+                (off_t)activeTransfer->CachedOffset,
+                (off_t)cachedLength,
+                POSIX_FADV_DONTNEED);
+            activeTransfer->CachedOffset = activeTransfer->ReadOffset;
+        }
+
+        return (size_t)bytesRead;
+    }
+
+    size_t UploadEngine::HeaderCallback(char *buffer, size_t size, size_t numElements, void *data)
+    {
+        static const std::string Crc64Header = "x-ms-content-crc64:";
+
+        ActiveTransfer *activeTransfer = static_cast<ActiveTransfer *>(data);
+        size_t length = size * numElements;
+        if (length > Crc64Header.size() && strncasecmp(buffer, Crc64Header.c_str(), Crc64Header.size()) == 0)
+        {
+            std::string value(buffer + Crc64Header.size(), length - Crc64Header.size());
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t\r\n") + 1);
+            activeTransfer->ResponseCrc64 = value;
+        }
+
+        return length;
+    }
+
+    bool UploadEngine::VerifyChecksum(const ActiveTransfer &activeTransfer)
+    {
+        const UploadTransfer &transfer = activeTransfer.Transfer;
+
+        // Service versions before 2019-02-02 return no CRC64, the data is not verified then.
+        if (!transfer.Checksum || activeTransfer.ResponseCrc64.empty())
+        {
+            return true;
+        }
+
+        std::string expected = Crc64::Encode(transfer.Checksum->GetValue());
+        if (activeTransfer.ResponseCrc64 != expected)
+        {
+            LogError(
+                "Storage service received %s with CRC64 %s, the sent data has CRC64 %s.",
+                transfer.Description.c_str(),
+                activeTransfer.ResponseCrc64.c_str(),
+                expected.c_str());
+            return false;
+        }
+
+        return true;
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
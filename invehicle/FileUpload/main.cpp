@@ -26,6 +26,7 @@
 #include "module_initialization.h"
 
 #include "processors/include/module_message_processor.h"
+#include "settings/include/file_upload_settings.h"
 
 using namespace microsoft::azure::connectedcar::autoedge;
 using namespace microsoft::azure::connectedcar;
@@ -101,7 +102,8 @@ bool ConnectToMqttBroker(std::shared_ptr<MqttClient> &mqttClient)
 
 void SubscribeToMqttBroker(
     std::shared_ptr<ModuleMessageProcessor> &moduleMessageProcessor,
-    std::shared_ptr<MqttClient> &mqttClient)
+    std::shared_ptr<MqttClient> &mqttClient,
+    const std::string &bandwidthControlTopic)
 {
 
     SubscribeHandler handler = [&](unsigned short packetId,
@@ -115,8 +117,8 @@ void SubscribeToMqttBroker(
             CorrelationId correlationId =
                 CorrelationId(optionalCorrelationId.has_value() ? optionalCorrelationId.value() : "");
 
-            LogTrace(correlationId, "New message: %s", payload.c_str());
-            moduleMessageProcessor->ProcessMessageAsync(payload, correlationId);
+            // The message is only queued here, so the MQTT client isn't held up by parsing and processing.
+            moduleMessageProcessor->EnqueueMessage(payload, correlationId);
         }
         catch (const MqttClientException &e)
         {
@@ -130,6 +132,12 @@ void SubscribeToMqttBroker(
         {MqttConstants::Topics::RequestFileUpload, Qos::AT_LEAST_ONCE},
         {MqttConstants::Topics::FileUploadBlobUri, Qos::AT_LEAST_ONCE}};
 
+    // Bandwidth limits messages are dispatched by their message type like any other message.
+    if (!bandwidthControlTopic.empty())
+    {
+        subscribeTopics[bandwidthControlTopic] = Qos::AT_LEAST_ONCE;
+    }
+
     for (const auto &[k, v] : subscribeTopics)
     {
         mqttClient->Subscribe(k, handler, v);
@@ -190,10 +198,11 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    // Subscribe to the MQTT broker.
+    // Load the upload tuning settings.
+    FileUploadSettings settings = FileUploadSettings::LoadFromEnvironment();
+
     std::shared_ptr<ModuleMessageProcessor> moduleMessageProcessor =
-        std::make_unique<ModuleMessageProcessor>(mqttClient);
-    SubscribeToMqttBroker(moduleMessageProcessor, mqttClient);
+        std::make_unique<ModuleMessageProcessor>(mqttClient, settings);
 
     std::string dataContainerPath = Configuration::GetEnvironmentConfigOrDefault(
         ConfigurationKeys::FileUploadModule::DataContainerPath,
@@ -209,6 +218,12 @@ int main(int argc, char *argv[])
         throw std::logic_error("Unable to set data container path.");
     }
 
+    // Recover the accepted upload requests from the journal before new requests arrive.
+    moduleMessageProcessor->RecoverPendingWork(dataContainerPath);
+
+    // Subscribe to the MQTT broker.
+    SubscribeToMqttBroker(moduleMessageProcessor, mqttClient, settings.BandwidthControlTopic);
+
     LogInfo("File Upload Module has started.");
 
     // Start module processors.
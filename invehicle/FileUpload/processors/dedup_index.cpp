@@ -0,0 +1,370 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <fcntl.h>
+#include <fstream>
+#include <logging.h>
+#include <unistd.h>
+
+#include "include/dedup_index.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    using namespace nlohmann;
+
+    namespace DedupRecordTypes
+    {
+        static const std::string Content = "Content";
+        static const std::string UploadId = "UploadId";
+    } // namespace DedupRecordTypes
+
+    static const std::string IndexFileName = "dedup-index.log";
+
+    static bool WriteAll(int fileDescriptor, const std::string &data)
+    {
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t result = write(fileDescriptor, data.data() + written, data.size() - written);
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            written += result;
+        }
+
+        return true;
+    }
+
+    DedupIndex::DedupIndex(const std::string &indexDirectory, size_t contentCapacity, std::chrono::seconds retention) :
+        indexDirectory_(indexDirectory), indexPath_(indexDirectory + "/" + IndexFileName),
+        contentCapacity_(contentCapacity), retentionInSeconds_(retention.count())
+    {
+    }
+
+    DedupIndex::~DedupIndex()
+    {
+        if (fileDescriptor_ >= 0)
+        {
+            close(fileDescriptor_);
+        }
+    }
+
+    void DedupIndex::Open()
+    {
+        std::scoped_lock<std::mutex> indexLock(indexMutex_);
+
+        try
+        {
+            boost::filesystem::create_directories(indexDirectory_);
+        }
+        catch (boost::filesystem::filesystem_error &e)
+        {
+            LogWarn("Failed to create the dedup index directory, %s.", e.what());
+            return;
+        }
+
+        // Records are not synced, so the index stops at the first record that can't be parsed.
+        std::ifstream indexFile(indexPath_);
+        std::string line;
+        while (std::getline(indexFile, line))
+        {
+            try
+            {
+                ApplyRecord(json::parse(line));
+                recordCount_++;
+            }
+            catch (const std::exception &e)
+            {
+                LogWarn("Stopped loading the dedup index at an invalid record, %s.", e.what());
+                break;
+            }
+        }
+        indexFile.close();
+
+        Trim();
+        LogInfo(
+            "Loaded %zu content entries and %zu upload ids from the dedup index.",
+            contents_.size(),
+            uploadIds_.size());
+
+        if (!Compact())
+        {
+            fileDescriptor_ = open(indexPath_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fileDescriptor_ < 0)
+            {
+                LogWarn("Failed to open the dedup index, %s.", indexPath_.c_str());
+            }
+        }
+    }
+
+    bool DedupIndex::AddUploadId(const std::string &uploadId)
+    {
+        std::scoped_lock<std::mutex> indexLock(indexMutex_);
+
+        Trim();
+        if (uploadIds_.find(uploadId) != uploadIds_.end())
+        {
+            return false;
+        }
+
+        json record;
+        record["Type"] = DedupRecordTypes::UploadId;
+        record["UploadId"] = uploadId;
+        record["Time"] = GetTime();
+        AppendRecord(record);
+
+        return true;
+    }
+
+    bool DedupIndex::HasUploadId(const std::string &uploadId)
+    {
+        std::scoped_lock<std::mutex> indexLock(indexMutex_);
+
+        Trim();
+        return uploadIds_.find(uploadId) != uploadIds_.end();
+    }
+
+    bool DedupIndex::IsContentEnabled() const
+    {
+        return contentCapacity_ > 0;
+    }
+
+    bool DedupIndex::HasContentSize(uint64_t size)
+    {
+        if (!IsContentEnabled())
+        {
+            return false;
+        }
+
+        std::scoped_lock<std::mutex> indexLock(indexMutex_);
+
+        Trim();
+        return contentSizes_.find(size) != contentSizes_.end();
+    }
+
+    std::string DedupIndex::FindContent(uint64_t size, const std::string &contentHash)
+    {
+        if (!IsContentEnabled() || contentHash.empty())
+        {
+            return std::string();
+        }
+
+        std::scoped_lock<std::mutex> indexLock(indexMutex_);
+
+        Trim();
+        auto content = contents_.find(GetContentKey(size, contentHash));
+        return content == contents_.end() ? std::string() : content->second.BlobPath;
+    }
+
+    void DedupIndex::AddContent(uint64_t size, const std::string &contentHash, const std::string &blobPath)
+    {
+        if (!IsContentEnabled() || contentHash.empty())
+        {
+            return;
+        }
+
+        std::scoped_lock<std::mutex> indexLock(indexMutex_);
+
+        json record;
+        record["Type"] = DedupRecordTypes::Content;
+        record["Size"] = size;
+        record["Hash"] = contentHash;
+        record["BlobPath"] = blobPath;
+        record["Time"] = GetTime();
+        AppendRecord(record);
+        Trim();
+    }
+
+    void DedupIndex::ApplyRecord(const json &record)
+    {
+        const std::string &type = record.at("Type").get_ref<const std::string &>();
+        int64_t time = record.at("Time").get<int64_t>();
+
+        if (type == DedupRecordTypes::Content)
+        {
+            IndexEntry entry;
+            entry.Size = record.at("Size").get<uint64_t>();
+            entry.BlobPath = record.at("BlobPath").get<std::string>();
+            entry.AddedTime = time;
+
+            // An entry added again within the same second keeps its place in the order.
+            std::string key = GetContentKey(entry.Size, record.at("Hash").get<std::string>());
+            auto content = contents_.find(key);
+            if (content == contents_.end())
+            {
+                contentSizes_[entry.Size]++;
+            }
+            else if (content->second.AddedTime == time)
+            {
+                content->second = std::move(entry);
+                return;
+            }
+            contents_[key] = std::move(entry);
+            contentOrder_.emplace_back(time, key);
+        }
+        else if (type == DedupRecordTypes::UploadId)
+        {
+            std::string uploadId = record.at("UploadId").get<std::string>();
+            uploadIds_[uploadId] = time;
+            uploadIdOrder_.emplace_back(time, uploadId);
+        }
+    }
+
+    void DedupIndex::AppendRecord(const json &record)
+    {
+        ApplyRecord(record);
+        recordCount_++;
+
+        if (fileDescriptor_ < 0)
+        {
+            return;
+        }
+
+        if (!WriteAll(fileDescriptor_, record.dump() + "\n"))
+        {
+            LogWarn("Failed to append to the dedup index, %s.", indexPath_.c_str());
+        }
+
+        // Compact once most of the records belong to dropped entries.
+        size_t liveRecordCount = contents_.size() + uploadIds_.size();
+        if (recordCount_ >= MinCompactionRecords && recordCount_ >= 2 * liveRecordCount)
+        {
+            Compact();
+        }
+    }
+
+    void DedupIndex::Trim()
+    {
+        int64_t expiry = GetTime() - retentionInSeconds_;
+
+        while (!contentOrder_.empty())
+        {
+            const auto &[addedTime, key] = contentOrder_.front();
+            auto content = contents_.find(key);
+            if (content != contents_.end() && content->second.AddedTime == addedTime)
+            {
+                if (addedTime > expiry && contents_.size() <= contentCapacity_)
+                {
+                    break;
+                }
+
+                auto contentSize = contentSizes_.find(content->second.Size);
+                if (contentSize != contentSizes_.end() && --contentSize->second == 0)
+                {
+                    contentSizes_.erase(contentSize);
+                }
+                contents_.erase(content);
+            }
+            contentOrder_.pop_front();
+        }
+
+        while (!uploadIdOrder_.empty())
+        {
+            const auto &[addedTime, uploadId] = uploadIdOrder_.front();
+            auto entry = uploadIds_.find(uploadId);
+            if (entry != uploadIds_.end() && entry->second == addedTime)
+            {
+                if (addedTime > expiry && uploadIds_.size() <= MaxUploadIds)
+                {
+                    break;
+                }
+                uploadIds_.erase(entry);
+            }
+            uploadIdOrder_.pop_front();
+        }
+    }
+
+    bool DedupIndex::Compact()
+    {
+        std::string records;
+        for (const auto &[addedTime, key] : contentOrder_)
+        {
+            auto content = contents_.find(key);
+            if (content == contents_.end() || content->second.AddedTime != addedTime)
+            {
+                continue;
+            }
+
+            json record;
+            record["Type"] = DedupRecordTypes::Content;
+            record["Size"] = content->second.Size;
+            record["Hash"] = key.substr(key.find(':') + 1);
+            record["BlobPath"] = content->second.BlobPath;
+            record["Time"] = addedTime;
+            records += record.dump() + "\n";
+        }
+
+        for (const auto &[addedTime, uploadId] : uploadIdOrder_)
+        {
+            auto entry = uploadIds_.find(uploadId);
+            if (entry == uploadIds_.end() || entry->second != addedTime)
+            {
+                continue;
+            }
+
+            json record;
+            record["Type"] = DedupRecordTypes::UploadId;
+            record["UploadId"] = uploadId;
+            record["Time"] = addedTime;
+            records += record.dump() + "\n";
+        }
+
+        // Write the live records to a temporary file first, so a crash during compaction leaves
+        // either the old or the new index behind.
+        std::string temporaryPath = indexPath_ + ".tmp";
+        int fileDescriptor = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fileDescriptor < 0)
+        {
+            LogWarn("Failed to create the compacted dedup index, %s.", temporaryPath.c_str());
+            return false;
+        }
+
+        bool written = WriteAll(fileDescriptor, records) && fdatasync(fileDescriptor) == 0;
+        close(fileDescriptor);
+
+        if (!written || rename(temporaryPath.c_str(), indexPath_.c_str()) != 0)
+        {
+            LogWarn("Failed to compact the dedup index, %s.", indexPath_.c_str());
+            unlink(temporaryPath.c_str());
+            return false;
+        }
+
+        if (fileDescriptor_ >= 0)
+        {
+            close(fileDescriptor_);
+        }
+
+        fileDescriptor_ = open(indexPath_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fileDescriptor_ < 0)
+        {
+            LogWarn("Failed to open the dedup index, %s.", indexPath_.c_str());
+        }
+
+        size_t liveRecordCount = contents_.size() + uploadIds_.size();
+        LogTrace("Compacted the dedup index from %zu to %zu records.", recordCount_, liveRecordCount);
+        recordCount_ = liveRecordCount;
+
+        return true;
+    }
+
+    std::string DedupIndex::GetContentKey(uint64_t size, const std::string &contentHash)
+    {
+        return std::to_string(size) + ":" + contentHash;
+    }
+
+    int64_t DedupIndex::GetTime()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
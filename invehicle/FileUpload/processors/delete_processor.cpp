@@ -4,7 +4,7 @@
 //  </copyright>
 // ---------------------------------------------------------------------------------
 
-#include <boost/filesystem.hpp>
+#include <algorithm>
 #include <logging.h>
 #include <nlohmann/json.hpp>
 
@@ -15,65 +15,117 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
     using namespace microsoft::azure::connectedcar::vehicle::datacontracts;
     using namespace nlohmann;
 
+    DeleteProcessor::DeleteProcessor(size_t deleteThreadCount) : fileDeleter_(deleteThreadCount)
+    {
+    }
+
     void DeleteProcessor::Delete(UploadProcessMessage processMessage)
     {
-        if (processMessage.HasFileRetentionExpiry())
-        {
-            LogTrace("Delete " + processMessage.UploadRequestPayload.UploadId + ".");
-            DeleteFilesInMessage(processMessage);
-        }
-        else
+        std::chrono::steady_clock::time_point deadline = processMessage.HasFileRetentionExpiry()
+                                                             ? std::chrono::steady_clock::now()
+                                                             : processMessage.UploadRequestPayload.FileRetentionExpiry;
+
+        LogTrace("Enqueue " + processMessage.UploadRequestPayload.UploadId + " to delete.");
         {
-            LogTrace("Enqueue " + processMessage.UploadRequestPayload.UploadId + " to delete.");
-            messageQueue_.push(processMessage);
+            std::scoped_lock<std::mutex> messageLock(messageMutex_);
+            messageQueue_.push(RetentionItem{deadline, processMessage});
         }
+
+        // Wake up the delete thread, the new message may be due before the one it waits for.
+        messageAdded_.notify_one();
+    }
+
+    void DeleteProcessor::SetJournal(const std::shared_ptr<UploadJournal> &journal)
+    {
+        journal_ = journal;
     }
 
     void DeleteProcessor::Start(const CancellationToken::Ptr cancellation_token)
     {
         while (!cancellation_token->IsCancellationRequested())
         {
-            if (!messageQueue_.empty())
+            std::vector<UploadProcessMessage> dueMessages;
             {
-                UploadProcessMessage processMessage = messageQueue_.front();
-                messageQueue_.pop();
+                std::unique_lock<std::mutex> messageLock(messageMutex_);
 
-                if (processMessage.HasFileRetentionExpiry())
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                while (!messageQueue_.empty() && messageQueue_.top().Deadline <= now)
                 {
-                    DeleteFilesInMessage(processMessage);
+                    dueMessages.push_back(messageQueue_.top().ProcessMessage);
+                    messageQueue_.pop();
                 }
-                else
+
+                if (dueMessages.empty())
                 {
-                    messageQueue_.push(processMessage);
+                    std::chrono::steady_clock::time_point wakeUpTime =
+                        now + std::chrono::milliseconds(CancellationCheckIntervalInMs);
+                    if (!messageQueue_.empty())
+                    {
+                        wakeUpTime = std::min(wakeUpTime, messageQueue_.top().Deadline);
+                    }
+
+                    messageAdded_.wait_until(messageLock, wakeUpTime);
+                    continue;
                 }
             }
 
-            std::this_thread::sleep_for(std::chrono::seconds(ProcessorThreadSleep));
+            // Files are deleted without holding the lock, so new messages can be queued meanwhile.
+            DeleteNow(dueMessages);
         }
     }
 
-    void DeleteProcessor::DeleteFilesInMessage(UploadProcessMessage processMessage)
+    std::optional<UploadProcessMessage> DeleteProcessor::EvictNext()
     {
-        for (FileUploadResult fileUpload : processMessage.UploadFileList)
+        std::optional<UploadProcessMessage> processMessage;
         {
-            std::string localFilePath = processMessage.GetLocalPath(fileUpload.FileName);
+            std::scoped_lock<std::mutex> messageLock(messageMutex_);
+            if (messageQueue_.empty())
+            {
+                return std::nullopt;
+            }
 
-            try
+            processMessage = messageQueue_.top().ProcessMessage;
+            messageQueue_.pop();
+        }
+
+        DeleteNow(*processMessage);
+
+        return processMessage;
+    }
+
+    void DeleteProcessor::DeleteNow(const UploadProcessMessage &processMessage)
+    {
+        DeleteNow(std::vector<UploadProcessMessage>{processMessage});
+    }
+
+    void DeleteProcessor::DeleteNow(const std::vector<UploadProcessMessage> &processMessages)
+    {
+        DeleteFilesInMessages(processMessages);
+
+        if (journal_)
+        {
+            for (const UploadProcessMessage &processMessage : processMessages)
             {
-                if (boost::filesystem::exists(localFilePath))
-                {
-                    boost::filesystem::remove(localFilePath);
-                    LogTrace("Deleted " + localFilePath + ".");
-                }
-                else
-                {
-                    LogTrace("Skipped deleting because " + localFilePath + " does not exist.");
-                }
+                journal_->RecordDeleted(processMessage.UploadRequestPayload.UploadId);
             }
-            catch (boost::filesystem::filesystem_error &e)
+        }
+    }
+
+    void DeleteProcessor::DeleteFilesInMessages(const std::vector<UploadProcessMessage> &processMessages)
+    {
+        // The files of all messages are deleted in one batch, so messages sharing a directory share
+        // its directory handle.
+        std::vector<std::string> localFilePaths;
+        for (const UploadProcessMessage &processMessage : processMessages)
+        {
+            LogTrace("Delete " + processMessage.UploadRequestPayload.UploadId + ".");
+            for (const FileUploadResult &fileUpload : processMessage.UploadFileList)
             {
-                LogWarn("Exception thrown while deleting file" + std::string(e.what()));
+                localFilePaths.push_back(processMessage.GetLocalPath(fileUpload.FileName));
             }
         }
+
+        size_t deletedCount = fileDeleter_.DeleteFiles(localFilePaths);
+        LogTrace("Deleted %zu of %zu files.", deletedCount, localFilePaths.size());
     }
-} // namespace microsoft::azure::connectedcar::fileuploadmodule
\ No newline at end of file
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -0,0 +1,313 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <boost/uuid/uuid_generators.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <logging.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "include/drop_folder_watcher.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    using namespace nlohmann;
+
+    void from_json(const json &j, WatchRule &rule)
+    {
+        WatchRule defaults;
+        rule.Directory = j.at("Directory").get<std::string>();
+        rule.Pattern = j.value("Pattern", defaults.Pattern);
+        rule.Priority = j.value("Priority", defaults.Priority);
+        rule.TimeToLiveInSec = j.value("TimeToLiveInSec", defaults.TimeToLiveInSec);
+        rule.FileRetentionInSec = j.value("FileRetentionInSec", defaults.FileRetentionInSec);
+        rule.Metadata = j.value("Metadata", defaults.Metadata);
+        rule.Compression = j.value("Compression", defaults.Compression);
+    }
+
+    DropFolderWatcher::DropFolderWatcher(
+        const std::shared_ptr<UploadProcessor> &uploadProcessor,
+        const FileUploadSettings &settings) :
+        uploadProcessor_(uploadProcessor),
+        batchWindow_(std::chrono::milliseconds(settings.WatchBatchWindowInMs)),
+        maxBatchFiles_(std::max<size_t>(1, settings.WatchMaxBatchFiles))
+    {
+        if (settings.WatchRules.empty())
+        {
+            return;
+        }
+
+        try
+        {
+            rules_ = json::parse(settings.WatchRules).get<std::vector<WatchRule>>();
+        }
+        catch (json::exception &e)
+        {
+            throw std::invalid_argument("Invalid watch rules, " + std::string(e.what()));
+        }
+    }
+
+    void DropFolderWatcher::SetHostDataContainerPath(const std::string &hostDataContainerPath)
+    {
+        dataContainerPath_ = hostDataContainerPath;
+    }
+
+    void DropFolderWatcher::AddJournaledFiles(const UploadProcessMessage &processMessage)
+    {
+        for (const vehicle::datacontracts::FileUploadResult &fileUpload : processMessage.UploadFileList)
+        {
+            requestedFiles_.insert(fileUpload.FileName);
+        }
+    }
+
+    void DropFolderWatcher::Start(const CancellationToken::Ptr cancellationToken)
+    {
+        if (rules_.empty())
+        {
+            LogInfo("No watch rules are configured, the drop folder watcher is disabled.");
+            return;
+        }
+
+        int inotifyDescriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyDescriptor < 0)
+        {
+            LogError("Failed to initialize inotify, the drop folder watcher is disabled.");
+            return;
+        }
+
+        // IN_CLOSE_WRITE and IN_MOVED_TO fire once a file is completely written, so a file is never
+        // requested while its producer still writes it.
+        std::map<int, std::string> watchedDirectories;
+        for (const WatchRule &rule : rules_)
+        {
+            std::string directoryPath = dataContainerPath_ + "/" + rule.Directory;
+            int watchDescriptor =
+                inotify_add_watch(inotifyDescriptor, directoryPath.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+            if (watchDescriptor < 0)
+            {
+                LogWarn("Failed to watch %s.", directoryPath.c_str());
+                continue;
+            }
+
+            watchedDirectories[watchDescriptor] = rule.Directory;
+            LogInfo("Watching %s for files matching %s.", directoryPath.c_str(), rule.Pattern.c_str());
+        }
+
+        // Files written before the watches were added have no events, so they are found by a scan. A file
+        // written while it is scanned may be picked up by both, which the batch deduplicates.
+        PruneRequestedFiles();
+        for (const auto &[watchDescriptor, directory] : watchedDirectories)
+        {
+            ScanDirectory(directory);
+        }
+
+        alignas(inotify_event) char eventBuffer[64 * 1024];
+        while (!cancellationToken->IsCancellationRequested())
+        {
+            pollfd pollDescriptor{inotifyDescriptor, POLLIN, 0};
+            if (poll(&pollDescriptor, 1, CancellationCheckIntervalInMs) > 0)
+            {
+                bool overflowed = false;
+                ssize_t length;
+                while ((length = read(inotifyDescriptor, eventBuffer, sizeof(eventBuffer))) > 0)
+                {
+                    for (char *position = eventBuffer; position < eventBuffer + length;)
+                    {
+                        const inotify_event *event = reinterpret_cast<const inotify_event *>(position);
+                        position += sizeof(inotify_event) + event->len;
+
+                        if ((event->mask & IN_Q_OVERFLOW) != 0)
+                        {
+                            overflowed = true;
+                            continue;
+                        }
+
+                        auto directory = watchedDirectories.find(event->wd);
+                        if ((event->mask & IN_ISDIR) == 0 && event->len > 0 && directory != watchedDirectories.end())
+                        {
+                            AddFile(directory->second, event->name);
+                        }
+                    }
+                }
+
+                if (overflowed)
+                {
+                    LogWarn("The inotify event queue overflowed, rescanning the watched directories.");
+                    PruneRequestedFiles();
+                    for (const auto &[watchDescriptor, directory] : watchedDirectories)
+                    {
+                        ScanDirectory(directory);
+                    }
+                }
+            }
+
+            FlushBatches(false);
+        }
+
+        // Collected files are journaled with their request on shutdown, so they are uploaded after a restart.
+        FlushBatches(true);
+        close(inotifyDescriptor);
+    }
+
+    void DropFolderWatcher::AddFile(const std::string &directory, const std::string &fileName)
+    {
+        // Hidden files are skipped like in expanded file lists. Producers write temporary files that way and
+        // rename them once complete, so a hidden file is usually gone by the time it would be uploaded.
+        if (fileName.empty() || fileName[0] == '.')
+        {
+            return;
+        }
+
+        for (size_t ruleIndex = 0; ruleIndex < rules_.size(); ruleIndex++)
+        {
+            const WatchRule &rule = rules_[ruleIndex];
+            if (rule.Directory != directory || fnmatch(rule.Pattern.c_str(), fileName.c_str(), 0) != 0)
+            {
+                continue;
+            }
+
+            PendingBatch &batch = pendingBatches_[ruleIndex];
+            if (batch.FileList.empty())
+            {
+                batch.FirstFileTime = std::chrono::steady_clock::now();
+            }
+
+            // A file closed several times within the window is requested once.
+            if (batch.FileNames.insert(fileName).second)
+            {
+                batch.FileList.push_back(GetRelativePath(directory, fileName));
+            }
+
+            return;
+        }
+    }
+
+    void DropFolderWatcher::ScanDirectory(const std::string &directory)
+    {
+        std::string directoryPath = dataContainerPath_ + "/" + directory;
+        DIR *directoryStream = opendir(directoryPath.c_str());
+        if (directoryStream == nullptr)
+        {
+            LogWarn("Failed to scan %s.", directoryPath.c_str());
+            return;
+        }
+
+        size_t addedFiles = 0;
+        while (dirent *entry = readdir(directoryStream))
+        {
+            // Hidden files are never requested, see AddFile.
+            std::string fileName = entry->d_name;
+            if (fileName.empty() || fileName[0] == '.' ||
+                requestedFiles_.count(GetRelativePath(directory, fileName)) > 0)
+            {
+                continue;
+            }
+
+            bool isFile = entry->d_type == DT_REG;
+            if (entry->d_type == DT_UNKNOWN)
+            {
+                struct stat fileInfo;
+                isFile = fstatat(dirfd(directoryStream), entry->d_name, &fileInfo, AT_SYMLINK_NOFOLLOW) == 0 &&
+                         S_ISREG(fileInfo.st_mode);
+            }
+
+            if (isFile)
+            {
+                AddFile(directory, fileName);
+                addedFiles++;
+            }
+        }
+
+        closedir(directoryStream);
+
+        if (addedFiles > 0)
+        {
+            LogInfo("Found %zu files in %s that were not requested yet.", addedFiles, directoryPath.c_str());
+        }
+    }
+
+    void DropFolderWatcher::PruneRequestedFiles()
+    {
+        for (auto it = requestedFiles_.begin(); it != requestedFiles_.end();)
+        {
+            struct stat fileInfo;
+            if (stat((dataContainerPath_ + "/" + *it).c_str(), &fileInfo) != 0 && errno == ENOENT)
+            {
+                it = requestedFiles_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        requestedFilesPruneSize_ = std::max(MinRequestedFilesPruneSize, 2 * requestedFiles_.size());
+    }
+
+    std::string DropFolderWatcher::GetRelativePath(const std::string &directory, const std::string &fileName)
+    {
+        return directory.empty() || directory == "." ? fileName : directory + "/" + fileName;
+    }
+
+    void DropFolderWatcher::FlushBatches(bool force)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (auto it = pendingBatches_.begin(); it != pendingBatches_.end();)
+        {
+            const PendingBatch &batch = it->second;
+            if (force || now - batch.FirstFileTime >= batchWindow_ || batch.FileList.size() >= maxBatchFiles_)
+            {
+                EnqueueBatch(rules_[it->first], batch);
+                it = pendingBatches_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    void DropFolderWatcher::EnqueueBatch(const WatchRule &rule, const PendingBatch &batch)
+    {
+        std::string uploadId = boost::uuids::to_string(boost::uuids::random_generator()());
+
+        // The request is built like a request of another module, so it is journaled and processed the same way.
+        json uploadRequest;
+        uploadRequest["UploadId"] = uploadId;
+        uploadRequest["TimeToLive"] = std::to_string(rule.TimeToLiveInSec);
+        uploadRequest["FileList"] = batch.FileList;
+        uploadRequest["Priority"] = rule.Priority;
+        uploadRequest["FileRetentionInSec"] = std::to_string(rule.FileRetentionInSec);
+        uploadRequest["Metadata"] = rule.Metadata;
+        if (!rule.Compression.empty())
+        {
+            uploadRequest[UploadProcessMessage::RequestCompressionProperty] = rule.Compression;
+        }
+
+        CorrelationId correlationId = CorrelationId(uploadId);
+        LogInfo(
+            correlationId,
+            "Request upload of %zu files dropped into %s.",
+            batch.FileList.size(),
+            rule.Directory.c_str());
+
+        uploadProcessor_->EnqueueProcess(uploadRequest.dump(), correlationId);
+
+        requestedFiles_.insert(batch.FileList.begin(), batch.FileList.end());
+        if (requestedFiles_.size() >= requestedFilesPruneSize_)
+        {
+            PruneRequestedFiles();
+        }
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -0,0 +1,144 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <logging.h>
+#include <map>
+#include <unistd.h>
+
+#include "include/file_deleter.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    FileDeleter::FileDeleter(size_t threadCount)
+    {
+        for (size_t threadIndex = 0; threadIndex < std::max<size_t>(1, threadCount); threadIndex++)
+        {
+            workers_.emplace_back(&FileDeleter::RunWorker, this);
+        }
+    }
+
+    FileDeleter::~FileDeleter()
+    {
+        {
+            std::scoped_lock<std::mutex> taskLock(taskMutex_);
+            stopping_ = true;
+        }
+        taskAdded_.notify_all();
+
+        for (std::thread &worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    size_t FileDeleter::DeleteFiles(const std::vector<std::string> &filePaths)
+    {
+        std::map<std::string, std::vector<std::string>> filesByDirectory;
+        for (const std::string &filePath : filePaths)
+        {
+            size_t separator = filePath.find_last_of('/');
+            if (separator == std::string::npos)
+            {
+                filesByDirectory["."].push_back(filePath);
+            }
+            else
+            {
+                filesByDirectory[filePath.substr(0, std::max<size_t>(separator, 1))].push_back(
+                    filePath.substr(separator + 1));
+            }
+        }
+
+        std::mutex completionMutex;
+        std::condition_variable directoryCompleted;
+        size_t pendingDirectories = filesByDirectory.size();
+        size_t deletedCount = 0;
+
+        {
+            std::scoped_lock<std::mutex> taskLock(taskMutex_);
+            for (const auto &[directoryPath, fileNames] : filesByDirectory)
+            {
+                tasks_.emplace_back([&, directoryPath = directoryPath, fileNames = fileNames] {
+                    size_t directoryDeletedCount = DeleteFilesInDirectory(directoryPath, fileNames);
+
+                    std::scoped_lock<std::mutex> completionLock(completionMutex);
+                    deletedCount += directoryDeletedCount;
+                    if (--pendingDirectories == 0)
+                    {
+                        directoryCompleted.notify_one();
+                    }
+                });
+            }
+        }
+        taskAdded_.notify_all();
+
+        std::unique_lock<std::mutex> completionLock(completionMutex);
+        directoryCompleted.wait(completionLock, [&pendingDirectories] { return pendingDirectories == 0; });
+
+        return deletedCount;
+    }
+
+    void FileDeleter::RunWorker()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> taskLock(taskMutex_);
+                taskAdded_.wait(taskLock, [this] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty())
+                {
+                    return;
+                }
+
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+
+            task();
+        }
+    }
+
+    size_t FileDeleter::DeleteFilesInDirectory(
+        const std::string &directoryPath,
+        const std::vector<std::string> &fileNames)
+    {
+        int directoryDescriptor = open(directoryPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (directoryDescriptor < 0)
+        {
+            LogTrace(
+                "Skipped deleting %zu files because %s can't be opened, %s.",
+                fileNames.size(),
+                directoryPath.c_str(),
+                strerror(errno));
+            return 0;
+        }
+
+        size_t deletedCount = 0;
+        for (const std::string &fileName : fileNames)
+        {
+            if (unlinkat(directoryDescriptor, fileName.c_str(), 0) == 0)
+            {
+                deletedCount++;
+            }
+            else if (errno == ENOENT)
+            {
+                LogTrace("Skipped deleting because %s/%s does not exist.", directoryPath.c_str(), fileName.c_str());
+            }
+            else
+            {
+                LogWarn("Failed to delete %s/%s, %s.", directoryPath.c_str(), fileName.c_str(), strerror(errno));
+            }
+        }
+
+        close(directoryDescriptor);
+
+        return deletedCount;
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
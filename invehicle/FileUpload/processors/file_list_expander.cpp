@@ -0,0 +1,256 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <iterator>
+#include <logging.h>
+#include <sys/stat.h>
+
+#include "include/file_list_expander.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    static const std::string GlobCharacters = "*?[";
+
+    FileListExpander::FileListExpander(size_t threadCount) : threadCount_(std::max<size_t>(1, threadCount))
+    {
+    }
+
+    FileListExpander::~FileListExpander()
+    {
+        {
+            std::scoped_lock<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        workAvailable_.notify_all();
+        spaceAvailable_.notify_all();
+
+        for (std::thread &worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    void FileListExpander::Start(
+        const std::string &containerDataPath,
+        const std::vector<std::string> &patterns,
+        const std::set<std::string> &knownFiles)
+    {
+        {
+            std::scoped_lock<std::mutex> lock(mutex_);
+            containerDataPath_ = containerDataPath;
+            knownFiles_ = knownFiles;
+
+            for (const std::string &pattern : patterns)
+            {
+                patterns_.push_back(ParsePattern(pattern));
+                scanItems_.push_back(ScanItem{patterns_.back().Root, patterns_.size() - 1, 0});
+            }
+
+            complete_ = scanItems_.empty();
+        }
+
+        for (size_t threadIndex = 0; threadIndex < threadCount_; threadIndex++)
+        {
+            workers_.emplace_back(&FileListExpander::RunWorker, this);
+        }
+    }
+
+    bool FileListExpander::Next(
+        std::vector<std::string> &files,
+        bool wait,
+        const CancellationToken::Ptr &cancellationToken)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (wait && files_.empty() && !complete_ && !cancellationToken->IsCancellationRequested())
+        {
+            filesAvailable_.wait_for(lock, std::chrono::milliseconds(CancellationCheckIntervalInMs));
+        }
+
+        if (cancellationToken->IsCancellationRequested())
+        {
+            return false;
+        }
+
+        files.insert(files.end(), std::make_move_iterator(files_.begin()), std::make_move_iterator(files_.end()));
+        files_.clear();
+        spaceAvailable_.notify_all();
+
+        return !files.empty() || !complete_;
+    }
+
+    bool FileListExpander::IsComplete()
+    {
+        std::scoped_lock<std::mutex> lock(mutex_);
+        return complete_;
+    }
+
+    bool FileListExpander::IsPattern(const std::string &containerDataPath, const std::string &fileListEntry)
+    {
+        if (fileListEntry.find_first_of(GlobCharacters) != std::string::npos)
+        {
+            return true;
+        }
+
+        struct stat fileInfo;
+        return stat((containerDataPath + "/" + fileListEntry).c_str(), &fileInfo) == 0 && S_ISDIR(fileInfo.st_mode);
+    }
+
+    void FileListExpander::RunWorker()
+    {
+        while (true)
+        {
+            ScanItem scanItem;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                workAvailable_.wait(lock, [this] { return stopping_ || complete_ || !scanItems_.empty(); });
+                if (stopping_ || scanItems_.empty())
+                {
+                    return;
+                }
+
+                scanItem = scanItems_.front();
+                scanItems_.pop_front();
+                activeScans_++;
+            }
+
+            ScanDirectory(scanItem);
+
+            std::scoped_lock<std::mutex> lock(mutex_);
+            if (--activeScans_ == 0 && scanItems_.empty() && !complete_)
+            {
+                complete_ = true;
+                workAvailable_.notify_all();
+                filesAvailable_.notify_all();
+            }
+        }
+    }
+
+    void FileListExpander::ScanDirectory(const ScanItem &scanItem)
+    {
+        std::string directoryPath =
+            scanItem.Directory.empty() ? containerDataPath_ : containerDataPath_ + "/" + scanItem.Directory;
+        DIR *directory = opendir(directoryPath.c_str());
+        if (directory == nullptr)
+        {
+            LogTrace("Skipped expanding %s because it can't be opened.", directoryPath.c_str());
+            return;
+        }
+
+        const FilePattern &pattern = patterns_[scanItem.PatternIndex];
+        std::vector<ScanItem> subdirectories;
+        std::vector<std::string> matchedFiles;
+
+        while (dirent *entry = readdir(directory))
+        {
+            std::string name = entry->d_name;
+            if (name.empty() || name[0] == '.')
+            {
+                continue;
+            }
+
+            bool isDirectory = entry->d_type == DT_DIR;
+            bool isFile = entry->d_type == DT_REG;
+            if (entry->d_type == DT_UNKNOWN)
+            {
+                struct stat fileInfo;
+                if (fstatat(dirfd(directory), entry->d_name, &fileInfo, AT_SYMLINK_NOFOLLOW) == 0)
+                {
+                    isDirectory = S_ISDIR(fileInfo.st_mode);
+                    isFile = S_ISREG(fileInfo.st_mode);
+                }
+            }
+
+            std::string relativePath = scanItem.Directory.empty() ? name : scanItem.Directory + "/" + name;
+            bool isLastComponent = scanItem.Depth + 1 >= pattern.Components.size();
+
+            if (!pattern.Components.empty() &&
+                fnmatch(pattern.Components[scanItem.Depth].c_str(), name.c_str(), FNM_PERIOD) != 0)
+            {
+                continue;
+            }
+
+            if (isDirectory && (pattern.Components.empty() || !isLastComponent))
+            {
+                subdirectories.push_back(ScanItem{relativePath, scanItem.PatternIndex, scanItem.Depth + 1});
+            }
+            else if (isFile && (pattern.Components.empty() || isLastComponent))
+            {
+                matchedFiles.push_back(relativePath);
+            }
+        }
+
+        closedir(directory);
+
+        if (!subdirectories.empty())
+        {
+            {
+                std::scoped_lock<std::mutex> lock(mutex_);
+                scanItems_.insert(scanItems_.end(), subdirectories.begin(), subdirectories.end());
+            }
+            workAvailable_.notify_all();
+        }
+
+        AddFiles(matchedFiles);
+    }
+
+    void FileListExpander::AddFiles(const std::vector<std::string> &files)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (const std::string &file : files)
+        {
+            // A file matched by several patterns, or listed by name as well, is handed out once.
+            if (!knownFiles_.insert(file).second)
+            {
+                continue;
+            }
+
+            spaceAvailable_.wait(lock, [this] { return stopping_ || files_.size() < MaxBufferedFiles; });
+            if (stopping_)
+            {
+                return;
+            }
+
+            files_.push_back(file);
+            filesAvailable_.notify_one();
+        }
+    }
+
+    FileListExpander::FilePattern FileListExpander::ParsePattern(const std::string &pattern)
+    {
+        std::vector<std::string> components;
+        size_t start = 0;
+        while (start <= pattern.size())
+        {
+            size_t end = std::min(pattern.find('/', start), pattern.size());
+            std::string component = pattern.substr(start, end - start);
+            if (!component.empty() && component != ".")
+            {
+                components.push_back(component);
+            }
+            start = end + 1;
+        }
+
+        FilePattern filePattern;
+        size_t componentIndex = 0;
+        for (; componentIndex < components.size(); componentIndex++)
+        {
+            if (components[componentIndex].find_first_of(GlobCharacters) != std::string::npos)
+            {
+                break;
+            }
+
+            filePattern.Root += (filePattern.Root.empty() ? "" : "/") + components[componentIndex];
+        }
+
+        filePattern.Components.assign(components.begin() + componentIndex, components.end());
+
+        return filePattern;
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
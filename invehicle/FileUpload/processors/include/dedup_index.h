@@ -0,0 +1,182 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef DEDUP_INDEX_H
+#define DEDUP_INDEX_H
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_map>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Persistent index of recently uploaded content and recently accepted upload ids, kept under the data
+     * container path. Content is identified by its size and content hash, and maps to the blob it was uploaded
+     * to, so a file with the same content doesn't need to be uploaded again. Upload ids are kept so a repeated
+     * upload request is dropped. Entries expire after the retention, and the oldest content entries are evicted
+     * beyond the capacity. Records are appended as JSON lines without syncing, since a lost record only costs
+     * an upload, and the index is compacted when it is opened and once most of its records are stale.
+     */
+    class DedupIndex
+    {
+      public:
+        /**
+         * @brief Construct DedupIndex object
+         *
+         * @param indexDirectory Directory to keep the index in
+         * @param contentCapacity Maximum number of content entries, 0 disables content deduplication
+         * @param retention Time entries are kept
+         */
+        DedupIndex(const std::string &indexDirectory, size_t contentCapacity, std::chrono::seconds retention);
+
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~DedupIndex();
+
+        DedupIndex(const DedupIndex &) = delete;
+        DedupIndex &operator=(const DedupIndex &) = delete;
+
+        /**
+         * @brief Load the index, drop the expired entries and open it for appending
+         */
+        void Open();
+
+        /**
+         * @brief Add an accepted upload id, unless it was accepted before within the retention
+         *
+         * @param uploadId Upload id of the request
+         *
+         * @return false if the upload id was accepted before
+         */
+        bool AddUploadId(const std::string &uploadId);
+
+        /**
+         * @brief Check if an upload id was accepted within the retention
+         *
+         * @param uploadId Upload id of the request
+         *
+         * @return true if the upload id was accepted before
+         */
+        bool HasUploadId(const std::string &uploadId);
+
+        /**
+         * @brief Check if content deduplication is enabled
+         *
+         * @return true if content is indexed
+         */
+        bool IsContentEnabled() const;
+
+        /**
+         * @brief Check if any indexed content has a size, so only files of a known size need to be hashed
+         *
+         * @param size Size of the content in bytes
+         *
+         * @return true if content of this size is indexed
+         */
+        bool HasContentSize(uint64_t size);
+
+        /**
+         * @brief Find the blob content was uploaded to
+         *
+         * @param size Size of the content in bytes
+         * @param contentHash Content hash of the content
+         *
+         * @return the blob path, empty if the content is not indexed
+         */
+        std::string FindContent(uint64_t size, const std::string &contentHash);
+
+        /**
+         * @brief Add uploaded content
+         *
+         * @param size Size of the content in bytes
+         * @param contentHash Content hash of the content
+         * @param blobPath Blob path the content was uploaded to
+         */
+        void AddContent(uint64_t size, const std::string &contentHash, const std::string &blobPath);
+
+      private:
+        /**
+         * @brief Indexed content, with the time it was added in seconds since the epoch
+         */
+        struct IndexEntry
+        {
+            std::string BlobPath;
+            uint64_t Size = 0;
+            int64_t AddedTime = 0;
+        };
+
+        /**
+         * @brief Apply an index record to the in-memory state
+         *
+         * @param record The index record
+         */
+        void ApplyRecord(const nlohmann::json &record);
+
+        /**
+         * @brief Apply a record and append it to the index. The caller must hold indexMutex_.
+         *
+         * @param record The index record
+         */
+        void AppendRecord(const nlohmann::json &record);
+
+        /**
+         * @brief Drop the expired entries, and the oldest content entries beyond the capacity.
+         * The caller must hold indexMutex_.
+         */
+        void Trim();
+
+        /**
+         * @brief Rewrite the index with the live entries only. The caller must hold indexMutex_.
+         *
+         * @return true if the index was rewritten
+         */
+        bool Compact();
+
+        /**
+         * @brief Get the key of content
+         *
+         * @param size Size of the content in bytes
+         * @param contentHash Content hash of the content
+         *
+         * @return the content key
+         */
+        static std::string GetContentKey(uint64_t size, const std::string &contentHash);
+
+        /**
+         * @brief Get the current time in seconds since the epoch
+         *
+         * @return the current time
+         */
+        static int64_t GetTime();
+
+        std::string indexDirectory_;
+        std::string indexPath_;
+        size_t contentCapacity_;
+        int64_t retentionInSeconds_;
+
+        std::mutex indexMutex_;
+        int fileDescriptor_ = -1;
+        size_t recordCount_ = 0;
+
+        // Entries by key, and their keys in the order they were added, to expire the oldest first. An entry
+        // that was added again keeps a stale key in the order, which is skipped when it comes up.
+        std::unordered_map<std::string, IndexEntry> contents_;
+        std::deque<std::pair<int64_t, std::string>> contentOrder_;
+        std::unordered_map<uint64_t, size_t> contentSizes_;
+        std::unordered_map<std::string, int64_t> uploadIds_;
+        std::deque<std::pair<int64_t, std::string>> uploadIdOrder_;
+
+        const size_t MaxUploadIds = 100000;
+        const size_t MinCompactionRecords = 1000;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // DEDUP_INDEX_H
@@ -7,11 +7,19 @@
 #ifndef DELETE_PROCESSOR_H
 #define DELETE_PROCESSOR_H
 
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
 #include <thread>
+#include <vector>
 #include <threading_utils.h>
 
+#include "file_deleter.h"
+#include "upload_journal.h"
 #include "upload_process_message.h"
 
 namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -20,9 +28,11 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
     {
       public:
         /**
-         * @brief Default constructor
+         * @brief Construct DeleteProcessor object
+         *
+         * @param deleteThreadCount Number of threads deleting files in parallel
          */
-        DeleteProcessor() = default;
+        explicit DeleteProcessor(size_t deleteThreadCount);
 
         /**
          * @brief Virtual destructor
@@ -30,14 +40,44 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         virtual ~DeleteProcessor() = default;
 
         /**
-         * @brief Request deleting files in upload request payload
+         * @brief Request deleting files in upload request payload once their retention expires.
+         * Files are deleted on the delete processor thread.
          *
          * @param processMessage Processing status message
          */
         void Delete(UploadProcessMessage processMessage);
 
         /**
-         * @brief Start delete processor thread.
+         * @brief Delete the files of the message whose retention expires first right away, to free storage
+         *
+         * @return The evicted message, or std::nullopt if no message waits for its retention to expire
+         */
+        std::optional<UploadProcessMessage> EvictNext();
+
+        /**
+         * @brief Delete the files of a message right away, and wait until they are deleted
+         *
+         * @param processMessage Processing status message
+         */
+        void DeleteNow(const UploadProcessMessage &processMessage);
+
+        /**
+         * @brief Delete the files of several messages right away in one batch, and wait until they are deleted
+         *
+         * @param processMessages Processing status messages
+         */
+        void DeleteNow(const std::vector<UploadProcessMessage> &processMessages);
+
+        /**
+         * @brief Set the journal to record deleted requests in
+         *
+         * @param journal The upload journal
+         */
+        void SetJournal(const std::shared_ptr<UploadJournal> &journal);
+
+        /**
+         * @brief Start delete processor thread. The thread sleeps until the next retention expires,
+         * and then deletes the files of every due message.
          *
          * @param cancellationToken Process cancellation token
          */
@@ -45,15 +85,40 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
 
       protected:
         /**
-         * @brief Delete local files in message
+         * @brief Delete local files in messages
          *
-         * @param processMessage Processing status message
+         * @param processMessages Processing status messages
+         */
+        virtual void DeleteFilesInMessages(const std::vector<UploadProcessMessage> &processMessages);
+
+        /**
+         * @brief A message waiting for its file retention to expire
+         */
+        struct RetentionItem
+        {
+            std::chrono::steady_clock::time_point Deadline;
+            UploadProcessMessage ProcessMessage;
+        };
+
+        /**
+         * @brief Orders retention items by deadline, earliest first
          */
-        virtual void DeleteFilesInMessage(UploadProcessMessage processMessage);
+        struct CompareDeadline
+        {
+            bool operator()(const RetentionItem &i1, const RetentionItem &i2) const
+            {
+                return i1.Deadline > i2.Deadline;
+            }
+        };
 
-        std::queue<UploadProcessMessage> messageQueue_;
+        std::priority_queue<RetentionItem, std::vector<RetentionItem>, CompareDeadline> messageQueue_;
+        std::mutex messageMutex_;
+        std::condition_variable messageAdded_;
+        std::shared_ptr<UploadJournal> journal_;
+        FileDeleter fileDeleter_;
 
-        const int ProcessorThreadSleep = 30;
+        // The cancellation token can't notify the delete thread, so it is checked at this interval.
+        const int CancellationCheckIntervalInMs = 500;
     };
 } // namespace microsoft::azure::connectedcar::fileuploadmodule
 #endif // DELETE_PROCESSOR_H
\ No newline at end of file
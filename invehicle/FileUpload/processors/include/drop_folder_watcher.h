@@ -0,0 +1,175 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef DROP_FOLDER_WATCHER_H
+#define DROP_FOLDER_WATCHER_H
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <set>
+#include <string>
+#include <threading_utils.h>
+#include <vector>
+
+#include "file_upload_settings.h"
+#include "upload_processor.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Upload request parameters of the files dropped into a watched directory
+     */
+    struct WatchRule
+    {
+        // Directory relative to the data container path, and glob pattern of the file names to upload.
+        std::string Directory;
+        std::string Pattern = "*";
+
+        int Priority = 0;
+        unsigned int TimeToLiveInSec = 3600;
+        unsigned int FileRetentionInSec = 0;
+        std::string Metadata;
+
+        // Content encoding of the uploaded files, see CompressionNames. Empty uses the compression rules.
+        std::string Compression;
+    };
+
+    /**
+     * @brief Parse a watch rule. Only Directory is required.
+     *
+     * @param j JSON object of the rule
+     * @param rule The watch rule
+     */
+    void from_json(const nlohmann::json &j, WatchRule &rule);
+
+    /**
+     * @brief Watches directories of the data container path with inotify, and requests uploads of the files
+     * written or moved into them, without a file upload request from another module. Files matching a rule
+     * are collected for a batch window and requested in one upload request per rule and window. The rule
+     * directories are scanned when the watches are added and whenever inotify drops events, so files that
+     * were written meanwhile are requested as well, unless they were requested or journaled already.
+     */
+    class DropFolderWatcher
+    {
+      public:
+        /**
+         * @brief Construct DropFolderWatcher object
+         *
+         * @param uploadProcessor Processor to enqueue the upload requests to
+         * @param settings File upload settings
+         */
+        DropFolderWatcher(const std::shared_ptr<UploadProcessor> &uploadProcessor, const FileUploadSettings &settings);
+
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~DropFolderWatcher() = default;
+
+        /**
+         * @brief Set data container path
+         *
+         * @param hostDataContainerPath container data path
+         */
+        void SetHostDataContainerPath(const std::string &hostDataContainerPath);
+
+        /**
+         * @brief Record the files of a journaled upload request, so the directory scans don't request them again.
+         * Called before the watcher is started.
+         *
+         * @param processMessage The journaled upload request
+         */
+        void AddJournaledFiles(const UploadProcessMessage &processMessage);
+
+        /**
+         * @brief Start the watcher thread. Watches the rule directories until cancellation is requested.
+         *
+         * @param cancellationToken cancellation token
+         */
+        void Start(const CancellationToken::Ptr cancellationToken);
+
+      private:
+        /**
+         * @brief Files collected for an upload request of a rule
+         */
+        struct PendingBatch
+        {
+            std::chrono::steady_clock::time_point FirstFileTime;
+            std::vector<std::string> FileList;
+            std::set<std::string> FileNames;
+        };
+
+        /**
+         * @brief Add a written file to the batch of the first rule of its directory that matches it. Hidden files
+         * are skipped.
+         *
+         * @param directory Watched directory, relative to the data container path
+         * @param fileName Name of the file
+         */
+        void AddFile(const std::string &directory, const std::string &fileName);
+
+        /**
+         * @brief Add the files of a watched directory that were not requested yet to the batches
+         *
+         * @param directory Watched directory, relative to the data container path
+         */
+        void ScanDirectory(const std::string &directory);
+
+        /**
+         * @brief Forget the requested files that no longer exist, such as those deleted after their upload
+         */
+        void PruneRequestedFiles();
+
+        /**
+         * @brief Get the path of a file relative to the data container path, as it is named in upload requests
+         *
+         * @param directory Watched directory, relative to the data container path
+         * @param fileName Name of the file
+         *
+         * @return the relative path
+         */
+        static std::string GetRelativePath(const std::string &directory, const std::string &fileName);
+
+        /**
+         * @brief Enqueue upload requests for the batches whose window elapsed or that are full
+         *
+         * @param force Enqueue every batch that holds a file
+         */
+        void FlushBatches(bool force);
+
+        /**
+         * @brief Enqueue the upload request of a batch
+         *
+         * @param rule The rule of the batch
+         * @param batch The batch
+         */
+        void EnqueueBatch(const WatchRule &rule, const PendingBatch &batch);
+
+        std::shared_ptr<UploadProcessor> uploadProcessor_;
+        std::string dataContainerPath_;
+
+        std::vector<WatchRule> rules_;
+        std::chrono::milliseconds batchWindow_;
+        size_t maxBatchFiles_;
+
+        // Pending batches by rule index.
+        std::map<size_t, PendingBatch> pendingBatches_;
+
+        // Files requested by the watcher or by journaled requests, relative to the data container path. The
+        // scans skip them, while a file written again still triggers a new request by its inotify event.
+        std::set<std::string> requestedFiles_;
+
+        // The requested files are pruned once they doubled since the last prune.
+        const size_t MinRequestedFilesPruneSize = 1024;
+        size_t requestedFilesPruneSize_ = MinRequestedFilesPruneSize;
+
+        // The cancellation token can't interrupt the poll on the inotify handle, so it is checked at this interval.
+        const int CancellationCheckIntervalInMs = 500;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // DROP_FOLDER_WATCHER_H
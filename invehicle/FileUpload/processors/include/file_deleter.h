@@ -0,0 +1,78 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef FILE_DELETER_H
+#define FILE_DELETER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Deletes batches of files on a pool of delete threads. Files are grouped by directory, and
+     * each directory is opened once and its files are unlinked relative to the directory handle, so
+     * the path of every file isn't resolved again. Directories are deleted from in parallel.
+     */
+    class FileDeleter
+    {
+      public:
+        /**
+         * @brief Construct FileDeleter object
+         *
+         * @param threadCount Number of delete threads
+         */
+        explicit FileDeleter(size_t threadCount);
+
+        /**
+         * @brief Stops the delete threads
+         */
+        virtual ~FileDeleter();
+
+        FileDeleter(const FileDeleter &) = delete;
+        FileDeleter &operator=(const FileDeleter &) = delete;
+
+        /**
+         * @brief Delete files, and wait until all of them were deleted. Files that don't exist are skipped.
+         *
+         * @param filePaths Paths of the files to delete
+         *
+         * @return number of deleted files
+         */
+        size_t DeleteFiles(const std::vector<std::string> &filePaths);
+
+      private:
+        /**
+         * @brief Delete thread loop. Runs queued tasks until the deleter is destroyed.
+         */
+        void RunWorker();
+
+        /**
+         * @brief Delete files of one directory
+         *
+         * @param directoryPath Path of the directory
+         * @param fileNames Names of the files in the directory
+         *
+         * @return number of deleted files
+         */
+        static size_t DeleteFilesInDirectory(
+            const std::string &directoryPath,
+            const std::vector<std::string> &fileNames);
+
+        std::vector<std::thread> workers_;
+        std::deque<std::function<void()>> tasks_;
+        std::mutex taskMutex_;
+        std::condition_variable taskAdded_;
+        bool stopping_ = false;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // FILE_DELETER_H
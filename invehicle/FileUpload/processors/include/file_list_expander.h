@@ -0,0 +1,160 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef FILE_LIST_EXPANDER_H
+#define FILE_LIST_EXPANDER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <threading_utils.h>
+#include <vector>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Expands FileList entries naming a directory or a glob pattern into the files they match, with
+     * a pool of threads walking the directories in parallel. Matched files are handed out while the walk
+     * is still running. The walk pauses while MaxBufferedFiles files wait to be taken.
+     *
+     * A directory matches every file below it. A glob pattern is matched by path component, so "*" does
+     * not match across directories. Hidden files and directories are skipped.
+     */
+    class FileListExpander
+    {
+      public:
+        /**
+         * @brief Construct FileListExpander object
+         *
+         * @param threadCount Number of threads walking directories
+         */
+        explicit FileListExpander(size_t threadCount);
+
+        /**
+         * @brief Stops the walk and the walking threads
+         */
+        virtual ~FileListExpander();
+
+        FileListExpander(const FileListExpander &) = delete;
+        FileListExpander &operator=(const FileListExpander &) = delete;
+
+        /**
+         * @brief Start walking the directories of the patterns
+         *
+         * @param containerDataPath ContainerDataPath shared with host, the patterns are relative to it
+         * @param patterns Directories and glob patterns to expand
+         * @param knownFiles Files that are not handed out again, relative to the container data path
+         */
+        void Start(
+            const std::string &containerDataPath,
+            const std::vector<std::string> &patterns,
+            const std::set<std::string> &knownFiles);
+
+        /**
+         * @brief Take the matched files found so far
+         *
+         * @param files Receives the matched files, relative to the container data path
+         * @param wait Block until a file is matched or the walk is complete
+         * @param cancellationToken cancellation token
+         *
+         * @return false once the walk is complete and every file was taken, or on cancellation
+         */
+        bool Next(std::vector<std::string> &files, bool wait, const CancellationToken::Ptr &cancellationToken);
+
+        /**
+         * @brief Check whether every directory was walked
+         *
+         * @return true if the walk is complete
+         */
+        bool IsComplete();
+
+        /**
+         * @brief Check whether a FileList entry is a directory or a glob pattern
+         *
+         * @param containerDataPath ContainerDataPath shared with host
+         * @param fileListEntry The FileList entry
+         *
+         * @return true if the entry must be expanded
+         */
+        static bool IsPattern(const std::string &containerDataPath, const std::string &fileListEntry);
+
+      private:
+        /**
+         * @brief A pattern split into its literal root directory and the glob components below it
+         */
+        struct FilePattern
+        {
+            std::string Root;
+
+            // Empty for a directory, which matches every file below it.
+            std::vector<std::string> Components;
+        };
+
+        /**
+         * @brief A directory to walk, relative to the container data path
+         */
+        struct ScanItem
+        {
+            std::string Directory;
+            size_t PatternIndex = 0;
+            size_t Depth = 0;
+        };
+
+        /**
+         * @brief Walking thread loop. Walks queued directories until the walk is complete or stopped.
+         */
+        void RunWorker();
+
+        /**
+         * @brief Walk one directory, queue its matching subdirectories and hand out its matching files
+         *
+         * @param scanItem The directory to walk
+         */
+        void ScanDirectory(const ScanItem &scanItem);
+
+        /**
+         * @brief Hand out matched files, waiting while the buffer is full
+         *
+         * @param files Matched files
+         */
+        void AddFiles(const std::vector<std::string> &files);
+
+        /**
+         * @brief Split a pattern into its root directory and glob components
+         *
+         * @param pattern The FileList entry
+         *
+         * @return the split pattern
+         */
+        static FilePattern ParsePattern(const std::string &pattern);
+
+        size_t threadCount_;
+        std::string containerDataPath_;
+        std::vector<FilePattern> patterns_;
+        std::vector<std::thread> workers_;
+
+        std::mutex mutex_;
+        std::condition_variable workAvailable_;
+        std::condition_variable filesAvailable_;
+        std::condition_variable spaceAvailable_;
+        std::deque<ScanItem> scanItems_;
+        size_t activeScans_ = 0;
+        std::deque<std::string> files_;
+        std::set<std::string> knownFiles_;
+        bool complete_ = false;
+        bool stopping_ = false;
+
+        const size_t MaxBufferedFiles = 4096;
+
+        // The cancellation token can't notify a waiting consumer, so it is checked at this interval.
+        const int CancellationCheckIntervalInMs = 500;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // FILE_LIST_EXPANDER_H
@@ -0,0 +1,165 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef INGRESS_QUEUE_H
+#define INGRESS_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <threading_utils.h>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief A message received from the MQTT broker, waiting to be dispatched
+     */
+    struct IngressMessage
+    {
+        std::string Payload;
+        std::string CorrelationId;
+        std::chrono::steady_clock::time_point ReceivedTime;
+    };
+
+    /**
+     * @brief Backpressure counters of the ingress queue
+     */
+    struct IngressMetrics
+    {
+        uint64_t ReceivedCount = 0;
+        uint64_t DispatchedCount = 0;
+        uint64_t DroppedCount = 0;
+        uint64_t BlockedCount = 0;
+        size_t Depth = 0;
+        size_t MaxDepth = 0;
+        uint64_t MaxQueueLatencyInMs = 0;
+    };
+
+    /**
+     * @brief Bounded lock-free queue between the MQTT callback threads and the message dispatcher thread.
+     * Any number of threads push, one thread pops. Pushing never takes a lock, unless the dispatcher is
+     * idle and must be woken up.
+     *
+     * When the queue is full, the overflow policy either drops the new message, or blocks the pushing
+     * thread until the dispatcher made room.
+     */
+    class IngressQueue
+    {
+      public:
+        /**
+         * @brief Construct IngressQueue object
+         *
+         * @param capacity Number of messages the queue holds, rounded up to a power of two
+         * @param dropWhenFull Drop new messages when the queue is full, instead of blocking the caller
+         */
+        IngressQueue(size_t capacity, bool dropWhenFull);
+
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~IngressQueue() = default;
+
+        IngressQueue(const IngressQueue &) = delete;
+        IngressQueue &operator=(const IngressQueue &) = delete;
+
+        /**
+         * @brief Push a received message. Called by the MQTT callback threads.
+         *
+         * @param message The received message
+         *
+         * @return false if the message was dropped
+         */
+        bool Push(IngressMessage message);
+
+        /**
+         * @brief Take the oldest message. Called by the dispatcher thread only. Blocks until a message is
+         * available or cancellation is requested.
+         *
+         * @param cancellationToken cancellation token
+         *
+         * @return the message, or std::nullopt on cancellation
+         */
+        std::optional<IngressMessage> Pop(const CancellationToken::Ptr &cancellationToken);
+
+        /**
+         * @brief Stop blocking pushing threads. Messages pushed afterwards into a full queue are dropped.
+         */
+        void Close();
+
+        /**
+         * @brief Get the backpressure counters
+         *
+         * @return the counters
+         */
+        IngressMetrics GetMetrics() const;
+
+      private:
+        /**
+         * @brief A slot of the ring buffer. The sequence tells whether the slot is free for the
+         * producer of a position, or filled for the consumer of a position.
+         */
+        struct Cell
+        {
+            std::atomic<size_t> Sequence;
+            IngressMessage Message;
+        };
+
+        /**
+         * @brief Try to push a message without waiting
+         *
+         * @param message The message, moved from on success
+         *
+         * @return false if the queue is full
+         */
+        bool TryPush(IngressMessage &message);
+
+        /**
+         * @brief Try to take a message without waiting
+         *
+         * @return the message, or std::nullopt if the queue is empty
+         */
+        std::optional<IngressMessage> TryPop();
+
+        /**
+         * @brief Get the number of queued messages
+         *
+         * @return number of queued messages
+         */
+        size_t GetDepth() const;
+
+        std::unique_ptr<Cell[]> cells_;
+        size_t mask_;
+        bool dropWhenFull_;
+
+        alignas(64) std::atomic<size_t> enqueuePosition_{0};
+        alignas(64) std::atomic<size_t> dequeuePosition_{0};
+
+        // The dispatcher waits on the condition only while the queue is empty and it announced it waits.
+        std::mutex waitMutex_;
+        std::condition_variable messageAvailable_;
+        std::condition_variable spaceAvailable_;
+        std::atomic<bool> consumerWaiting_{false};
+        std::atomic<size_t> producersWaiting_{0};
+        std::atomic<bool> closed_{false};
+
+        std::atomic<uint64_t> receivedCount_{0};
+        std::atomic<uint64_t> dispatchedCount_{0};
+        std::atomic<uint64_t> droppedCount_{0};
+        std::atomic<uint64_t> blockedCount_{0};
+        std::atomic<size_t> maxDepth_{0};
+        std::atomic<uint64_t> maxQueueLatencyInMs_{0};
+
+        // The cancellation token can't notify the waiting dispatcher, so it is checked at this interval.
+        const int CancellationCheckIntervalInMs = 500;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // INGRESS_QUEUE_H
@@ -0,0 +1,50 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef INTERNAL_MESSAGE_READER_H
+#define INTERNAL_MESSAGE_READER_H
+
+#include <string>
+#include <vector>
+
+#include "blob_upload_uri_response.h"
+#include "internal_message.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Decodes received messages straight into the data contracts with the SAX interface of the
+     * JSON parser, without building a JSON document first. Unknown properties are skipped.
+     */
+    class InternalMessageReader
+    {
+      public:
+        /**
+         * @brief Decode the internal message envelope. The payload is moved out of the parser, not copied.
+         *
+         * @param message The received message
+         *
+         * @return the internal message
+         *
+         * @throw std::invalid_argument if the message is not a valid internal message
+         */
+        static vehicle::datacontracts::InternalMessage ReadInternalMessage(const std::string &message);
+
+        /**
+         * @brief Decode a blob uri response payload, a single response or an array of responses
+         *
+         * @param payload The payload of the internal message
+         *
+         * @return the blob uri responses
+         *
+         * @throw std::invalid_argument if the payload is not a valid blob uri response
+         */
+        static std::vector<mcvp::datacontracts::BlobUploadUriResponse> ReadBlobUriResponses(
+            const std::string &payload);
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // INTERNAL_MESSAGE_READER_H
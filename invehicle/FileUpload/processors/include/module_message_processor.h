@@ -14,8 +14,15 @@
 #include <threading_utils.h>
 
 #include "auto_edge_hub_message.pb.h"
+#include "bandwidth_governor.h"
+#include "dedup_index.h"
 #include "delete_processor.h"
+#include "drop_folder_watcher.h"
+#include "file_upload_settings.h"
+#include "ingress_queue.h"
+#include "storage_governor.h"
 #include "upload_processor.h"
+#include "wire_codec.h"
 
 namespace microsoft::azure::connectedcar::fileuploadmodule
 {
@@ -26,8 +33,11 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
          * @brief Construct ModuleMessageProcessor object
          *
          * @param mqttClient The mqtt client to receive messages
+         * @param settings File upload settings
          */
-        explicit ModuleMessageProcessor(const std::shared_ptr<mqttclient::MqttClient> &mqttClient);
+        ModuleMessageProcessor(
+            const std::shared_ptr<mqttclient::MqttClient> &mqttClient,
+            const FileUploadSettings &settings);
 
         /**
          * @brief Virtual destructor
@@ -35,12 +45,35 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         virtual ~ModuleMessageProcessor() = default;
 
         /**
-         * @brief Processes a new message from the modules.
+         * @brief Queue a new message from the modules for the dispatcher thread. Called on the MQTT
+         * callback thread, so it doesn't parse the message.
          *
          * @param message Message received from the modules
          * @param correlationId The correlation id
          */
-        void ProcessMessageAsync(const std::string &message, const CorrelationId &correlationId);
+        void EnqueueMessage(const std::string &message, const CorrelationId &correlationId);
+
+        /**
+         * @brief Get the backpressure counters of the message queue
+         *
+         * @return the counters
+         */
+        IngressMetrics GetIngressMetrics() const;
+
+        /**
+         * @brief Get the achieved upload rate of each request priority
+         *
+         * @return the metrics by priority
+         */
+        std::vector<BandwidthClassMetrics> GetBandwidthMetrics() const;
+
+        /**
+         * @brief Open the upload journal and the dedup index under the data container path, and queue the
+         * upload and delete work the journal recovers. Called before subscribing to the MQTT broker.
+         *
+         * @param hostDataContainerPath The data container path from host.
+         */
+        void RecoverPendingWork(const std::string &hostDataContainerPath);
 
         /**
          * @brief Start processor threads.
@@ -53,6 +86,28 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
             const std::string &hostDataContainerPath);
 
       private:
+        /**
+         * @brief Processes a new message from the modules.
+         *
+         * @param message Message received from the modules
+         * @param correlationId The correlation id
+         */
+        void ProcessMessage(const std::string &message, const CorrelationId &correlationId);
+
+        /**
+         * @brief Dispatcher thread loop. Processes queued messages until cancellation is requested.
+         *
+         * @param cancellationToken The cancellation token
+         */
+        void RunDispatcher(const CancellationToken::Ptr cancellationToken);
+
+        /**
+         * @brief Log the achieved upload rate of each request priority that sent data since the last call
+         *
+         * @param loggedBytesSent Bytes sent until the last call, updated to the bytes sent until now
+         */
+        void LogBandwidthMetrics(uint64_t &loggedBytesSent) const;
+
         /**
          * @brief Start delete worker thread.
          *
@@ -73,9 +128,44 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
             const std::shared_ptr<UploadProcessor> &uploadProcessor,
             const CancellationToken::Ptr cancellationToken);
 
+        /**
+         * @brief Start storage governor thread.
+         *
+         * @param storageGovernor The storage governor to start its thread
+         * @param cancellationToken cancellation token
+         */
+        static void StartStorageGovernor(
+            const std::shared_ptr<StorageGovernor> &storageGovernor,
+            const CancellationToken::Ptr cancellationToken);
+
+        /**
+         * @brief Start drop folder watcher thread.
+         *
+         * @param dropFolderWatcher The drop folder watcher to start its thread
+         * @param cancellationToken cancellation token
+         */
+        static void StartDropFolderWatcher(
+            const std::shared_ptr<DropFolderWatcher> &dropFolderWatcher,
+            const CancellationToken::Ptr cancellationToken);
+
+        std::shared_ptr<WireCodec> wireCodec_;
         std::shared_ptr<BlobUriHandler> blobUriHandler_;
         std::shared_ptr<UploadProcessor> uploadProcessor_;
         std::shared_ptr<DeleteProcessor> deleteProcessor_;
+        std::shared_ptr<StorageGovernor> storageGovernor_;
+        std::shared_ptr<DropFolderWatcher> dropFolderWatcher_;
+        std::shared_ptr<UploadJournal> journal_;
+        size_t journalCompactionThreshold_;
+        std::shared_ptr<DedupIndex> dedupIndex_;
+        size_t dedupIndexCapacity_;
+        std::chrono::seconds dedupRetention_;
+        IngressQueue ingressQueue_;
+        std::shared_ptr<BandwidthGovernor> bandwidthGovernor_;
+
+        const int MetricsLogIntervalInSeconds = 60;
+
+        const std::string JournalDirectoryName = ".upload-journal";
+        const std::string DedupIndexDirectoryName = ".dedup-index";
     };
 } // namespace microsoft::azure::connectedcar::fileuploadmodule
 #endif // MODULE_MESSAGE_PROCESSOR_H
\ No newline at end of file
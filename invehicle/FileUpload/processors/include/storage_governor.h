@@ -0,0 +1,112 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef STORAGE_GOVERNOR_H
+#define STORAGE_GOVERNOR_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <threading_utils.h>
+
+#include "delete_processor.h"
+#include "file_upload_settings.h"
+#include "upload_processor.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Used space and inodes of a file system, in percent
+     */
+    struct StorageUsage
+    {
+        double UsedSpacePercent = 0;
+        double UsedInodesPercent = 0;
+    };
+
+    /**
+     * @brief Watches the file system of the data container path, and evicts files before retention
+     * expires when it fills up. Once the used space or inodes reach the high watermark, files are
+     * evicted until both are below the low watermark, or an eviction frees nothing: first the files of
+     * notified requests waiting for their retention to expire, then the queued requests with the lowest
+     * priority above the eviction priority floor.
+     */
+    class StorageGovernor
+    {
+      public:
+        /**
+         * @brief Construct StorageGovernor object
+         *
+         * @param uploadProcessor Processor holding the queued upload requests
+         * @param deleteProcessor Processor holding the requests waiting for their retention to expire
+         * @param settings File upload settings
+         */
+        StorageGovernor(
+            const std::shared_ptr<UploadProcessor> &uploadProcessor,
+            const std::shared_ptr<DeleteProcessor> &deleteProcessor,
+            const FileUploadSettings &settings);
+
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~StorageGovernor() = default;
+
+        /**
+         * @brief Set data container path
+         *
+         * @param hostDataContainerPath container data path
+         */
+        void SetHostDataContainerPath(const std::string &hostDataContainerPath);
+
+        /**
+         * @brief Start the storage governor thread. Checks the storage usage at the check interval until
+         * cancellation is requested.
+         *
+         * @param cancellationToken cancellation token
+         */
+        void Start(const CancellationToken::Ptr cancellationToken);
+
+        /**
+         * @brief Check the storage usage once, and evict files if it is above the high watermark
+         *
+         * @return number of evicted upload requests
+         */
+        size_t CheckStorage();
+
+      protected:
+        /**
+         * @brief Get the storage usage of the data container path
+         *
+         * @param usage The storage usage
+         *
+         * @return true if the usage could be read
+         */
+        virtual bool GetStorageUsage(StorageUsage &usage);
+
+      private:
+        /**
+         * @brief Get the reason of an eviction from the storage usage
+         *
+         * @param usage The storage usage
+         *
+         * @return the eviction reason
+         */
+        static std::string GetEvictionReason(const StorageUsage &usage);
+
+        std::shared_ptr<UploadProcessor> uploadProcessor_;
+        std::shared_ptr<DeleteProcessor> deleteProcessor_;
+        std::string dataContainerPath_;
+
+        double highWatermarkPercent_;
+        double lowWatermarkPercent_;
+        std::chrono::seconds checkInterval_;
+
+        // The cancellation token can't notify the governor thread, so it is checked at this interval.
+        const int CancellationCheckIntervalInMs = 500;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // STORAGE_GOVERNOR_H
@@ -0,0 +1,254 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef UPLOAD_JOURNAL_H
+#define UPLOAD_JOURNAL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "upload_process_message.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Pending work recovered from the journal
+     */
+    struct JournalReplay
+    {
+        // Accepted upload requests that were not notified yet, with the files uploaded so far.
+        std::vector<UploadProcessMessage> PendingUploads;
+
+        // Notified upload requests whose files were not deleted yet.
+        std::vector<UploadProcessMessage> PendingDeletes;
+
+        size_t RecordCount = 0;
+    };
+
+    /**
+     * @brief Append-only journal of upload requests, kept under the data container path so accepted
+     * requests and their retention survive a restart. Every event is appended as a JSON line, and a sync
+     * thread syncs the records appended since its last sync together, so appending never waits for the
+     * disk. Only accepted requests wait until their record is synced. The journal is compacted to the
+     * live requests when it is opened, and by the sync thread whenever most of its records belong to
+     * finished requests.
+     */
+    class UploadJournal
+    {
+      public:
+        /**
+         * @brief Construct UploadJournal object
+         *
+         * @param journalDirectory Directory to keep the journal in
+         * @param compactionThreshold Minimum number of records before the journal is compacted
+         */
+        UploadJournal(const std::string &journalDirectory, size_t compactionThreshold);
+
+        /**
+         * @brief Virtual destructor. Syncs the appended records and stops the sync thread.
+         */
+        virtual ~UploadJournal();
+
+        UploadJournal(const UploadJournal &) = delete;
+        UploadJournal &operator=(const UploadJournal &) = delete;
+
+        /**
+         * @brief Replay the journal, compact it, open it for appending, and start the sync thread
+         *
+         * @param containerDataPath ContainerDataPath shared with host
+         *
+         * @return The pending work recovered from the journal
+         */
+        JournalReplay Open(const std::string &containerDataPath);
+
+        /**
+         * @brief Record an accepted upload request, and wait until the record is synced
+         *
+         * @param processMessage Upload processing state message
+         * @param requestMessage The file upload request message as received
+         */
+        void RecordEnqueue(const UploadProcessMessage &processMessage, const std::string &requestMessage);
+
+        /**
+         * @brief Record a successfully uploaded file
+         *
+         * @param uploadId Upload id of the request
+         * @param fileIndex Index of the file in the upload file list
+         * @param duplicateOf Blob path holding the content of the file if it was not uploaded, or empty
+         * @param contentCrc64 Encoded CRC64 of the uploaded blob, or empty
+         */
+        void RecordFileUploaded(
+            const std::string &uploadId,
+            size_t fileIndex,
+            const std::string &duplicateOf = "",
+            const std::string &contentCrc64 = "");
+
+        /**
+         * @brief Record the successfully uploaded files of a pack with one record
+         *
+         * @param uploadId Upload id of the request
+         * @param fileIndexes Indexes of the packed files in the upload file list
+         * @param packBlobPath Blob path of the pack
+         */
+        void RecordPackUploaded(
+            const std::string &uploadId,
+            const std::vector<size_t> &fileIndexes,
+            const std::string &packBlobPath);
+
+        /**
+         * @brief Record files found by expanding the directories and glob patterns of a request. The files
+         * are appended to the upload file list of the request in the order they are recorded.
+         *
+         * @param uploadId Upload id of the request
+         * @param fileNames Names of the files, relative to the container data path
+         */
+        void RecordFilesDiscovered(const std::string &uploadId, const std::vector<std::string> &fileNames);
+
+        /**
+         * @brief Record that the directories and glob patterns of a request were expanded completely
+         *
+         * @param uploadId Upload id of the request
+         */
+        void RecordFileListExpanded(const std::string &uploadId);
+
+        /**
+         * @brief Record the final upload notification of a request
+         *
+         * @param uploadId Upload id of the request
+         */
+        void RecordNotified(const std::string &uploadId);
+
+        /**
+         * @brief Record that the files of a request were deleted. The request is finished.
+         *
+         * @param uploadId Upload id of the request
+         */
+        void RecordDeleted(const std::string &uploadId);
+
+      private:
+        /**
+         * @brief Journal state of an upload request
+         */
+        struct JournalEntry
+        {
+            std::string RequestMessage;
+            std::string CorrelationId;
+            int64_t TimeToLiveExpiry = 0;
+            int64_t FileRetentionExpiry = 0;
+            std::set<size_t> UploadedFiles;
+            std::map<size_t, std::string> DuplicateBlobs;
+            std::map<size_t, std::string> ContentCrc64s;
+
+            // Uploaded files recorded by pack records, by pack blob path. They are in UploadedFiles as well.
+            std::map<std::string, std::vector<size_t>> UploadedPacks;
+            size_t PackedFileCount = 0;
+            std::vector<std::string> DiscoveredFiles;
+            size_t DiscoveryRecordCount = 0;
+            bool FileListExpanded = false;
+            bool Notified = false;
+        };
+
+        /**
+         * @brief Apply a journal record to the in-memory state
+         *
+         * @param record The journal record
+         */
+        void ApplyRecord(const nlohmann::json &record);
+
+        /**
+         * @brief Apply a record and append it to the journal, to be synced by the sync thread.
+         * The caller must hold journalMutex_.
+         *
+         * @param record The journal record
+         *
+         * @return the sequence number of the record, see WaitForSync
+         */
+        uint64_t AppendRecord(const nlohmann::json &record);
+
+        /**
+         * @brief Wait until the sync thread synced a record. The caller must hold journalMutex_.
+         *
+         * @param journalLock Lock of journalMutex_
+         * @param sequence Sequence number of the record
+         */
+        void WaitForSync(std::unique_lock<std::mutex> &journalLock, uint64_t sequence);
+
+        /**
+         * @brief Sync thread loop. Syncs the appended records as one group, and compacts the journal once most
+         * of its records belong to finished requests.
+         */
+        void RunSync();
+
+        /**
+         * @brief Rewrite the journal with the records of the live requests only. The live records are written
+         * without holding journalMutex_, and records appended meanwhile are added before the journal is
+         * replaced. The caller must hold journalMutex_.
+         *
+         * @param journalLock Lock of journalMutex_
+         *
+         * @return true if the journal was rewritten
+         */
+        bool Compact(std::unique_lock<std::mutex> &journalLock);
+
+        /**
+         * @brief Get the number of records needed to describe an entry
+         *
+         * @param entry The journal entry
+         *
+         * @return number of records
+         */
+        static size_t GetRecordCount(const JournalEntry &entry);
+
+        /**
+         * @brief Convert a steady clock time point to milliseconds since the epoch, to survive a restart
+         *
+         * @param timePoint The steady clock time point
+         *
+         * @return milliseconds since the epoch
+         */
+        static int64_t ToUnixTimeInMs(std::chrono::steady_clock::time_point timePoint);
+
+        /**
+         * @brief Convert milliseconds since the epoch to a steady clock time point
+         *
+         * @param unixTimeInMs milliseconds since the epoch
+         *
+         * @return The steady clock time point
+         */
+        static std::chrono::steady_clock::time_point FromUnixTimeInMs(int64_t unixTimeInMs);
+
+        std::string journalDirectory_;
+        std::string journalPath_;
+        size_t compactionThreshold_;
+
+        std::mutex journalMutex_;
+        int fileDescriptor_ = -1;
+        std::map<std::string, JournalEntry> entries_;
+        size_t recordCount_ = 0;
+        size_t liveRecordCount_ = 0;
+
+        // Sequence numbers of the last appended and the last synced record.
+        uint64_t appendedSequence_ = 0;
+        uint64_t syncedSequence_ = 0;
+        std::condition_variable appendedCondition_;
+        std::condition_variable syncedCondition_;
+        bool stopping_ = false;
+        std::thread syncThread_;
+
+        // Records appended while the journal is compacted, to be added to the compacted journal.
+        bool compacting_ = false;
+        std::string compactionBacklog_;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // UPLOAD_JOURNAL_H
@@ -0,0 +1,152 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef UPLOAD_MESSAGE_QUEUE_H
+#define UPLOAD_MESSAGE_QUEUE_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <threading_utils.h>
+#include <vector>
+
+#include "upload_process_message.h"
+#include "upload_scheduling_policy.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Upload process message queue shared by a pool of upload workers. The messages are kept in one
+     * queue under one mutex, and a worker takes the first message by the scheduling policy. Aging makes the
+     * order depend on the current time, so the queue is scanned on every dequeue instead of being kept as a heap.
+     */
+    class UploadMessageQueue
+    {
+      public:
+        /**
+         * @brief Construct UploadMessageQueue object
+         *
+         * @param workerCount Number of workers taking messages from the queue
+         * @param schedulingPolicy Order of the queued messages
+         */
+        UploadMessageQueue(size_t workerCount, const std::shared_ptr<UploadSchedulingPolicy> &schedulingPolicy);
+
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~UploadMessageQueue() = default;
+
+        /**
+         * @brief Push a message and wake up a worker
+         *
+         * @param processMessage Upload processing state message
+         */
+        void Push(const UploadProcessMessage &processMessage);
+
+        /**
+         * @brief Hold a message back until it is due, then push it like Push
+         *
+         * @param processMessage Upload processing state message
+         * @param readyTime Time the message is due
+         */
+        void PushDelayed(const UploadProcessMessage &processMessage, std::chrono::steady_clock::time_point readyTime);
+
+        /**
+         * @brief Take the first message by the scheduling policy. Blocks until a message is available or
+         * cancellation is requested.
+         *
+         * @param cancellationToken cancellation token
+         *
+         * @return Process message, or std::nullopt on cancellation
+         */
+        std::optional<UploadProcessMessage> Pop(const CancellationToken::Ptr &cancellationToken);
+
+        /**
+         * @brief Remove the queued message with the lowest priority, which is the highest priority value, and
+         * the latest enqueued within a priority. Messages held back by PushDelayed are not considered.
+         *
+         * @param priorityFloor Messages with a priority value at or below the floor are never taken
+         *
+         * @return Process message, or std::nullopt if no message above the floor is queued
+         */
+        std::optional<UploadProcessMessage> TakeLowestPriority(int priorityFloor);
+
+        /**
+         * @brief Get the number of queued messages, without messages held back by PushDelayed
+         *
+         * @return number of queued messages
+         */
+        size_t Size();
+
+        /**
+         * @brief Get the number of messages held back by PushDelayed
+         *
+         * @return number of delayed messages
+         */
+        size_t DelayedSize();
+
+        /**
+         * @brief Get the number of workers
+         *
+         * @return number of workers
+         */
+        size_t GetWorkerCount() const;
+
+      private:
+        /**
+         * @brief A message held back until its ready time
+         */
+        struct DelayedMessage
+        {
+            std::chrono::steady_clock::time_point ReadyTime;
+            UploadProcessMessage ProcessMessage;
+        };
+
+        /**
+         * @brief Orders delayed messages by ready time, earliest first
+         */
+        struct CompareReadyTime
+        {
+            bool operator()(const DelayedMessage &m1, const DelayedMessage &m2) const
+            {
+                return m1.ReadyTime > m2.ReadyTime;
+            }
+        };
+
+        /**
+         * @brief Remove a queued message, by moving the last message into its place. The caller must hold
+         * queueMutex_.
+         *
+         * @param position Position of the message
+         *
+         * @return the message
+         */
+        UploadProcessMessage Remove(std::vector<UploadProcessMessage>::iterator position);
+
+        /**
+         * @brief Move the delayed messages that are due to the queue. The caller must hold queueMutex_.
+         *
+         * @param now The current time
+         */
+        void PushDueMessages(std::chrono::steady_clock::time_point now);
+
+        size_t workerCount_;
+        std::shared_ptr<UploadSchedulingPolicy> schedulingPolicy_;
+
+        std::mutex queueMutex_;
+        std::condition_variable messageAvailable_;
+        // The policies order messages of equal rank by their enqueue time, so the order of the vector doesn't matter.
+        std::vector<UploadProcessMessage> messages_;
+        std::priority_queue<DelayedMessage, std::vector<DelayedMessage>, CompareReadyTime> delayedMessages_;
+
+        // The cancellation token can't notify waiting workers, so it is checked at this interval.
+        const int CancellationCheckIntervalInMs = 500;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // UPLOAD_MESSAGE_QUEUE_H
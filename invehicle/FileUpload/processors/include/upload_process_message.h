@@ -9,9 +9,12 @@
 
 #include <chrono>
 #include <iostream>
+#include <map>
 #include <string>
+#include <sys/stat.h>
 #include <vector>
 
+#include "file_list_expander.h"
 #include "file_upload_notification.h"
 #include "file_upload_request_message.h"
 #include "file_upload_result.h"
@@ -29,11 +32,40 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         vehicle::datacontracts::FileUploadRequestMessage UploadRequestPayload;
         std::string ContainerDataPath;
         std::vector<vehicle::datacontracts::FileUploadResult> UploadFileList;
+
+        // FileList entries naming a directory or a glob pattern. They are expanded into UploadFileList
+        // while the request is uploaded, and cleared once the expansion completed.
+        std::vector<std::string> FilePatterns;
+
+        // Content encoding requested for the files of the request, see CompressionNames. Empty uses the
+        // compression rules of the module.
+        std::string Compression;
+
+        // Blob paths holding the content of files of UploadFileList that were not uploaded because the same
+        // content was uploaded before, by file index.
+        std::map<size_t, std::string> DuplicateBlobs;
+
+        // CRC64 of the uploaded blobs of files of UploadFileList, encoded like the x-ms-content-crc64 header,
+        // by file index.
+        std::map<size_t, std::string> ContentCrc64s;
+
+        // Failed upload attempts of each file of UploadFileList.
+        std::vector<unsigned int> FileFailedAttempts;
         bool UploadResult = false;
         std::chrono::system_clock::time_point LastUploadTime;
-        int RetriesRemaining = 3;
+        static const int MaxRetries = 3;
+        static inline const std::string RequestCompressionProperty = "Compression";
+        static inline const std::string DuplicateOfProperty = "DuplicateOf";
+        static inline const std::string ContentCrc64Property = "ContentCrc64";
+        int RetriesRemaining = MaxRetries;
         std::string CorrelationId;
 
+        // Scheduling state: queueing time of the request, bytes left to upload, and whether an upload
+        // attempt has started.
+        std::chrono::steady_clock::time_point EnqueuedTime;
+        uint64_t TotalBytes = 0;
+        bool Started = false;
+
         /**
          * @brief Create UploadProcessMessage object
          *
@@ -52,10 +84,64 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
 
             for (std::string fileName : uploadRequest.FileList)
             {
+                if (FileListExpander::IsPattern(containerDataPath, fileName))
+                {
+                    FilePatterns.push_back(fileName);
+                    continue;
+                }
+
                 vehicle::datacontracts::FileUploadResult uploadResult;
                 uploadResult.FileName = fileName;
                 UploadFileList.push_back(uploadResult);
             }
+
+            FileFailedAttempts.assign(UploadFileList.size(), 0);
+        }
+
+        /**
+         * @brief Get the compression requested by an upload request. The request contract has no
+         * compression, so it is an additional property of the request.
+         *
+         * @param request The JSON upload request
+         *
+         * @return the requested content encoding, or an empty string
+         */
+        static std::string GetRequestedCompression(const json &request)
+        {
+            return request.value(RequestCompressionProperty, std::string());
+        }
+
+        /**
+         * @brief Add files found by expanding FilePatterns to the upload file list
+         *
+         * @param fileNames Names of the files, relative to the container data path
+         */
+        void AddFiles(const std::vector<std::string> &fileNames)
+        {
+            for (const std::string &fileName : fileNames)
+            {
+                vehicle::datacontracts::FileUploadResult uploadResult;
+                uploadResult.FileName = fileName;
+                UploadFileList.push_back(uploadResult);
+            }
+
+            FileFailedAttempts.resize(UploadFileList.size(), 0);
+        }
+
+        /**
+         * @brief Update the total size of the files that are not uploaded yet
+         */
+        void UpdateTotalBytes()
+        {
+            TotalBytes = 0;
+            for (const vehicle::datacontracts::FileUploadResult &uploadResult : UploadFileList)
+            {
+                struct stat fileInfo;
+                if (!uploadResult.UploadResult && stat(GetLocalPath(uploadResult.FileName).c_str(), &fileInfo) == 0)
+                {
+                    TotalBytes += (uint64_t)fileInfo.st_size;
+                }
+            }
         }
 
         /**
@@ -114,7 +200,7 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
          *
          * @return local file path string
          */
-        std::string GetLocalPath(const std::string &fileName)
+        std::string GetLocalPath(const std::string &fileName) const
         {
             return ContainerDataPath + "/" + fileName;
         }
@@ -136,23 +222,46 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
          *
          * @return notification of file upload state.
          */
-        vehicle::datacontracts::FileUploadNotification CreateNotification()
+        vehicle::datacontracts::FileUploadNotification CreateNotification() const
         {
             vehicle::datacontracts::FileUploadNotification notification;
             notification.UploadId = UploadRequestPayload.UploadId;
             notification.UploadResult = UploadResult;
             notification.Metadata = UploadRequestPayload.Metadata;
-            for (vehicle::datacontracts::FileUploadResult uploadResult : UploadFileList)
+            for (size_t fileIndex = 0; fileIndex < UploadFileList.size(); fileIndex++)
             {
-                json json_data = uploadResult;
+                json json_data = UploadFileList[fileIndex];
+
+                // The upload result contract has no deduplication state or checksum, so they are additional
+                // properties.
+                auto duplicate = DuplicateBlobs.find(fileIndex);
+                if (duplicate != DuplicateBlobs.end())
+                {
+                    json_data[DuplicateOfProperty] = duplicate->second;
+                }
+                auto contentCrc64 = ContentCrc64s.find(fileIndex);
+                if (contentCrc64 != ContentCrc64s.end())
+                {
+                    json_data[ContentCrc64Property] = contentCrc64->second;
+                }
                 notification.UploadFileList.push_back(json_data.dump());
             }
 
-            std::time_t t = std::chrono::system_clock::to_time_t(LastUploadTime);
-            notification.LastUploadTime = std::ctime(&t);
+            notification.LastUploadTime = FormatLastUploadTime();
 
             return notification;
         }
+
+        /**
+         * @brief Format the last upload time for the file upload notification
+         *
+         * @return the last upload time in ctime format
+         */
+        std::string FormatLastUploadTime() const
+        {
+            std::time_t t = std::chrono::system_clock::to_time_t(LastUploadTime);
+            return std::ctime(&t);
+        }
     };
 } // namespace microsoft::azure::connectedcar::fileuploadmodule
 #endif // UPLOAD_PROCESS_MESSAGE_H
\ No newline at end of file
@@ -7,35 +7,47 @@
 #ifndef UPLOAD_PROCESSOR_H
 #define UPLOAD_PROCESSOR_H
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <mqtt_client.h>
 #include <mqtt_constants.h>
 #include <mutex>
 #include <optional>
 #include <queue>
+#include <random>
+#include <set>
 #include <string>
 #include <thread>
 #include <threading_utils.h>
 
 #include "../../handlers/include/blob_upload_handler.h"
 #include "../../handlers/include/blob_uri_handler.h"
+#include "dedup_index.h"
 #include "delete_processor.h"
+#include "file_list_expander.h"
 #include "file_upload_request_message.h"
+#include "file_upload_settings.h"
 #include "internal_message.h"
 #include "internal_message_types.h"
+#include "upload_journal.h"
+#include "upload_message_queue.h"
 #include "upload_process_message.h"
+#include "wire_codec.h"
 
 namespace microsoft::azure::connectedcar::fileuploadmodule
 {
     /**
-     * @brief ComparePriority for upload process message priority queue
+     * @brief Upload state of a message whose files are being uploaded by the upload engine
      */
-    struct ComparePriority
+    struct InFlightUploadMessage
     {
-        bool operator()(UploadProcessMessage const &p1, UploadProcessMessage const &p2)
-        {
-            return p1.UploadRequestPayload.Priority > p2.UploadRequestPayload.Priority;
-        }
+        UploadProcessMessage ProcessMessage;
+        size_t PendingFiles = 0;
+        std::mutex Mutex;
     };
 
     class UploadProcessor
@@ -47,11 +59,15 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
          * @param mqttClient The mqtt client to publish messages
          * @param blobUriHandler Blob upload uri handler
          * @param deleteProcessor Processor to delete file
+         * @param wireCodec Codec of the published messages
+         * @param settings File upload settings
          */
         UploadProcessor(
             const std::shared_ptr<mqttclient::MqttClient> &mqttClient,
             const std::shared_ptr<BlobUriHandler> &blobUriHandler,
-            const std::shared_ptr<DeleteProcessor> &deleteProcessor);
+            const std::shared_ptr<DeleteProcessor> &deleteProcessor,
+            const std::shared_ptr<WireCodec> &wireCodec,
+            const FileUploadSettings &settings);
 
         /**
          * @brief Virtual destructor
@@ -66,6 +82,34 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
          */
         void EnqueueProcess(const std::string &message, const CorrelationId &correlationId);
 
+        /**
+         * @brief Enqueue an upload request recovered from the journal
+         *
+         * @param processMessage Upload processing state message
+         */
+        void EnqueueRecovered(const UploadProcessMessage &processMessage);
+
+        /**
+         * @brief Set the journal to record accepted requests and their progress in
+         *
+         * @param journal The upload journal
+         */
+        void SetJournal(const std::shared_ptr<UploadJournal> &journal);
+
+        /**
+         * @brief Set the dedup index to drop repeated requests and skip uploading known content with
+         *
+         * @param dedupIndex The dedup index
+         */
+        void SetDedupIndex(const std::shared_ptr<DedupIndex> &dedupIndex);
+
+        /**
+         * @brief Set the bandwidth governor that limits the upload rate of the upload engine
+         *
+         * @param bandwidthGovernor The bandwidth governor
+         */
+        void SetBandwidthGovernor(const std::shared_ptr<BandwidthGovernor> &bandwidthGovernor);
+
         /**
          * @brief Set data container path
          *
@@ -74,22 +118,65 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         void SetHostDataContainerPath(const std::string &hostDataContainerPath);
 
         /**
-         * @brief Start upload process thread
+         * @brief Start the upload worker threads and the completion thread, and wait for them to stop on
+         * cancellation
          *
          * @param cancellationToken cancellation token
          */
         void Start(const CancellationToken::Ptr cancellationToken);
 
+        /**
+         * @brief Get the number of upload requests that expired in the queue before their first upload attempt
+         *
+         * @return number of requests expired before start
+         */
+        uint64_t GetExpiredBeforeStartCount() const;
+
+        /**
+         * @brief Evict the queued upload request with the lowest priority, to free storage. The request is
+         * notified as failed and its files are deleted right away. Requests at or below the eviction
+         * priority floor, being uploaded or waiting for a retry are not evicted.
+         *
+         * @param evictionReason Reason added to the upload notification
+         *
+         * @return true if a request was evicted
+         */
+        bool EvictPendingRequest(const std::string &evictionReason);
+
+        /**
+         * @brief Notify that the files of an already notified upload request were deleted before
+         * their retention expired
+         *
+         * @param processMessage Upload processing state message
+         * @param evictionReason Reason added to the upload notification
+         */
+        void NotifyEviction(UploadProcessMessage processMessage, const std::string &evictionReason);
+
       protected:
-        std::priority_queue<UploadProcessMessage, std::vector<UploadProcessMessage>, ComparePriority> messageQueue_;
+        UploadMessageQueue messageQueue_;
 
       private:
         /**
-         * @brief Dequeue process message from the priority queue
+         * @brief Upload worker loop. Takes messages from the queue until cancellation is requested.
+         *
+         * @param cancellationToken cancellation token
+         */
+        void RunWorker(const CancellationToken::Ptr &cancellationToken);
+
+        /**
+         * @brief Completion loop. Runs the posted completions until cancellation is requested.
+         *
+         * @param cancellationToken cancellation token
+         */
+        void RunCompletions(const CancellationToken::Ptr &cancellationToken);
+
+        /**
+         * @brief Post the completion of a transfer to the completion thread, so journaling and notifying
+         * never hold up the upload engine thread
          *
-         * @return Process message if messageQueue_ is not empty, or std::nullopt otherwise
+         * @param completion The completion to run
          */
-        std::optional<UploadProcessMessage> DequeueProcessMessage();
+        void PostCompletion(std::function<void()> completion);
 
         /**
          * @brief Request upload blob uri to DeviceToCloud (TelemetryModule)
@@ -100,11 +187,170 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         void RequestBlobUri(const std::string &blobPath, const CorrelationId &correlationId);
 
         /**
-         * @brief Start uploading files by request upload payload
+         * @brief Request upload blob uris of several blob paths, batched into messages of
+         * BlobUriRequestBatchSize blob paths
+         *
+         * @param blobPaths Upload blob paths
+         * @param correlationId The correlation id
+         */
+        void RequestBlobUris(const std::vector<std::string> &blobPaths, const CorrelationId &correlationId);
+
+        /**
+         * @brief Start uploading files by request upload payload. Files are handed to the upload
+         * engine, and the message is validated once the last of its files completed.
+         *
+         * @param processMessage Upload processing state message
+         * @param cancellationToken cancellation token
+         */
+        void UploadFiles(UploadProcessMessage &processMessage, const CancellationToken::Ptr &cancellationToken);
+
+        /**
+         * @brief Get the pack entry of a file if the file is small enough to be packed
+         *
+         * @param processMessage Upload processing state message
+         * @param fileName Name of the file, relative to the container data path
+         * @param entry Set to the pack entry of the file
+         *
+         * @return true if the file is packed
+         */
+        bool GetPackEntry(const UploadProcessMessage &processMessage, const std::string &fileName, PackEntry &entry)
+            const;
+
+        /**
+         * @brief Find the blob a file's content was uploaded to before. The file is hashed only if content of
+         * its size is indexed.
          *
          * @param processMessage Upload processing state message
+         * @param fileName Name of the file, relative to the container data path
+         *
+         * @return the blob path holding the content of the file, empty if the file needs to be uploaded
          */
-        void UploadFiles(UploadProcessMessage &processMessage);
+        std::string FindDuplicateBlob(const UploadProcessMessage &processMessage, const std::string &fileName);
+
+        /**
+         * @brief Acquire a blob uri for a pack and start uploading it. Every file of the pack completes with
+         * the upload state of the pack.
+         *
+         * @param processMessage Upload processing state message
+         * @param inFlightMessage The in-flight message
+         * @param entries The packed files
+         * @param fileIndexes Indexes of the packed files in the upload file list
+         * @param cancellationToken cancellation token
+         */
+        void UploadPack(
+            UploadProcessMessage &processMessage,
+            const std::shared_ptr<InFlightUploadMessage> &inFlightMessage,
+            std::vector<PackEntry> entries,
+            std::vector<size_t> fileIndexes,
+            const CancellationToken::Ptr &cancellationToken);
+
+        /**
+         * @brief Add files found by expanding the file list of a message to the message, its in-flight state,
+         * and the files left to upload
+         *
+         * @param processMessage Upload processing state message
+         * @param inFlightMessage The in-flight message
+         * @param fileNames Names of the found files
+         * @param pendingFileIndexes Indexes of the files left to upload
+         */
+        void AddExpandedFiles(
+            UploadProcessMessage &processMessage,
+            const std::shared_ptr<InFlightUploadMessage> &inFlightMessage,
+            const std::vector<std::string> &fileNames,
+            std::vector<size_t> &pendingFileIndexes);
+
+        /**
+         * @brief Record that the file list of a message was expanded completely
+         *
+         * @param processMessage Upload processing state message
+         * @param inFlightMessage The in-flight message
+         */
+        void CompleteFileListExpansion(
+            UploadProcessMessage &processMessage,
+            const std::shared_ptr<InFlightUploadMessage> &inFlightMessage);
+
+        /**
+         * @brief Record the upload state of a file of an in-flight message
+         *
+         * @param inFlightMessage The in-flight message
+         * @param fileIndex Index of the file in the upload file list
+         * @param uploadResult Upload state of the file
+         * @param duplicateOf Blob path holding the content of the file if it was not uploaded, or empty
+         * @param contentCrc64 Encoded CRC64 of the uploaded blob, or empty
+         */
+        void CompleteFileUpload(
+            const std::shared_ptr<InFlightUploadMessage> &inFlightMessage,
+            size_t fileIndex,
+            bool uploadResult,
+            const std::string &duplicateOf = "",
+            const std::string &contentCrc64 = "");
+
+        /**
+         * @brief Record the upload state of the files of a pack of an in-flight message. An uploaded pack is
+         * journaled with one record.
+         *
+         * @param inFlightMessage The in-flight message
+         * @param fileIndexes Indexes of the packed files in the upload file list
+         * @param packBlobPath Blob path of the pack
+         * @param uploadResult Upload state of the pack
+         */
+        void CompletePackUpload(
+            const std::shared_ptr<InFlightUploadMessage> &inFlightMessage,
+            const std::vector<size_t> &fileIndexes,
+            const std::string &packBlobPath,
+            bool uploadResult);
+
+        /**
+         * @brief Set the upload state of a file of a message, and count a failed attempt
+         *
+         * @param processMessage Upload processing state message
+         * @param fileIndex Index of the file in the upload file list
+         * @param uploadResult Upload state of the file
+         */
+        void SetFileUploadResult(UploadProcessMessage &processMessage, size_t fileIndex, bool uploadResult);
+
+        /**
+         * @brief Release pending files of an in-flight message, and validate the message
+         * once no file is pending anymore. On shutdown the message is left to the journal instead.
+         *
+         * @param inFlightMessage The in-flight message
+         * @param fileCount Number of files to release
+         */
+        void ReleasePendingFile(const std::shared_ptr<InFlightUploadMessage> &inFlightMessage, size_t fileCount = 1);
+
+        /**
+         * @brief Wait until fewer than MaxConcurrentFileUploads files are being uploaded, and take a slot
+         *
+         * @param cancellationToken cancellation token
+         *
+         * @return false if cancellation was requested before a slot was free
+         */
+        bool AcquireUploadSlot(const CancellationToken::Ptr &cancellationToken);
+
+        /**
+         * @brief Release an upload slot taken by AcquireUploadSlot
+         */
+        void ReleaseUploadSlot();
+
+        /**
+         * @brief Get the delay before the next attempt of a message, growing exponentially with its retries
+         *
+         * @param processMessage Upload processing state message, with the retry already counted
+         *
+         * @return the retry delay
+         */
+        std::chrono::milliseconds GetRetryDelay(const UploadProcessMessage &processMessage);
+
+        /**
+         * @brief Get the content encoding to upload a file with: the compression of its request, or else
+         * the encoding of the first compression rule matching the file name, or else the default compression
+         *
+         * @param processMessage Upload processing state message
+         * @param fileName Name of the file, relative to the container data path
+         *
+         * @return the content encoding, see CompressionNames
+         */
+        std::string GetCompression(const UploadProcessMessage &processMessage, const std::string &fileName) const;
 
         /**
          * @brief Validate file upload state from UploadProcessMessage
@@ -116,34 +362,78 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         /**
          * @brief Send final upload status notification to DeviceToCloud (TelemetryModule).
          *
-         * @param notification Upload notification message to DeviceToCloud (TelemetryModule)
+         * @param processMessage The upload request to notify
          * @param correlationId The correlation id
+         * @param evictionReason Reason the files were evicted, empty if they were not
          */
         void SendNotification(
-            const vehicle::datacontracts::FileUploadNotification &notification,
-            const CorrelationId &correlationId);
+            const UploadProcessMessage &processMessage,
+            const CorrelationId &correlationId,
+            const std::string &evictionReason = "");
 
         /**
          * @brief Publish message to MQTT broker
          *
-         * @param internalMessage the internal message to send MQTT broker
+         * @param message the encoded internal message to send MQTT broker
          * @param topic   the mqtt topic path
          * @param correlationId The correlation id
          */
         void PublishMessage(
-            const vehicle::datacontracts::InternalMessage &internalMessage,
+            const std::string &message,
             const std::string &topic,
             const CorrelationId &correlationId);
 
         std::shared_ptr<mqttclient::MqttClient> mqttClient_;
         std::shared_ptr<BlobUriHandler> blobUriHandler_;
         std::shared_ptr<DeleteProcessor> deleteProcessor_;
+        std::shared_ptr<WireCodec> wireCodec_;
+        std::shared_ptr<UploadJournal> journal_;
+        std::shared_ptr<DedupIndex> dedupIndex_;
+        std::mutex acceptMutex_;
 
-        BlobUploadHandler blobUploadHandler_;
         std::string dataContainerPath_;
-        std::mutex messageMutex_;
+        std::atomic<uint64_t> expiredBeforeStartCount_ = 0;
+
+        size_t blobUriRequestWindow_;
+        size_t blobUriRequestBatchSize_;
+
+        std::chrono::milliseconds retryBaseDelay_;
+        std::chrono::milliseconds retryMaxDelay_;
+        std::mutex randomMutex_;
+        std::mt19937_64 randomEngine_;
+
+        size_t fileListScanThreadCount_;
+
+        std::string defaultCompression_;
+        std::vector<CompressionRule> compressionRules_;
+
+        uint64_t packFileSizeThreshold_;
+        uint64_t packMaxSize_;
+        size_t packMaxFiles_;
+
+        int evictionPriorityFloor_;
+
+        size_t maxConcurrentFileUploads_;
+        size_t activeFileUploads_ = 0;
+        std::mutex uploadSlotMutex_;
+        std::condition_variable uploadSlotCondition_;
+
+        std::deque<std::function<void()>> completions_;
+        std::mutex completionMutex_;
+        std::condition_variable completionCondition_;
+
+        // Set by Start. Uploads that fail once cancellation is requested are not retried or notified.
+        CancellationToken::Ptr cancellationToken_;
+
+        // Declared last, so the upload engine stops before the state its completions use is destroyed.
+        BlobUploadHandler blobUploadHandler_;
+
+        const int MaxBackoffExponent = 16;
+
+        const int CancellationCheckIntervalInMs = 500;
 
-        const int ProcessorThreadSleepInSeconds = 1;
+        // Packs are uploaded to <UploadId>/.packs/<index of the first packed file>.tar.
+        const std::string PackDirectoryName = ".packs";
     };
 } // namespace microsoft::azure::connectedcar::fileuploadmodule
 #endif // UPLOAD_PROCESSOR_H
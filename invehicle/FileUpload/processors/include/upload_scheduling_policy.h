@@ -0,0 +1,115 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef UPLOAD_SCHEDULING_POLICY_H
+#define UPLOAD_SCHEDULING_POLICY_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "file_upload_settings.h"
+#include "upload_process_message.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Ordering policy of queued upload process messages
+     */
+    class UploadSchedulingPolicy
+    {
+      public:
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~UploadSchedulingPolicy() = default;
+
+        /**
+         * @brief Check whether a message should start before another one
+         *
+         * @param p1 Upload processing state message
+         * @param p2 Upload processing state message
+         * @param now Current time, the same for every comparison of one dequeue
+         *
+         * @return True if p1 should start before p2
+         */
+        virtual bool RunsBefore(
+            const UploadProcessMessage &p1,
+            const UploadProcessMessage &p2,
+            std::chrono::steady_clock::time_point now) const = 0;
+
+        /**
+         * @brief Create the policy selected by the settings
+         *
+         * @param settings File upload settings
+         *
+         * @return the scheduling policy
+         */
+        static std::shared_ptr<UploadSchedulingPolicy> Create(const FileUploadSettings &settings);
+    };
+
+    /**
+     * @brief Orders messages by priority only, in arrival order within a priority.
+     */
+    class PriorityFirstPolicy : public UploadSchedulingPolicy
+    {
+      public:
+        bool RunsBefore(
+            const UploadProcessMessage &p1,
+            const UploadProcessMessage &p2,
+            std::chrono::steady_clock::time_point now) const override;
+    };
+
+    /**
+     * @brief Orders messages by priority, raised by one level for every aging interval a message waited.
+     * Within a priority, the message whose time to live expires in an earlier deadline bucket runs first,
+     * then the message with fewer bytes to upload. The order holds across the queued messages of all upload
+     * workers.
+     */
+    class DeadlineAwarePolicy : public UploadSchedulingPolicy
+    {
+      public:
+        /**
+         * @brief Construct DeadlineAwarePolicy object
+         *
+         * @param agingInterval Waiting time that raises the priority of a message by one level
+         * @param deadlineBucket Width of the buckets deadlines are compared in, 0 compares them exactly
+         */
+        DeadlineAwarePolicy(std::chrono::seconds agingInterval, std::chrono::seconds deadlineBucket);
+
+        bool RunsBefore(
+            const UploadProcessMessage &p1,
+            const UploadProcessMessage &p2,
+            std::chrono::steady_clock::time_point now) const override;
+
+      private:
+        /**
+         * @brief Get the priority of a message raised by its waiting time. Lower values run first.
+         *
+         * @param processMessage Upload processing state message
+         * @param now Current time
+         *
+         * @return the effective priority
+         */
+        long long GetEffectivePriority(
+            const UploadProcessMessage &processMessage,
+            std::chrono::steady_clock::time_point now) const;
+
+        /**
+         * @brief Get the bucket the time to live expiry of a message falls in. Lower values run first.
+         *
+         * @param processMessage Upload processing state message
+         *
+         * @return the deadline bucket
+         */
+        long long GetDeadlineBucket(const UploadProcessMessage &processMessage) const;
+
+        std::chrono::seconds agingInterval_;
+        std::chrono::seconds deadlineBucket_;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // UPLOAD_SCHEDULING_POLICY_H
@@ -0,0 +1,159 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef WIRE_CODEC_H
+#define WIRE_CODEC_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "blob_upload_uri_response.h"
+#include "internal_message.h"
+#include "upload_process_message.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Encoding of a message exchanged with other modules
+     */
+    enum class WireFormat
+    {
+        Json,
+        Protobuf
+    };
+
+    /**
+     * @brief Encodes and decodes the messages exchanged with other modules, as JSON text or as the protobuf
+     * messages of file_upload_wire.proto. Received messages are decoded in the encoding they arrive in.
+     * Published messages are encoded in the configured encoding, or in auto mode in the encoding of the
+     * last received message, so the module answers its peers in the encoding they use.
+     */
+    class WireCodec
+    {
+      public:
+        /**
+         * @brief Construct WireCodec object
+         *
+         * @param wireFormat Encoding of published messages, see WireFormatNames
+         */
+        explicit WireCodec(const std::string &wireFormat);
+
+        /**
+         * @brief Virtual destructor
+         */
+        virtual ~WireCodec() = default;
+
+        /**
+         * @brief Detect the encoding of a received message. A JSON message is an object, and a protobuf
+         * envelope never starts with an opening brace.
+         *
+         * @param message The received message
+         *
+         * @return the encoding of the message
+         */
+        static WireFormat DetectFormat(const std::string &message);
+
+        /**
+         * @brief Decode the envelope of a received message
+         *
+         * @param message The received message
+         * @param format Set to the encoding of the message, which the payload is encoded in as well
+         *
+         * @return the internal message
+         *
+         * @throw std::invalid_argument if the message is not a valid internal message
+         */
+        vehicle::datacontracts::InternalMessage DecodeInternalMessage(const std::string &message, WireFormat &format);
+
+        /**
+         * @brief Decode a file upload request payload into the JSON text of the request contract, which is
+         * what the upload processor accepts and journals
+         *
+         * @param payload The payload of the internal message
+         * @param format The encoding of the payload
+         *
+         * @return the JSON text of the file upload request
+         *
+         * @throw std::invalid_argument if the payload is not a valid file upload request
+         */
+        std::string DecodeFileUploadRequest(const std::string &payload, WireFormat format) const;
+
+        /**
+         * @brief Decode a blob uri response payload, a single response or a batch of responses
+         *
+         * @param payload The payload of the internal message
+         * @param format The encoding of the payload
+         *
+         * @return the blob uri responses
+         *
+         * @throw std::invalid_argument if the payload is not a valid blob uri response
+         */
+        std::vector<mcvp::datacontracts::BlobUploadUriResponse> DecodeBlobUriResponses(
+            const std::string &payload,
+            WireFormat format) const;
+
+        /**
+         * @brief Decode a bandwidth limits payload into its JSON text, see BandwidthLimits::MessageType
+         *
+         * @param payload The payload of the internal message
+         * @param format The encoding of the payload
+         *
+         * @return the JSON text of the bandwidth limits
+         *
+         * @throw std::invalid_argument if the payload is not valid bandwidth limits
+         */
+        std::string DecodeBandwidthLimits(const std::string &payload, WireFormat format) const;
+
+        /**
+         * @brief Encode a blob uri request message
+         *
+         * @param blobPaths Paths of the requested blobs
+         * @param batched Whether the request is a batch. A JSON request for a single blob holds the plain path.
+         *
+         * @return the encoded internal message
+         */
+        std::string EncodeBlobUriRequest(const std::vector<std::string> &blobPaths, bool batched) const;
+
+        /**
+         * @brief Encode the file upload notification message of an upload request
+         *
+         * @param processMessage The upload request
+         * @param evictionReason Reason the files were evicted, empty if they were not
+         *
+         * @return the encoded internal message
+         */
+        std::string EncodeNotification(const UploadProcessMessage &processMessage, const std::string &evictionReason)
+            const;
+
+        /**
+         * @brief Get the encoding of published messages
+         *
+         * @return the encoding of published messages
+         */
+        WireFormat GetPublishFormat() const;
+
+      private:
+        /**
+         * @brief Encode an internal message envelope
+         *
+         * @param messageType The message type
+         * @param payload The encoded payload
+         * @param format The encoding of the envelope
+         *
+         * @return the encoded internal message
+         */
+        static std::string EncodeInternalMessage(
+            const std::string &messageType,
+            std::string payload,
+            WireFormat format);
+
+        bool followPeerFormat_;
+        std::atomic<WireFormat> publishFormat_;
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // WIRE_CODEC_H
@@ -0,0 +1,203 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+
+#include "include/ingress_queue.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Raise an atomic maximum to a value
+     */
+    template <typename T> static void UpdateMaximum(std::atomic<T> &maximum, T value)
+    {
+        T current = maximum.load(std::memory_order_relaxed);
+        while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    IngressQueue::IngressQueue(size_t capacity, bool dropWhenFull) : dropWhenFull_(dropWhenFull)
+    {
+        size_t cellCount = 2;
+        while (cellCount < capacity)
+        {
+            cellCount *= 2;
+        }
+
+        cells_ = std::make_unique<Cell[]>(cellCount);
+        for (size_t position = 0; position < cellCount; position++)
+        {
+            cells_[position].Sequence.store(position, std::memory_order_relaxed);
+        }
+        mask_ = cellCount - 1;
+    }
+
+    bool IngressQueue::Push(IngressMessage message)
+    {
+        receivedCount_.fetch_add(1, std::memory_order_relaxed);
+
+        if (!TryPush(message))
+        {
+            if (dropWhenFull_ || closed_)
+            {
+                droppedCount_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            // Blocking holds up the MQTT client, which is only preferred over losing messages
+            // because requests delivered at least once are acknowledged when the callback returns.
+            blockedCount_.fetch_add(1, std::memory_order_relaxed);
+            producersWaiting_++;
+            {
+                std::unique_lock<std::mutex> waitLock(waitMutex_);
+                while (!TryPush(message))
+                {
+                    if (closed_)
+                    {
+                        producersWaiting_--;
+                        droppedCount_.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+
+                    spaceAvailable_.wait_for(waitLock, std::chrono::milliseconds(CancellationCheckIntervalInMs));
+                }
+            }
+            producersWaiting_--;
+        }
+
+        UpdateMaximum(maxDepth_, GetDepth());
+
+        // The dispatcher announces that it waits before it checks the queue a last time, so either it
+        // sees this message or this thread sees it waiting.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (consumerWaiting_)
+        {
+            std::scoped_lock<std::mutex> waitLock(waitMutex_);
+            messageAvailable_.notify_one();
+        }
+
+        return true;
+    }
+
+    std::optional<IngressMessage> IngressQueue::Pop(const CancellationToken::Ptr &cancellationToken)
+    {
+        while (!cancellationToken->IsCancellationRequested())
+        {
+            std::optional<IngressMessage> message = TryPop();
+            if (message.has_value())
+            {
+                dispatchedCount_.fetch_add(1, std::memory_order_relaxed);
+                UpdateMaximum<uint64_t>(
+                    maxQueueLatencyInMs_,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - message->ReceivedTime)
+                        .count());
+
+                if (producersWaiting_ > 0)
+                {
+                    std::scoped_lock<std::mutex> waitLock(waitMutex_);
+                    spaceAvailable_.notify_all();
+                }
+
+                return message;
+            }
+
+            std::unique_lock<std::mutex> waitLock(waitMutex_);
+            consumerWaiting_ = true;
+            if (enqueuePosition_.load() == dequeuePosition_.load(std::memory_order_relaxed))
+            {
+                messageAvailable_.wait_for(waitLock, std::chrono::milliseconds(CancellationCheckIntervalInMs));
+            }
+            consumerWaiting_ = false;
+        }
+
+        return std::nullopt;
+    }
+
+    void IngressQueue::Close()
+    {
+        closed_ = true;
+
+        std::scoped_lock<std::mutex> waitLock(waitMutex_);
+        spaceAvailable_.notify_all();
+    }
+
+    IngressMetrics IngressQueue::GetMetrics() const
+    {
+        IngressMetrics metrics;
+        metrics.ReceivedCount = receivedCount_.load(std::memory_order_relaxed);
+        metrics.DispatchedCount = dispatchedCount_.load(std::memory_order_relaxed);
+        metrics.DroppedCount = droppedCount_.load(std::memory_order_relaxed);
+        metrics.BlockedCount = blockedCount_.load(std::memory_order_relaxed);
+        metrics.Depth = GetDepth();
+        metrics.MaxDepth = maxDepth_.load(std::memory_order_relaxed);
+        metrics.MaxQueueLatencyInMs = maxQueueLatencyInMs_.load(std::memory_order_relaxed);
+
+        return metrics;
+    }
+
+    size_t IngressQueue::GetDepth() const
+    {
+        // The positions are read at slightly different times, which can overstate the depth by a few messages.
+        size_t dequeuePosition = dequeuePosition_.load(std::memory_order_relaxed);
+        size_t enqueuePosition = enqueuePosition_.load(std::memory_order_relaxed);
+
+        return std::min(enqueuePosition - std::min(enqueuePosition, dequeuePosition), mask_ + 1);
+    }
+
+    bool IngressQueue::TryPush(IngressMessage &message)
+    {
+        size_t position = enqueuePosition_.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true)
+        {
+            cell = &cells_[position & mask_];
+            size_t sequence = cell->Sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+            if (difference == 0)
+            {
+                // The cell is free for this position, claim the position.
+                if (enqueuePosition_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                // The cell still holds the message of the previous round, the queue is full.
+                return false;
+            }
+            else
+            {
+                position = enqueuePosition_.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->Message = std::move(message);
+        cell->Sequence.store(position + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    std::optional<IngressMessage> IngressQueue::TryPop()
+    {
+        size_t position = dequeuePosition_.load(std::memory_order_relaxed);
+        Cell &cell = cells_[position & mask_];
+        if (cell.Sequence.load(std::memory_order_acquire) != position + 1)
+        {
+            return std::nullopt;
+        }
+
+        IngressMessage message = std::move(cell.Message);
+        cell.Sequence.store(position + mask_ + 1, std::memory_order_release);
+        dequeuePosition_.store(position + 1, std::memory_order_release);
+
+        return message;
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
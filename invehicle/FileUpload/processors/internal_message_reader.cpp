@@ -0,0 +1,243 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+
+#include "include/internal_message_reader.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    using namespace microsoft::azure::connectedcar::mcvp::datacontracts;
+    using namespace microsoft::azure::connectedcar::vehicle::datacontracts;
+    using namespace nlohmann;
+
+    namespace
+    {
+        /**
+         * @brief SAX handler that accepts any document. Readers override the events they decode, and
+         * track the nesting depth to skip the values they don't decode.
+         */
+        class ContractSaxReader : public json_sax<json>
+        {
+          public:
+            bool null() override
+            {
+                return true;
+            }
+
+            bool boolean(bool) override
+            {
+                return true;
+            }
+
+            bool number_integer(number_integer_t) override
+            {
+                return true;
+            }
+
+            bool number_unsigned(number_unsigned_t) override
+            {
+                return true;
+            }
+
+            bool number_float(number_float_t, const string_t &) override
+            {
+                return true;
+            }
+
+            bool string(string_t &) override
+            {
+                return true;
+            }
+
+            bool binary(binary_t &) override
+            {
+                return true;
+            }
+
+            bool start_object(std::size_t) override
+            {
+                depth_++;
+                return true;
+            }
+
+            bool key(string_t &key) override
+            {
+                key_ = std::move(key);
+                return true;
+            }
+
+            bool end_object() override
+            {
+                depth_--;
+                return true;
+            }
+
+            bool start_array(std::size_t) override
+            {
+                depth_++;
+                return true;
+            }
+
+            bool end_array() override
+            {
+                depth_--;
+                return true;
+            }
+
+            bool parse_error(std::size_t, const std::string &, const detail::exception &e) override
+            {
+                throw std::invalid_argument(e.what());
+            }
+
+          protected:
+            size_t depth_ = 0;
+            string_t key_;
+        };
+
+        /**
+         * @brief Decodes the MessageType and Payload properties of an internal message
+         */
+        class InternalMessageSaxReader : public ContractSaxReader
+        {
+          public:
+            bool string(string_t &value) override
+            {
+                if (depth_ != 1)
+                {
+                    return true;
+                }
+
+                if (key_ == "MessageType")
+                {
+                    internalMessage_.MessageType = std::move(value);
+                    hasMessageType_ = true;
+                }
+                else if (key_ == "Payload")
+                {
+                    internalMessage_.Payload = std::move(value);
+                    hasPayload_ = true;
+                }
+
+                return true;
+            }
+
+            InternalMessage TakeInternalMessage()
+            {
+                if (!hasMessageType_ || !hasPayload_)
+                {
+                    throw std::invalid_argument("The message has no MessageType or Payload.");
+                }
+
+                return std::move(internalMessage_);
+            }
+
+          private:
+            InternalMessage internalMessage_;
+            bool hasMessageType_ = false;
+            bool hasPayload_ = false;
+        };
+
+        /**
+         * @brief Decodes a blob uri response object, or an array of them
+         */
+        class BlobUriResponseSaxReader : public ContractSaxReader
+        {
+          public:
+            bool start_object(std::size_t elements) override
+            {
+                ContractSaxReader::start_object(elements);
+                if (IsResponseDepth())
+                {
+                    responses_.emplace_back();
+                    fieldCounts_.push_back(0);
+                }
+
+                return true;
+            }
+
+            bool start_array(std::size_t elements) override
+            {
+                if (depth_ == 0)
+                {
+                    isArray_ = true;
+                }
+
+                return ContractSaxReader::start_array(elements);
+            }
+
+            bool string(string_t &value) override
+            {
+                if (!IsResponseDepth() || responses_.empty())
+                {
+                    return true;
+                }
+
+                if (key_ == "RequestedFileName")
+                {
+                    responses_.back().RequestedFileName = std::move(value);
+                    fieldCounts_.back()++;
+                }
+                else if (key_ == "BlobSasUri")
+                {
+                    responses_.back().BlobSasUri = std::move(value);
+                    fieldCounts_.back()++;
+                }
+
+                return true;
+            }
+
+            std::vector<BlobUploadUriResponse> TakeResponses()
+            {
+                for (size_t fieldCount : fieldCounts_)
+                {
+                    if (fieldCount < 2)
+                    {
+                        throw std::invalid_argument("A blob uri response has no RequestedFileName or BlobSasUri.");
+                    }
+                }
+
+                return std::move(responses_);
+            }
+
+          private:
+            /**
+             * @brief Check whether the parser is inside a response object, but not inside its values
+             */
+            bool IsResponseDepth() const
+            {
+                return depth_ == (isArray_ ? 2 : 1);
+            }
+
+            std::vector<BlobUploadUriResponse> responses_;
+            std::vector<size_t> fieldCounts_;
+            bool isArray_ = false;
+        };
+    } // namespace
+
+    InternalMessage InternalMessageReader::ReadInternalMessage(const std::string &message)
+    {
+        InternalMessageSaxReader reader;
+        if (!json::sax_parse(message, &reader))
+        {
+            throw std::invalid_argument("The message is not valid JSON.");
+        }
+
+        return reader.TakeInternalMessage();
+    }
+
+    std::vector<BlobUploadUriResponse> InternalMessageReader::ReadBlobUriResponses(const std::string &payload)
+    {
+        BlobUriResponseSaxReader reader;
+        if (!json::sax_parse(payload, &reader))
+        {
+            throw std::invalid_argument("The blob uri response is not valid JSON.");
+        }
+
+        return reader.TakeResponses();
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
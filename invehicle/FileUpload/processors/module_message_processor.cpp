@@ -26,11 +26,71 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
     using namespace microsoft::azure::connectedcar::vehicle::datacontracts;
     using namespace nlohmann;
 
-    ModuleMessageProcessor::ModuleMessageProcessor(const std::shared_ptr<MqttClient> &mqttClient)
+    ModuleMessageProcessor::ModuleMessageProcessor(
+        const std::shared_ptr<MqttClient> &mqttClient,
+        const FileUploadSettings &settings) :
+        journalCompactionThreshold_(settings.JournalCompactionThreshold),
+        dedupIndexCapacity_(settings.DedupIndexCapacity),
+        dedupRetention_(settings.DedupRetentionInSeconds),
+        ingressQueue_(settings.IngressQueueCapacity, settings.IngressOverflowPolicy == IngressOverflowPolicyNames::Drop)
     {
-        blobUriHandler_ = std::make_shared<BlobUriHandler>();
-        deleteProcessor_ = std::make_shared<DeleteProcessor>();
-        uploadProcessor_ = std::make_shared<UploadProcessor>(mqttClient, blobUriHandler_, deleteProcessor_);
+        blobUriHandler_ = std::make_shared<BlobUriHandler>(
+            settings.BlobUriCacheCapacity,
+            std::chrono::seconds(settings.BlobUriMinValidityInSeconds));
+        deleteProcessor_ = std::make_shared<DeleteProcessor>(settings.DeleteThreadCount);
+        wireCodec_ = std::make_shared<WireCodec>(settings.WireFormat);
+        uploadProcessor_ =
+            std::make_shared<UploadProcessor>(mqttClient, blobUriHandler_, deleteProcessor_, wireCodec_, settings);
+        storageGovernor_ = std::make_shared<StorageGovernor>(uploadProcessor_, deleteProcessor_, settings);
+        dropFolderWatcher_ = std::make_shared<DropFolderWatcher>(uploadProcessor_, settings);
+
+        bandwidthGovernor_ = std::make_shared<BandwidthGovernor>(settings);
+        uploadProcessor_->SetBandwidthGovernor(bandwidthGovernor_);
+    }
+
+    void ModuleMessageProcessor::RecoverPendingWork(const std::string &hostDataContainerPath)
+    {
+        std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+        uploadProcessor_->SetHostDataContainerPath(hostDataContainerPath);
+
+        journal_ = std::make_shared<UploadJournal>(
+            hostDataContainerPath + "/" + JournalDirectoryName,
+            journalCompactionThreshold_);
+        JournalReplay replay = journal_->Open(hostDataContainerPath);
+
+        // Pending deletes whose retention already expired are deleted right away, and must be journaled.
+        uploadProcessor_->SetJournal(journal_);
+        deleteProcessor_->SetJournal(journal_);
+
+        dedupIndex_ = std::make_shared<DedupIndex>(
+            hostDataContainerPath + "/" + DedupIndexDirectoryName,
+            dedupIndexCapacity_,
+            dedupRetention_);
+        dedupIndex_->Open();
+        uploadProcessor_->SetDedupIndex(dedupIndex_);
+
+        // The drop folder watcher must not request the files of recovered requests again when it scans.
+        for (const UploadProcessMessage &processMessage : replay.PendingUploads)
+        {
+            dropFolderWatcher_->AddJournaledFiles(processMessage);
+            uploadProcessor_->EnqueueRecovered(processMessage);
+        }
+
+        for (const UploadProcessMessage &processMessage : replay.PendingDeletes)
+        {
+            dropFolderWatcher_->AddJournaledFiles(processMessage);
+            deleteProcessor_->Delete(processMessage);
+        }
+
+        LogInfo(
+            "Recovered %zu upload requests and %zu pending deletes from %zu journal records in %lld ms.",
+            replay.PendingUploads.size(),
+            replay.PendingDeletes.size(),
+            replay.RecordCount,
+            static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                       std::chrono::steady_clock::now() - startTime)
+                                       .count()));
     }
 
     void ModuleMessageProcessor::StartProcessorsAsync(
@@ -38,12 +98,20 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         const std::string &hostDataContainerPath)
     {
         uploadProcessor_->SetHostDataContainerPath(hostDataContainerPath);
+        storageGovernor_->SetHostDataContainerPath(hostDataContainerPath);
+        dropFolderWatcher_->SetHostDataContainerPath(hostDataContainerPath);
 
         std::thread deleteWorker = std::thread(StartDeleteWorker, deleteProcessor_, cancellationToken);
         std::thread uploadWorker = std::thread(StartUploadWorker, uploadProcessor_, cancellationToken);
+        std::thread storageWorker = std::thread(StartStorageGovernor, storageGovernor_, cancellationToken);
+        std::thread watchWorker = std::thread(StartDropFolderWatcher, dropFolderWatcher_, cancellationToken);
+        std::thread dispatcher = std::thread(&ModuleMessageProcessor::RunDispatcher, this, cancellationToken);
 
         deleteWorker.join();
         uploadWorker.join();
+        storageWorker.join();
+        watchWorker.join();
+        dispatcher.join();
     }
 
     void ModuleMessageProcessor::StartDeleteWorker(
@@ -60,25 +128,159 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         uploadProcessorPtr->Start(cancellationToken);
     }
 
-    void ModuleMessageProcessor::ProcessMessageAsync(const std::string &message, const CorrelationId &correlationId)
+    void ModuleMessageProcessor::StartStorageGovernor(
+        const std::shared_ptr<StorageGovernor> &storageGovernorPtr,
+        CancellationToken::Ptr cancellationToken)
+    {
+        storageGovernorPtr->Start(cancellationToken);
+    }
+
+    void ModuleMessageProcessor::StartDropFolderWatcher(
+        const std::shared_ptr<DropFolderWatcher> &dropFolderWatcherPtr,
+        CancellationToken::Ptr cancellationToken)
+    {
+        dropFolderWatcherPtr->Start(cancellationToken);
+    }
+
+    void ModuleMessageProcessor::EnqueueMessage(const std::string &message, const CorrelationId &correlationId)
+    {
+        IngressMessage ingressMessage;
+        ingressMessage.Payload = message;
+        ingressMessage.CorrelationId = correlationId.ToString();
+        ingressMessage.ReceivedTime = std::chrono::steady_clock::now();
+
+        if (!ingressQueue_.Push(std::move(ingressMessage)))
+        {
+            LogWarn(correlationId, "Dropped a message because the message queue is full.");
+        }
+    }
+
+    IngressMetrics ModuleMessageProcessor::GetIngressMetrics() const
+    {
+        return ingressQueue_.GetMetrics();
+    }
+
+    std::vector<BandwidthClassMetrics> ModuleMessageProcessor::GetBandwidthMetrics() const
+    {
+        return bandwidthGovernor_->GetMetrics();
+    }
+
+    void ModuleMessageProcessor::RunDispatcher(const CancellationToken::Ptr cancellationToken)
+    {
+        std::chrono::steady_clock::time_point nextMetricsLogTime =
+            std::chrono::steady_clock::now() + std::chrono::seconds(MetricsLogIntervalInSeconds);
+        uint64_t loggedReceivedCount = 0;
+        uint64_t loggedBytesSent = 0;
+
+        while (!cancellationToken->IsCancellationRequested())
+        {
+            std::optional<IngressMessage> ingressMessage = ingressQueue_.Pop(cancellationToken);
+            if (ingressMessage.has_value())
+            {
+                CorrelationId correlationId = CorrelationId(ingressMessage->CorrelationId);
+                LogTrace(correlationId, "New message: %s", ingressMessage->Payload.c_str());
+                ProcessMessage(ingressMessage->Payload, correlationId);
+            }
+
+            if (std::chrono::steady_clock::now() >= nextMetricsLogTime)
+            {
+                IngressMetrics metrics = ingressQueue_.GetMetrics();
+                if (metrics.ReceivedCount != loggedReceivedCount)
+                {
+                    LogInfo(
+                        "Message queue: %llu received, %llu dropped, %llu blocked, depth %zu, max depth %zu, "
+                        "max latency %llu ms.",
+                        static_cast<unsigned long long>(metrics.ReceivedCount),
+                        static_cast<unsigned long long>(metrics.DroppedCount),
+                        static_cast<unsigned long long>(metrics.BlockedCount),
+                        metrics.Depth,
+                        metrics.MaxDepth,
+                        static_cast<unsigned long long>(metrics.MaxQueueLatencyInMs));
+                    loggedReceivedCount = metrics.ReceivedCount;
+                }
+
+                LogBandwidthMetrics(loggedBytesSent);
+
+                nextMetricsLogTime =
+                    std::chrono::steady_clock::now() + std::chrono::seconds(MetricsLogIntervalInSeconds);
+            }
+        }
+
+        // Callbacks blocked on a full queue return once the dispatcher stopped.
+        ingressQueue_.Close();
+    }
+
+    void ModuleMessageProcessor::LogBandwidthMetrics(uint64_t &loggedBytesSent) const
+    {
+        std::vector<BandwidthClassMetrics> metrics = bandwidthGovernor_->GetMetrics();
+
+        uint64_t bytesSent = 0;
+        std::string classRates;
+        for (const BandwidthClassMetrics &classMetrics : metrics)
+        {
+            bytesSent += classMetrics.BytesSent;
+            classRates += ", priority " + std::to_string(classMetrics.Priority) + " " +
+                          std::to_string(classMetrics.RateInBytesPerSecond) + " B/s (weight " +
+                          std::to_string(classMetrics.Weight) + ", " + std::to_string(classMetrics.ActiveTransfers) +
+                          " transfers, " + std::to_string(classMetrics.ThrottledCount) + " throttled)";
+        }
+
+        if (bytesSent == loggedBytesSent)
+        {
+            return;
+        }
+
+        LogInfo(
+            "Upload bandwidth: limit %llu B/s%s.",
+            static_cast<unsigned long long>(bandwidthGovernor_->GetLimits().LimitInBytesPerSecond),
+            classRates.c_str());
+        loggedBytesSent = bytesSent;
+    }
+
+    void ModuleMessageProcessor::ProcessMessage(const std::string &message, const CorrelationId &correlationId)
     {
         try
         {
-            // Convert the message to json internal message
-            InternalMessage internalMessage = json::parse(message);
+            // The payload is encoded like the envelope, JSON or protobuf.
+            WireFormat format;
+            InternalMessage internalMessage = wireCodec_->DecodeInternalMessage(message, format);
             LogTrace("Received a \"" + internalMessage.MessageType + "\" message.");
 
             if (internalMessage.MessageType == InternalMessageTypes::FileUploadRequest)
             {
-                uploadProcessor_->EnqueueProcess(internalMessage.Payload, correlationId);
+                uploadProcessor_->EnqueueProcess(
+                    wireCodec_->DecodeFileUploadRequest(internalMessage.Payload, format),
+                    correlationId);
             }
             else if (internalMessage.MessageType == InternalMessageTypes::ArbitraryToDevice)
             {
-                BlobUploadUriResponse blobUriResponse = json::parse(internalMessage.Payload);
-                blobUriHandler_->AddBlobUri(
-                    blobUriResponse.RequestedFileName,
-                    blobUriResponse.BlobSasUri,
-                    correlationId);
+                // A batched blob uri request is answered with an array of responses.
+                std::vector<BlobUploadUriResponse> blobUriResponses =
+                    wireCodec_->DecodeBlobUriResponses(internalMessage.Payload, format);
+
+                for (const BlobUploadUriResponse &blobUriResponse : blobUriResponses)
+                {
+                    blobUriHandler_->AddBlobUri(
+                        blobUriResponse.RequestedFileName,
+                        blobUriResponse.BlobSasUri,
+                        correlationId);
+                }
+            }
+            else if (internalMessage.MessageType == BandwidthLimits::MessageType)
+            {
+                BandwidthLimits limits = bandwidthGovernor_->UpdateLimits(
+                    wireCodec_->DecodeBandwidthLimits(internalMessage.Payload, format));
+
+                std::string priorityWeights;
+                for (const auto &[priority, weight] : limits.PriorityWeights)
+                {
+                    priorityWeights += " " + std::to_string(priority) + ":" + std::to_string(weight);
+                }
+                LogInfo(
+                    correlationId,
+                    "Set the upload bandwidth limit to %llu B/s, priority weights%s.",
+                    static_cast<unsigned long long>(limits.LimitInBytesPerSecond),
+                    priorityWeights.empty() ? " none" : priorityWeights.c_str());
             }
             else
             {
@@ -91,5 +293,14 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         {
             LogWarn(correlationId, "Error in parsing message, %s.", e.what());
         }
+        catch (std::invalid_argument &e)
+        {
+            LogWarn(correlationId, "Error in parsing message, %s.", e.what());
+        }
+        catch (const std::exception &e)
+        {
+            // The dispatcher thread must keep running, an exception escaping it would terminate the module.
+            LogError(correlationId, "Error processing message, %s.", e.what());
+        }
     }
 } // namespace microsoft::azure::connectedcar::fileuploadmodule
\ No newline at end of file
@@ -0,0 +1,142 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <logging.h>
+#include <sys/statvfs.h>
+#include <thread>
+
+#include "include/storage_governor.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    StorageGovernor::StorageGovernor(
+        const std::shared_ptr<UploadProcessor> &uploadProcessor,
+        const std::shared_ptr<DeleteProcessor> &deleteProcessor,
+        const FileUploadSettings &settings) :
+        uploadProcessor_(uploadProcessor),
+        deleteProcessor_(deleteProcessor), highWatermarkPercent_(settings.StorageHighWatermarkPercent),
+        lowWatermarkPercent_(settings.StorageLowWatermarkPercent),
+        checkInterval_(std::chrono::seconds(settings.StorageCheckIntervalInSeconds))
+    {
+    }
+
+    void StorageGovernor::SetHostDataContainerPath(const std::string &hostDataContainerPath)
+    {
+        dataContainerPath_ = hostDataContainerPath;
+    }
+
+    void StorageGovernor::Start(const CancellationToken::Ptr cancellationToken)
+    {
+        if (checkInterval_.count() == 0)
+        {
+            LogInfo("The storage governor is disabled.");
+            return;
+        }
+
+        while (!cancellationToken->IsCancellationRequested())
+        {
+            CheckStorage();
+
+            std::chrono::steady_clock::time_point nextCheckTime = std::chrono::steady_clock::now() + checkInterval_;
+            while (!cancellationToken->IsCancellationRequested() && std::chrono::steady_clock::now() < nextCheckTime)
+            {
+                std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+                    nextCheckTime - std::chrono::steady_clock::now(),
+                    std::chrono::milliseconds(CancellationCheckIntervalInMs)));
+            }
+        }
+    }
+
+    size_t StorageGovernor::CheckStorage()
+    {
+        StorageUsage usage;
+        if (!GetStorageUsage(usage) ||
+            std::max(usage.UsedSpacePercent, usage.UsedInodesPercent) < highWatermarkPercent_)
+        {
+            return 0;
+        }
+
+        LogWarn(
+            "Storage of %s is above the high watermark, %.1f%% space and %.1f%% inodes used.",
+            dataContainerPath_.c_str(),
+            usage.UsedSpacePercent,
+            usage.UsedInodesPercent);
+
+        // Uploaded files are evicted first, they are only kept for their retention. Queued requests are
+        // evicted only when no uploaded files are left.
+        size_t evictedCount = 0;
+        while (std::max(usage.UsedSpacePercent, usage.UsedInodesPercent) >= lowWatermarkPercent_)
+        {
+            std::string evictionReason = GetEvictionReason(usage);
+
+            std::optional<UploadProcessMessage> retainedMessage = deleteProcessor_->EvictNext();
+            if (retainedMessage.has_value())
+            {
+                uploadProcessor_->NotifyEviction(*retainedMessage, evictionReason);
+            }
+            else if (!uploadProcessor_->EvictPendingRequest(evictionReason))
+            {
+                LogWarn("Storage is above the low watermark, but no upload request is left to evict.");
+                break;
+            }
+
+            evictedCount++;
+
+            // Files that are still open or were already deleted free nothing, so evicting more requests
+            // may not help either. Eviction resumes at the next check.
+            StorageUsage previousUsage = usage;
+            if (!GetStorageUsage(usage))
+            {
+                break;
+            }
+
+            if (usage.UsedSpacePercent >= previousUsage.UsedSpacePercent &&
+                usage.UsedInodesPercent >= previousUsage.UsedInodesPercent)
+            {
+                LogWarn("Evicting an upload request didn't free storage, stop evicting until the next check.");
+                break;
+            }
+        }
+
+        LogInfo(
+            "Evicted %zu upload requests, %.1f%% space and %.1f%% inodes used.",
+            evictedCount,
+            usage.UsedSpacePercent,
+            usage.UsedInodesPercent);
+
+        return evictedCount;
+    }
+
+    bool StorageGovernor::GetStorageUsage(StorageUsage &usage)
+    {
+        struct statvfs fileSystemInfo;
+        if (statvfs(dataContainerPath_.c_str(), &fileSystemInfo) != 0)
+        {
+            LogWarn("Failed to get the storage usage of %s.", dataContainerPath_.c_str());
+            return false;
+        }
+
+        // Blocks reserved for root are counted as used, since the module can't write to them.
+        usage.UsedSpacePercent = fileSystemInfo.f_blocks == 0
+                                     ? 0
+                                     : 100.0 * (fileSystemInfo.f_blocks - fileSystemInfo.f_bavail) /
+                                           fileSystemInfo.f_blocks;
+
+        // Some file systems don't have a fixed number of inodes and report none.
+        usage.UsedInodesPercent =
+            fileSystemInfo.f_files == 0
+                ? 0
+                : 100.0 * (fileSystemInfo.f_files - fileSystemInfo.f_favail) / fileSystemInfo.f_files;
+
+        return true;
+    }
+
+    std::string StorageGovernor::GetEvictionReason(const StorageUsage &usage)
+    {
+        return usage.UsedSpacePercent >= usage.UsedInodesPercent ? "LowDiskSpace" : "LowInodes";
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
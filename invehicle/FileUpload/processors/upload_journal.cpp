@@ -0,0 +1,617 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <fcntl.h>
+#include <fstream>
+#include <logging.h>
+#include <unistd.h>
+
+#include "include/upload_journal.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    using namespace microsoft::azure::connectedcar::vehicle::datacontracts;
+    using namespace nlohmann;
+
+    namespace JournalRecordTypes
+    {
+        static const std::string Enqueue = "Enqueue";
+        static const std::string FileUploaded = "FileUploaded";
+        static const std::string PackUploaded = "PackUploaded";
+        static const std::string FilesDiscovered = "FilesDiscovered";
+        static const std::string FileListExpanded = "FileListExpanded";
+        static const std::string Notified = "Notified";
+        static const std::string Deleted = "Deleted";
+    } // namespace JournalRecordTypes
+
+    static const std::string JournalFileName = "upload-journal.log";
+
+    static bool WriteAll(int fileDescriptor, const std::string &data)
+    {
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t result = write(fileDescriptor, data.data() + written, data.size() - written);
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            written += result;
+        }
+
+        return true;
+    }
+
+    UploadJournal::UploadJournal(const std::string &journalDirectory, size_t compactionThreshold) :
+        journalDirectory_(journalDirectory), journalPath_(journalDirectory + "/" + JournalFileName),
+        compactionThreshold_(compactionThreshold)
+    {
+    }
+
+    UploadJournal::~UploadJournal()
+    {
+        {
+            std::scoped_lock<std::mutex> journalLock(journalMutex_);
+            stopping_ = true;
+        }
+        appendedCondition_.notify_one();
+
+        if (syncThread_.joinable())
+        {
+            syncThread_.join();
+        }
+
+        if (fileDescriptor_ >= 0)
+        {
+            close(fileDescriptor_);
+        }
+    }
+
+    JournalReplay UploadJournal::Open(const std::string &containerDataPath)
+    {
+        std::unique_lock<std::mutex> journalLock(journalMutex_);
+
+        JournalReplay replay;
+
+        try
+        {
+            boost::filesystem::create_directories(journalDirectory_);
+        }
+        catch (boost::filesystem::filesystem_error &e)
+        {
+            LogWarn("Failed to create the upload journal directory, %s.", e.what());
+            return replay;
+        }
+
+        // The last line can be partially written if the module stopped during an append, so
+        // the replay stops at the first record that can't be parsed.
+        std::ifstream journalFile(journalPath_);
+        std::string line;
+        while (std::getline(journalFile, line))
+        {
+            try
+            {
+                ApplyRecord(json::parse(line));
+                replay.RecordCount++;
+            }
+            catch (const std::exception &e)
+            {
+                LogWarn("Stopped replaying the upload journal at an invalid record, %s.", e.what());
+                break;
+            }
+        }
+        journalFile.close();
+
+        for (const auto &[uploadId, entry] : entries_)
+        {
+            try
+            {
+                json request = json::parse(entry.RequestMessage);
+                FileUploadRequestMessage uploadRequest = request;
+
+                UploadProcessMessage processMessage;
+                processMessage.Create(uploadRequest, containerDataPath, entry.CorrelationId);
+                processMessage.Compression = UploadProcessMessage::GetRequestedCompression(request);
+                processMessage.UploadRequestPayload.TimeToLiveExpiry = FromUnixTimeInMs(entry.TimeToLiveExpiry);
+                processMessage.UploadRequestPayload.FileRetentionExpiry = FromUnixTimeInMs(entry.FileRetentionExpiry);
+                processMessage.EnqueuedTime = std::chrono::steady_clock::now();
+
+                // File indexes refer to the upload file list including the discovered files.
+                processMessage.AddFiles(entry.DiscoveredFiles);
+                if (entry.FileListExpanded)
+                {
+                    processMessage.FilePatterns.clear();
+                }
+
+                for (size_t fileIndex : entry.UploadedFiles)
+                {
+                    if (fileIndex < processMessage.UploadFileList.size())
+                    {
+                        processMessage.UploadFileList[fileIndex].UploadResult = true;
+                    }
+                }
+                processMessage.DuplicateBlobs = entry.DuplicateBlobs;
+                processMessage.ContentCrc64s = entry.ContentCrc64s;
+                processMessage.UpdateTotalBytes();
+
+                if (entry.Notified)
+                {
+                    replay.PendingDeletes.push_back(processMessage);
+                }
+                else
+                {
+                    replay.PendingUploads.push_back(processMessage);
+                }
+            }
+            catch (json::exception &e)
+            {
+                LogWarn(
+                    "Skipped an invalid upload request, %s, in the upload journal: %s.",
+                    uploadId.c_str(),
+                    e.what());
+            }
+        }
+
+        // Rewrite the journal with the live requests, which also drops a partially written record.
+        recordCount_ = replay.RecordCount;
+        if (!Compact(journalLock))
+        {
+            fileDescriptor_ = open(journalPath_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fileDescriptor_ < 0)
+            {
+                LogWarn("Failed to open the upload journal, %s.", journalPath_.c_str());
+            }
+        }
+
+        if (!syncThread_.joinable())
+        {
+            syncThread_ = std::thread(&UploadJournal::RunSync, this);
+        }
+
+        return replay;
+    }
+
+    void UploadJournal::RecordEnqueue(const UploadProcessMessage &processMessage, const std::string &requestMessage)
+    {
+        json record;
+        record["Type"] = JournalRecordTypes::Enqueue;
+        record["UploadId"] = processMessage.UploadRequestPayload.UploadId;
+        record["Request"] = requestMessage;
+        record["CorrelationId"] = processMessage.CorrelationId;
+        record["TimeToLiveExpiry"] = ToUnixTimeInMs(processMessage.UploadRequestPayload.TimeToLiveExpiry);
+        record["FileRetentionExpiry"] = ToUnixTimeInMs(processMessage.UploadRequestPayload.FileRetentionExpiry);
+
+        // The request is only acknowledged once it is on disk. Other records may be lost in a crash, which
+        // only costs an upload or a notification again.
+        std::unique_lock<std::mutex> journalLock(journalMutex_);
+        WaitForSync(journalLock, AppendRecord(record));
+    }
+
+    void UploadJournal::RecordFileUploaded(
+        const std::string &uploadId,
+        size_t fileIndex,
+        const std::string &duplicateOf,
+        const std::string &contentCrc64)
+    {
+        json record;
+        record["Type"] = JournalRecordTypes::FileUploaded;
+        record["UploadId"] = uploadId;
+        record["FileIndex"] = fileIndex;
+        if (!duplicateOf.empty())
+        {
+            record["DuplicateOf"] = duplicateOf;
+        }
+        if (!contentCrc64.empty())
+        {
+            record["ContentCrc64"] = contentCrc64;
+        }
+
+        std::scoped_lock<std::mutex> journalLock(journalMutex_);
+        AppendRecord(record);
+    }
+
+    void UploadJournal::RecordPackUploaded(
+        const std::string &uploadId,
+        const std::vector<size_t> &fileIndexes,
+        const std::string &packBlobPath)
+    {
+        json record;
+        record["Type"] = JournalRecordTypes::PackUploaded;
+        record["UploadId"] = uploadId;
+        record["FileIndexes"] = fileIndexes;
+        record["PackBlob"] = packBlobPath;
+
+        std::scoped_lock<std::mutex> journalLock(journalMutex_);
+        AppendRecord(record);
+    }
+
+    void UploadJournal::RecordFilesDiscovered(const std::string &uploadId, const std::vector<std::string> &fileNames)
+    {
+        json record;
+        record["Type"] = JournalRecordTypes::FilesDiscovered;
+        record["UploadId"] = uploadId;
+        record["FileList"] = fileNames;
+
+        std::scoped_lock<std::mutex> journalLock(journalMutex_);
+        AppendRecord(record);
+    }
+
+    void UploadJournal::RecordFileListExpanded(const std::string &uploadId)
+    {
+        json record;
+        record["Type"] = JournalRecordTypes::FileListExpanded;
+        record["UploadId"] = uploadId;
+
+        std::scoped_lock<std::mutex> journalLock(journalMutex_);
+        AppendRecord(record);
+    }
+
+    void UploadJournal::RecordNotified(const std::string &uploadId)
+    {
+        json record;
+        record["Type"] = JournalRecordTypes::Notified;
+        record["UploadId"] = uploadId;
+
+        std::scoped_lock<std::mutex> journalLock(journalMutex_);
+        AppendRecord(record);
+    }
+
+    void UploadJournal::RecordDeleted(const std::string &uploadId)
+    {
+        json record;
+        record["Type"] = JournalRecordTypes::Deleted;
+        record["UploadId"] = uploadId;
+
+        std::scoped_lock<std::mutex> journalLock(journalMutex_);
+        AppendRecord(record);
+    }
+
+    void UploadJournal::ApplyRecord(const json &record)
+    {
+        std::string type = record.at("Type").get<std::string>();
+        std::string uploadId = record.at("UploadId").get<std::string>();
+
+        if (type == JournalRecordTypes::Enqueue)
+        {
+            auto existing = entries_.find(uploadId);
+            if (existing != entries_.end())
+            {
+                liveRecordCount_ -= GetRecordCount(existing->second);
+            }
+
+            JournalEntry entry;
+            entry.RequestMessage = record.at("Request").get<std::string>();
+            entry.CorrelationId = record.at("CorrelationId").get<std::string>();
+            entry.TimeToLiveExpiry = record.at("TimeToLiveExpiry").get<int64_t>();
+            entry.FileRetentionExpiry = record.at("FileRetentionExpiry").get<int64_t>();
+            entries_[uploadId] = entry;
+            liveRecordCount_ += GetRecordCount(entry);
+            return;
+        }
+
+        // Events of a request that is not in the journal anymore are ignored.
+        auto it = entries_.find(uploadId);
+        if (it == entries_.end())
+        {
+            return;
+        }
+
+        JournalEntry &entry = it->second;
+        if (type == JournalRecordTypes::FileUploaded)
+        {
+            size_t fileIndex = record.at("FileIndex").get<size_t>();
+            if (entry.UploadedFiles.insert(fileIndex).second)
+            {
+                liveRecordCount_++;
+            }
+
+            auto duplicateOf = record.find("DuplicateOf");
+            if (duplicateOf != record.end())
+            {
+                entry.DuplicateBlobs[fileIndex] = duplicateOf->get<std::string>();
+            }
+
+            auto contentCrc64 = record.find("ContentCrc64");
+            if (contentCrc64 != record.end())
+            {
+                entry.ContentCrc64s[fileIndex] = contentCrc64->get<std::string>();
+            }
+        }
+        else if (type == JournalRecordTypes::PackUploaded)
+        {
+            // Only files not recorded before count as packed, so the live records are counted once.
+            std::vector<size_t> packedFiles;
+            for (size_t fileIndex : record.at("FileIndexes").get<std::vector<size_t>>())
+            {
+                if (entry.UploadedFiles.insert(fileIndex).second)
+                {
+                    packedFiles.push_back(fileIndex);
+                }
+            }
+
+            if (!packedFiles.empty())
+            {
+                std::vector<size_t> &pack = entry.UploadedPacks[record.at("PackBlob").get<std::string>()];
+                liveRecordCount_ += pack.empty() ? 1 : 0;
+                pack.insert(pack.end(), packedFiles.begin(), packedFiles.end());
+                entry.PackedFileCount += packedFiles.size();
+            }
+        }
+        else if (type == JournalRecordTypes::FilesDiscovered)
+        {
+            std::vector<std::string> fileNames = record.at("FileList").get<std::vector<std::string>>();
+            entry.DiscoveredFiles.insert(entry.DiscoveredFiles.end(), fileNames.begin(), fileNames.end());
+            entry.DiscoveryRecordCount++;
+            liveRecordCount_++;
+        }
+        else if (type == JournalRecordTypes::FileListExpanded)
+        {
+            if (!entry.FileListExpanded)
+            {
+                entry.FileListExpanded = true;
+                liveRecordCount_++;
+            }
+        }
+        else if (type == JournalRecordTypes::Notified)
+        {
+            if (!entry.Notified)
+            {
+                entry.Notified = true;
+                liveRecordCount_++;
+            }
+        }
+        else if (type == JournalRecordTypes::Deleted)
+        {
+            liveRecordCount_ -= GetRecordCount(entry);
+            entries_.erase(it);
+        }
+    }
+
+    uint64_t UploadJournal::AppendRecord(const json &record)
+    {
+        ApplyRecord(record);
+        recordCount_++;
+
+        if (fileDescriptor_ < 0)
+        {
+            return syncedSequence_;
+        }
+
+        std::string line = record.dump() + "\n";
+        if (!WriteAll(fileDescriptor_, line))
+        {
+            LogWarn("Failed to append to the upload journal, %s.", journalPath_.c_str());
+        }
+
+        if (compacting_)
+        {
+            compactionBacklog_ += line;
+        }
+
+        appendedSequence_++;
+        appendedCondition_.notify_one();
+
+        return appendedSequence_;
+    }
+
+    void UploadJournal::WaitForSync(std::unique_lock<std::mutex> &journalLock, uint64_t sequence)
+    {
+        syncedCondition_.wait(journalLock, [this, sequence] { return syncedSequence_ >= sequence || stopping_; });
+    }
+
+    void UploadJournal::RunSync()
+    {
+        std::unique_lock<std::mutex> journalLock(journalMutex_);
+        while (true)
+        {
+            appendedCondition_.wait(journalLock, [this] { return stopping_ || appendedSequence_ > syncedSequence_; });
+            if (appendedSequence_ == syncedSequence_)
+            {
+                break;
+            }
+
+            // Records appended while the disk syncs are synced together by the next round. The descriptor is
+            // duplicated, since a compaction may replace it meanwhile.
+            uint64_t sequence = appendedSequence_;
+            int fileDescriptor = dup(fileDescriptor_);
+            journalLock.unlock();
+
+            bool synced = fileDescriptor >= 0 && fdatasync(fileDescriptor) == 0;
+            if (fileDescriptor >= 0)
+            {
+                close(fileDescriptor);
+            }
+
+            journalLock.lock();
+            if (!synced)
+            {
+                LogWarn("Failed to sync the upload journal, %s.", journalPath_.c_str());
+            }
+
+            // Waiting requests are released even if the sync failed, like a failed append.
+            syncedSequence_ = std::max(syncedSequence_, sequence);
+            syncedCondition_.notify_all();
+
+            // Compact once most of the records belong to finished requests.
+            if (recordCount_ >= compactionThreshold_ && recordCount_ >= 2 * liveRecordCount_)
+            {
+                Compact(journalLock);
+            }
+        }
+    }
+
+    bool UploadJournal::Compact(std::unique_lock<std::mutex> &journalLock)
+    {
+        std::string records;
+        size_t liveRecordCount = 0;
+        for (auto &[uploadId, entry] : entries_)
+        {
+            json enqueueRecord;
+            enqueueRecord["Type"] = JournalRecordTypes::Enqueue;
+            enqueueRecord["UploadId"] = uploadId;
+            enqueueRecord["Request"] = entry.RequestMessage;
+            enqueueRecord["CorrelationId"] = entry.CorrelationId;
+            enqueueRecord["TimeToLiveExpiry"] = entry.TimeToLiveExpiry;
+            enqueueRecord["FileRetentionExpiry"] = entry.FileRetentionExpiry;
+            records += enqueueRecord.dump() + "\n";
+
+            // The discovered files are rewritten as one record, and must precede the indexes that refer to them.
+            if (!entry.DiscoveredFiles.empty())
+            {
+                json discoveredRecord;
+                discoveredRecord["Type"] = JournalRecordTypes::FilesDiscovered;
+                discoveredRecord["UploadId"] = uploadId;
+                discoveredRecord["FileList"] = entry.DiscoveredFiles;
+                records += discoveredRecord.dump() + "\n";
+            }
+
+            if (entry.FileListExpanded)
+            {
+                json expandedRecord;
+                expandedRecord["Type"] = JournalRecordTypes::FileListExpanded;
+                expandedRecord["UploadId"] = uploadId;
+                records += expandedRecord.dump() + "\n";
+            }
+
+            std::set<size_t> packedFiles;
+            for (const auto &[packBlobPath, fileIndexes] : entry.UploadedPacks)
+            {
+                json packRecord;
+                packRecord["Type"] = JournalRecordTypes::PackUploaded;
+                packRecord["UploadId"] = uploadId;
+                packRecord["FileIndexes"] = fileIndexes;
+                packRecord["PackBlob"] = packBlobPath;
+                records += packRecord.dump() + "\n";
+                packedFiles.insert(fileIndexes.begin(), fileIndexes.end());
+            }
+
+            for (size_t fileIndex : entry.UploadedFiles)
+            {
+                if (packedFiles.count(fileIndex) > 0)
+                {
+                    continue;
+                }
+
+                json fileRecord;
+                fileRecord["Type"] = JournalRecordTypes::FileUploaded;
+                fileRecord["UploadId"] = uploadId;
+                fileRecord["FileIndex"] = fileIndex;
+
+                auto duplicate = entry.DuplicateBlobs.find(fileIndex);
+                if (duplicate != entry.DuplicateBlobs.end())
+                {
+                    fileRecord["DuplicateOf"] = duplicate->second;
+                }
+
+                auto contentCrc64 = entry.ContentCrc64s.find(fileIndex);
+                if (contentCrc64 != entry.ContentCrc64s.end())
+                {
+                    fileRecord["ContentCrc64"] = contentCrc64->second;
+                }
+                records += fileRecord.dump() + "\n";
+            }
+
+            if (entry.Notified)
+            {
+                json notifiedRecord;
+                notifiedRecord["Type"] = JournalRecordTypes::Notified;
+                notifiedRecord["UploadId"] = uploadId;
+                records += notifiedRecord.dump() + "\n";
+            }
+
+            liveRecordCount += GetRecordCount(entry) - entry.DiscoveryRecordCount;
+            liveRecordCount += entry.DiscoveredFiles.empty() ? 0 : 1;
+            entry.DiscoveryRecordCount = entry.DiscoveredFiles.empty() ? 0 : 1;
+        }
+
+        // Records appended from here on are counted on top of the live records, and kept for the new journal.
+        size_t compactedRecordCount = recordCount_ - liveRecordCount;
+        recordCount_ = liveRecordCount;
+        liveRecordCount_ = liveRecordCount;
+        compacting_ = true;
+        compactionBacklog_.clear();
+        journalLock.unlock();
+
+        // Write the live records to a temporary file first, so a crash during compaction leaves
+        // either the old or the new journal behind.
+        std::string temporaryPath = journalPath_ + ".tmp";
+        int fileDescriptor = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool written = fileDescriptor >= 0 && WriteAll(fileDescriptor, records) && fdatasync(fileDescriptor) == 0;
+
+        journalLock.lock();
+        compacting_ = false;
+        if (written && !compactionBacklog_.empty())
+        {
+            written = WriteAll(fileDescriptor, compactionBacklog_) && fdatasync(fileDescriptor) == 0;
+        }
+        compactionBacklog_.clear();
+
+        if (fileDescriptor >= 0)
+        {
+            close(fileDescriptor);
+        }
+
+        if (!written || rename(temporaryPath.c_str(), journalPath_.c_str()) != 0)
+        {
+            LogWarn("Failed to compact the upload journal, %s.", journalPath_.c_str());
+            unlink(temporaryPath.c_str());
+            recordCount_ += compactedRecordCount;
+            return false;
+        }
+
+        if (fileDescriptor_ >= 0)
+        {
+            close(fileDescriptor_);
+        }
+
+        fileDescriptor_ = open(journalPath_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fileDescriptor_ < 0)
+        {
+            LogWarn("Failed to open the upload journal, %s.", journalPath_.c_str());
+        }
+
+        // Every appended record is in the synced new journal.
+        syncedSequence_ = appendedSequence_;
+        syncedCondition_.notify_all();
+
+        LogTrace(
+            "Compacted the upload journal from %zu to %zu records.",
+            recordCount_ + compactedRecordCount,
+            recordCount_);
+
+        return true;
+    }
+
+    size_t UploadJournal::GetRecordCount(const JournalEntry &entry)
+    {
+        return 1 + entry.UploadedFiles.size() - entry.PackedFileCount + entry.UploadedPacks.size() +
+               entry.DiscoveryRecordCount + (entry.FileListExpanded ? 1 : 0) + (entry.Notified ? 1 : 0);
+    }
+
+    int64_t UploadJournal::ToUnixTimeInMs(std::chrono::steady_clock::time_point timePoint)
+    {
+        std::chrono::steady_clock::duration remaining = timePoint - std::chrono::steady_clock::now();
+        std::chrono::system_clock::time_point systemTime =
+            std::chrono::system_clock::now() + std::chrono::duration_cast<std::chrono::system_clock::duration>(remaining);
+
+        return std::chrono::duration_cast<std::chrono::milliseconds>(systemTime.time_since_epoch()).count();
+    }
+
+    std::chrono::steady_clock::time_point UploadJournal::FromUnixTimeInMs(int64_t unixTimeInMs)
+    {
+        std::chrono::system_clock::time_point systemTime{std::chrono::milliseconds(unixTimeInMs)};
+
+        return std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                      systemTime - std::chrono::system_clock::now());
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
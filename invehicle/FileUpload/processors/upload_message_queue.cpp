@@ -0,0 +1,146 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+
+#include "include/upload_message_queue.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    UploadMessageQueue::UploadMessageQueue(
+        size_t workerCount,
+        const std::shared_ptr<UploadSchedulingPolicy> &schedulingPolicy) :
+        workerCount_(std::max<size_t>(1, workerCount)), schedulingPolicy_(schedulingPolicy)
+    {
+    }
+
+    void UploadMessageQueue::Push(const UploadProcessMessage &processMessage)
+    {
+        {
+            std::scoped_lock<std::mutex> queueLock(queueMutex_);
+            messages_.push_back(processMessage);
+        }
+
+        messageAvailable_.notify_one();
+    }
+
+    void UploadMessageQueue::PushDelayed(
+        const UploadProcessMessage &processMessage,
+        std::chrono::steady_clock::time_point readyTime)
+    {
+        // Waiting workers wake up at least every cancellation check interval, so they pick up the
+        // new ready time without being notified.
+        std::scoped_lock<std::mutex> queueLock(queueMutex_);
+        delayedMessages_.push(DelayedMessage{readyTime, processMessage});
+    }
+
+    void UploadMessageQueue::PushDueMessages(std::chrono::steady_clock::time_point now)
+    {
+        while (!delayedMessages_.empty() && delayedMessages_.top().ReadyTime <= now)
+        {
+            messages_.push_back(delayedMessages_.top().ProcessMessage);
+            delayedMessages_.pop();
+            messageAvailable_.notify_one();
+        }
+    }
+
+    std::optional<UploadProcessMessage> UploadMessageQueue::Pop(const CancellationToken::Ptr &cancellationToken)
+    {
+        std::unique_lock<std::mutex> queueLock(queueMutex_);
+        while (!cancellationToken->IsCancellationRequested())
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            PushDueMessages(now);
+
+            if (!messages_.empty())
+            {
+                // The same current time is used for every comparison, so aging can't make the order inconsistent.
+                auto first = messages_.begin();
+                for (auto it = std::next(first); it != messages_.end(); ++it)
+                {
+                    if (schedulingPolicy_->RunsBefore(*it, *first, now))
+                    {
+                        first = it;
+                    }
+                }
+
+                return Remove(first);
+            }
+
+            std::chrono::steady_clock::time_point wakeUpTime =
+                now + std::chrono::milliseconds(CancellationCheckIntervalInMs);
+            if (!delayedMessages_.empty())
+            {
+                wakeUpTime = std::min(wakeUpTime, delayedMessages_.top().ReadyTime);
+            }
+
+            messageAvailable_.wait_until(queueLock, wakeUpTime, [this] { return !messages_.empty(); });
+        }
+
+        return std::nullopt;
+    }
+
+    std::optional<UploadProcessMessage> UploadMessageQueue::TakeLowestPriority(int priorityFloor)
+    {
+        std::scoped_lock<std::mutex> queueLock(queueMutex_);
+
+        // The raw priority is used rather than the scheduling order, so a high-priority request that is
+        // only behind by its deadline or size is not evicted before low-priority ones.
+        auto lowest = messages_.end();
+        for (auto it = messages_.begin(); it != messages_.end(); ++it)
+        {
+            int priority = it->UploadRequestPayload.Priority;
+            if (priority <= priorityFloor)
+            {
+                continue;
+            }
+
+            if (lowest == messages_.end() || priority > lowest->UploadRequestPayload.Priority ||
+                (priority == lowest->UploadRequestPayload.Priority && it->EnqueuedTime > lowest->EnqueuedTime))
+            {
+                lowest = it;
+            }
+        }
+
+        if (lowest == messages_.end())
+        {
+            return std::nullopt;
+        }
+
+        return Remove(lowest);
+    }
+
+    size_t UploadMessageQueue::Size()
+    {
+        std::scoped_lock<std::mutex> queueLock(queueMutex_);
+        return messages_.size();
+    }
+
+    size_t UploadMessageQueue::DelayedSize()
+    {
+        std::scoped_lock<std::mutex> queueLock(queueMutex_);
+        return delayedMessages_.size();
+    }
+
+    size_t UploadMessageQueue::GetWorkerCount() const
+    {
+        return workerCount_;
+    }
+
+    UploadProcessMessage UploadMessageQueue::Remove(std::vector<UploadProcessMessage>::iterator position)
+    {
+        UploadProcessMessage processMessage = std::move(*position);
+        if (position != std::prev(messages_.end()))
+        {
+            *position = std::move(messages_.back());
+        }
+        messages_.pop_back();
+
+        return processMessage;
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -4,8 +4,12 @@
 //  </copyright>
 // ---------------------------------------------------------------------------------
 
+#include <algorithm>
+#include <fnmatch.h>
 #include <logging.h>
+#include <map>
 #include <nlohmann/json.hpp>
+#include <sys/stat.h>
 
 #include "include/upload_processor.h"
 #include "mqtt_client_exception.h"
@@ -21,10 +25,36 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
     UploadProcessor::UploadProcessor(
         const std::shared_ptr<MqttClient> &mqttClient,
         const std::shared_ptr<BlobUriHandler> &blobUriHandler,
-        const std::shared_ptr<DeleteProcessor> &deleteProcessor) :
+        const std::shared_ptr<DeleteProcessor> &deleteProcessor,
+        const std::shared_ptr<WireCodec> &wireCodec,
+        const FileUploadSettings &settings) :
+        messageQueue_(settings.UploadWorkerCount, UploadSchedulingPolicy::Create(settings)),
         mqttClient_(mqttClient),
-        blobUriHandler_(blobUriHandler), deleteProcessor_(deleteProcessor)
+        blobUriHandler_(blobUriHandler), deleteProcessor_(deleteProcessor), wireCodec_(wireCodec),
+        blobUriRequestWindow_(settings.BlobUriRequestWindow),
+        blobUriRequestBatchSize_(settings.BlobUriRequestBatchSize),
+        retryBaseDelay_(std::chrono::seconds(settings.RetryBaseDelayInSeconds)),
+        retryMaxDelay_(std::chrono::seconds(settings.RetryMaxDelayInSeconds)), randomEngine_(std::random_device()()),
+        fileListScanThreadCount_(settings.FileListScanThreadCount), defaultCompression_(settings.Compression),
+        packFileSizeThreshold_(settings.PackFileSizeThresholdInBytes), packMaxSize_(settings.PackMaxSizeInBytes),
+        packMaxFiles_(settings.PackMaxFiles),
+        evictionPriorityFloor_(static_cast<int>(settings.StorageEvictionPriorityFloor)),
+        maxConcurrentFileUploads_(settings.MaxConcurrentFileUploads),
+        blobUploadHandler_(settings)
     {
+        if (settings.CompressionRules.empty())
+        {
+            return;
+        }
+
+        try
+        {
+            compressionRules_ = json::parse(settings.CompressionRules).get<std::vector<CompressionRule>>();
+        }
+        catch (json::exception &e)
+        {
+            throw std::invalid_argument("Invalid compression rules, " + std::string(e.what()));
+        }
     }
 
     void UploadProcessor::SetHostDataContainerPath(const std::string &hostDataContainerPath)
@@ -32,6 +62,7 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         if (!hostDataContainerPath.empty())
         {
             dataContainerPath_ = hostDataContainerPath;
+            blobUploadHandler_.SetManifestDirectory(hostDataContainerPath);
         }
         else
         {
@@ -44,14 +75,39 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
     {
         try
         {
-            FileUploadRequestMessage uploadRequest = json::parse(message);
+            json request = json::parse(message);
+            FileUploadRequestMessage uploadRequest = request;
 
             UploadProcessMessage processMessage;
             processMessage.Create(uploadRequest, dataContainerPath_, correlationId.ToString());
+            processMessage.Compression = UploadProcessMessage::GetRequestedCompression(request);
+            processMessage.EnqueuedTime = std::chrono::steady_clock::now();
+            processMessage.UpdateTotalBytes();
+
+            // A request that is sent again, such as after a timeout of the sender, is uploaded only once. Requests
+            // are accepted one at a time, so one sent again meanwhile is checked after the first is recorded.
+            std::scoped_lock<std::mutex> acceptLock(acceptMutex_);
+            if (dedupIndex_ && dedupIndex_->HasUploadId(uploadRequest.UploadId))
+            {
+                LogWarn(
+                    correlationId,
+                    "Dropped the upload request %s, which was accepted before.",
+                    uploadRequest.UploadId.c_str());
+                return;
+            }
+
+            // The request is journaled before it is queued, so it is never lost once accepted. The upload id is
+            // recorded after that, so a request lost in a crash before it was journaled is accepted when sent again.
+            if (journal_)
+            {
+                journal_->RecordEnqueue(processMessage, message);
+            }
+            if (dedupIndex_)
+            {
+                dedupIndex_->AddUploadId(uploadRequest.UploadId);
+            }
 
-            messageMutex_.lock();
-            messageQueue_.push(processMessage);
-            messageMutex_.unlock();
+            messageQueue_.Push(processMessage);
         }
         catch (json::exception &e)
         {
@@ -59,72 +115,723 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         }
     }
 
-    std::optional<UploadProcessMessage> UploadProcessor::DequeueProcessMessage()
+    void UploadProcessor::EnqueueRecovered(const UploadProcessMessage &processMessage)
     {
-        std::unique_lock<std::mutex> dequeueLock(messageMutex_);
+        messageQueue_.Push(processMessage);
+    }
 
-        if (!messageQueue_.empty())
+    void UploadProcessor::SetJournal(const std::shared_ptr<UploadJournal> &journal)
+    {
+        journal_ = journal;
+    }
+
+    void UploadProcessor::SetDedupIndex(const std::shared_ptr<DedupIndex> &dedupIndex)
+    {
+        dedupIndex_ = dedupIndex;
+    }
+
+    void UploadProcessor::SetBandwidthGovernor(const std::shared_ptr<BandwidthGovernor> &bandwidthGovernor)
+    {
+        blobUploadHandler_.SetBandwidthGovernor(bandwidthGovernor);
+    }
+
+    void UploadProcessor::Start(const CancellationToken::Ptr cancellation_token)
+    {
+        cancellationToken_ = cancellation_token;
+
+        std::vector<std::thread> workers;
+        for (size_t workerIndex = 0; workerIndex < messageQueue_.GetWorkerCount(); workerIndex++)
         {
-            UploadProcessMessage processMessage = messageQueue_.top();
-            messageQueue_.pop();
-            return processMessage;
+            workers.emplace_back(&UploadProcessor::RunWorker, this, cancellation_token);
         }
+        workers.emplace_back(&UploadProcessor::RunCompletions, this, cancellation_token);
 
-        return std::nullopt;
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+
+        // Uploads still in flight fail, which releases their upload slots and pending files. The completion
+        // thread stopped already, so their completions run here.
+        blobUploadHandler_.Stop();
+
+        std::deque<std::function<void()>> completions;
+        {
+            std::scoped_lock<std::mutex> completionLock(completionMutex_);
+            completions.swap(completions_);
+        }
+
+        for (std::function<void()> &completion : completions)
+        {
+            completion();
+        }
     }
 
-    void UploadProcessor::Start(const CancellationToken::Ptr cancellation_token)
+    void UploadProcessor::RunWorker(const CancellationToken::Ptr &cancellationToken)
     {
-        while (!cancellation_token->IsCancellationRequested())
+        while (!cancellationToken->IsCancellationRequested())
         {
-            std::optional<UploadProcessMessage> processMessage = DequeueProcessMessage();
+            // Blocks until a message is queued, so queued messages start without delay.
+            std::optional<UploadProcessMessage> processMessage = messageQueue_.Pop(cancellationToken);
             if (processMessage.has_value() && !processMessage->IsEmptyMessage())
             {
-                UploadFiles(*processMessage);
+                if (!processMessage->Started && processMessage->HasExpired())
+                {
+                    uint64_t expiredBeforeStartCount = ++expiredBeforeStartCount_;
+                    LogWarn(
+                        CorrelationId(processMessage->CorrelationId),
+                        "Upload request %s expired in the queue before it started, %llu requests so far.",
+                        processMessage->UploadRequestPayload.UploadId.c_str(),
+                        static_cast<unsigned long long>(expiredBeforeStartCount));
+                }
+
+                processMessage->Started = true;
+                UploadFiles(*processMessage, cancellationToken);
             }
+        }
+    }
 
-            std::this_thread::sleep_for(std::chrono::seconds(ProcessorThreadSleepInSeconds));
+    void UploadProcessor::RunCompletions(const CancellationToken::Ptr &cancellationToken)
+    {
+        while (!cancellationToken->IsCancellationRequested())
+        {
+            std::deque<std::function<void()>> completions;
+            {
+                std::unique_lock<std::mutex> completionLock(completionMutex_);
+                completionCondition_.wait_for(
+                    completionLock,
+                    std::chrono::milliseconds(CancellationCheckIntervalInMs),
+                    [this] { return !completions_.empty(); });
+                completions.swap(completions_);
+            }
+
+            for (std::function<void()> &completion : completions)
+            {
+                completion();
+            }
         }
     }
 
-    void UploadProcessor::UploadFiles(UploadProcessMessage &processMessage)
+    void UploadProcessor::PostCompletion(std::function<void()> completion)
+    {
+        {
+            std::scoped_lock<std::mutex> completionLock(completionMutex_);
+            completions_.push_back(std::move(completion));
+        }
+
+        completionCondition_.notify_one();
+    }
+
+    uint64_t UploadProcessor::GetExpiredBeforeStartCount() const
+    {
+        return expiredBeforeStartCount_;
+    }
+
+    bool UploadProcessor::EvictPendingRequest(const std::string &evictionReason)
+    {
+        std::optional<UploadProcessMessage> processMessage = messageQueue_.TakeLowestPriority(evictionPriorityFloor_);
+        if (!processMessage.has_value())
+        {
+            return false;
+        }
+
+        CorrelationId correlationId = CorrelationId(processMessage->CorrelationId);
+        LogWarn(
+            correlationId,
+            "Evict the pending upload request, %s, with priority %d, %s.",
+            processMessage->UploadRequestPayload.UploadId.c_str(),
+            processMessage->UploadRequestPayload.Priority,
+            evictionReason.c_str());
+
+        for (const FileUploadResult &fileUpload : processMessage->UploadFileList)
+        {
+            if (!fileUpload.UploadResult)
+            {
+                blobUploadHandler_.DiscardProgress(processMessage->GetBlobPath(fileUpload.FileName));
+            }
+        }
+
+        SendNotification(*processMessage, correlationId, evictionReason);
+        if (journal_)
+        {
+            journal_->RecordNotified(processMessage->UploadRequestPayload.UploadId);
+        }
+
+        deleteProcessor_->DeleteNow(*processMessage);
+
+        return true;
+    }
+
+    void UploadProcessor::NotifyEviction(UploadProcessMessage processMessage, const std::string &evictionReason)
     {
         CorrelationId correlationId = CorrelationId(processMessage.CorrelationId);
+        LogWarn(
+            correlationId,
+            "Evicted the files of the upload request, %s, before their retention expired, %s.",
+            processMessage.UploadRequestPayload.UploadId.c_str(),
+            evictionReason.c_str());
 
-        processMessage.UploadResult = true;
-        for (FileUploadResult fileUpload : processMessage.UploadFileList)
+        SendNotification(processMessage, correlationId, evictionReason);
+    }
+
+    void UploadProcessor::UploadFiles(
+        UploadProcessMessage &processMessage,
+        const CancellationToken::Ptr &cancellationToken)
+    {
+        CorrelationId correlationId = CorrelationId(processMessage.CorrelationId);
+
+        std::shared_ptr<InFlightUploadMessage> inFlightMessage = std::make_shared<InFlightUploadMessage>();
+        inFlightMessage->ProcessMessage = processMessage;
+
+        // Hold one pending file while files are handed out, so the message can't be validated
+        // before the last file was started.
+        inFlightMessage->PendingFiles = 1;
+
+        std::vector<size_t> pendingFileIndexes;
+        for (size_t fileIndex = 0; fileIndex < processMessage.UploadFileList.size(); fileIndex++)
+        {
+            if (!processMessage.UploadFileList[fileIndex].UploadResult)
+            {
+                pendingFileIndexes.push_back(fileIndex);
+            }
+        }
+
+        // Directories and glob patterns are expanded while the files found so far are uploaded. Files already
+        // in the upload file list, including files found by an earlier attempt, are not added again.
+        std::unique_ptr<FileListExpander> fileListExpander;
+        bool expanding = !processMessage.FilePatterns.empty();
+        if (expanding)
+        {
+            std::set<std::string> knownFiles;
+            for (const FileUploadResult &fileUpload : processMessage.UploadFileList)
+            {
+                knownFiles.insert(fileUpload.FileName);
+            }
+
+            fileListExpander = std::make_unique<FileListExpander>(fileListScanThreadCount_);
+            fileListExpander->Start(processMessage.ContainerDataPath, processMessage.FilePatterns, knownFiles);
+        }
+
+        // Files whose content was uploaded before need no upload. They are keyed by the position of their
+        // file in the pending files, like the pack entries.
+        std::map<size_t, std::string> duplicateBlobs;
+
+        // Small files are collected into a pack, which is uploaded once it is full, and needs no blob uri
+        // per file. Pack entries are keyed by the position of their file in the pending files.
+        std::map<size_t, PackEntry> packEntries;
+        std::vector<PackEntry> pack;
+        std::vector<size_t> packFileIndexes;
+        uint64_t packSize = 0;
+
+        // Blob uris are requested for a window of files ahead of the file being uploaded, so the
+        // cloud round trips overlap with each other and with uploads in progress.
+        size_t requestedFiles = 0;
+        for (size_t position = 0;; position++)
         {
-            if (!processMessage.HasExpired() && !fileUpload.UploadResult)
+            // Take the files found so far, and wait for more only when no file is left to upload.
+            while (expanding && pendingFileIndexes.size() < position + blobUriRequestWindow_)
+            {
+                std::vector<std::string> fileNames;
+                bool wait = position >= pendingFileIndexes.size();
+                expanding = fileListExpander->Next(fileNames, wait, cancellationToken);
+
+                if (!fileNames.empty())
+                {
+                    AddExpandedFiles(processMessage, inFlightMessage, fileNames, pendingFileIndexes);
+                }
+                else if (!wait)
+                {
+                    break;
+                }
+            }
+
+            if (!expanding && fileListExpander && fileListExpander->IsComplete())
+            {
+                CompleteFileListExpansion(processMessage, inFlightMessage);
+                fileListExpander.reset();
+            }
+
+            if (position >= pendingFileIndexes.size() || processMessage.HasExpired())
+            {
+                break;
+            }
+
+            std::vector<std::string> blobPaths;
+            size_t requestWindowEnd = std::min(pendingFileIndexes.size(), position + blobUriRequestWindow_);
+            for (; requestedFiles < requestWindowEnd; requestedFiles++)
+            {
+                const FileUploadResult &requestedFile =
+                    processMessage.UploadFileList[pendingFileIndexes[requestedFiles]];
+
+                std::string duplicateBlob = FindDuplicateBlob(processMessage, requestedFile.FileName);
+                if (!duplicateBlob.empty())
+                {
+                    duplicateBlobs[requestedFiles] = std::move(duplicateBlob);
+                    continue;
+                }
+
+                PackEntry packEntry;
+                if (GetPackEntry(processMessage, requestedFile.FileName, packEntry))
+                {
+                    packEntries[requestedFiles] = std::move(packEntry);
+                    continue;
+                }
+
+                std::string blobPath = processMessage.GetBlobPath(requestedFile.FileName);
+
+                // A retried file reuses its cached uri while the token is still valid.
+                if (!blobUriHandler_->HasValidBlobUri(blobPath))
+                {
+                    blobPaths.push_back(blobPath);
+                }
+            }
+            RequestBlobUris(blobPaths, correlationId);
+
+            size_t fileIndex = pendingFileIndexes[position];
+            const FileUploadResult &fileUpload = processMessage.UploadFileList[fileIndex];
+
+            std::map<size_t, std::string>::iterator duplicateBlob = duplicateBlobs.find(position);
+            if (duplicateBlob != duplicateBlobs.end())
             {
-                std::string destinationBlobPath = processMessage.GetBlobPath(fileUpload.FileName);
-                RequestBlobUri(destinationBlobPath, correlationId);
-                std::string blobUri = blobUriHandler_->WaitForBlobUri(destinationBlobPath, 120, correlationId);
+                LogInfo(
+                    correlationId,
+                    "Skip uploading %s, its content was uploaded to %s.",
+                    fileUpload.FileName.c_str(),
+                    duplicateBlob->second.c_str());
 
-                if (!blobUri.empty())
                 {
-                    std::string localFilePath = processMessage.GetLocalPath(fileUpload.FileName);
-                    fileUpload.UploadResult = blobUploadHandler_.UploadBlob(localFilePath, blobUri);
+                    std::scoped_lock<std::mutex> inFlightLock(inFlightMessage->Mutex);
+                    inFlightMessage->PendingFiles++;
                 }
-                else
+
+                // Content at the file's own blob path was uploaded by an earlier attempt of this request.
+                bool ownBlob = duplicateBlob->second == processMessage.GetBlobPath(fileUpload.FileName);
+                CompleteFileUpload(inFlightMessage, fileIndex, true, ownBlob ? std::string() : duplicateBlob->second);
+                duplicateBlobs.erase(duplicateBlob);
+                continue;
+            }
+
+            std::map<size_t, PackEntry>::iterator packEntry = packEntries.find(position);
+            if (packEntry != packEntries.end())
+            {
+                uint64_t packedSize = TarPackStream::GetPackedSize(packEntry->second.Size);
+                if (!pack.empty() && (packSize + packedSize > packMaxSize_ || pack.size() >= packMaxFiles_))
                 {
-                    fileUpload.UploadResult = false;
+                    UploadPack(
+                        processMessage,
+                        inFlightMessage,
+                        std::move(pack),
+                        std::move(packFileIndexes),
+                        cancellationToken);
+                    pack.clear();
+                    packFileIndexes.clear();
+                    packSize = 0;
                 }
 
-                processMessage.LastUploadTime = std::chrono::system_clock::now();
-                processMessage.UploadResult = processMessage.UploadResult & fileUpload.UploadResult;
+                pack.push_back(std::move(packEntry->second));
+                packFileIndexes.push_back(fileIndex);
+                packSize += packedSize;
+                packEntries.erase(packEntry);
+                continue;
+            }
+
+            {
+                std::scoped_lock<std::mutex> inFlightLock(inFlightMessage->Mutex);
+                inFlightMessage->PendingFiles++;
+            }
+
+            std::string destinationBlobPath = processMessage.GetBlobPath(fileUpload.FileName);
+            std::string blobUri =
+                blobUriHandler_->WaitForBlobUri(destinationBlobPath, 120, correlationId, cancellationToken);
+
+            if (blobUri.empty())
+            {
+                CompleteFileUpload(inFlightMessage, fileIndex, false);
+                continue;
+            }
+
+            if (!AcquireUploadSlot(cancellationToken))
+            {
+                CompleteFileUpload(inFlightMessage, fileIndex, false);
+                break;
+            }
+
+            blobUploadHandler_.UploadBlobAsync(
+                processMessage.GetLocalPath(fileUpload.FileName),
+                blobUri,
+                processMessage.UploadRequestPayload.UploadId,
+                destinationBlobPath,
+                GetCompression(processMessage, fileUpload.FileName),
+                processMessage.UploadRequestPayload.Priority,
+                dedupIndex_ && dedupIndex_->IsContentEnabled(),
+                [this, inFlightMessage, fileIndex, destinationBlobPath](const BlobUploadResult &result) {
+                    ReleaseUploadSlot();
+                    PostCompletion([this, inFlightMessage, fileIndex, destinationBlobPath, result]() {
+                        if (result.Succeeded && dedupIndex_ && !result.ContentHash.empty())
+                        {
+                            dedupIndex_->AddContent(result.FileSize, result.ContentHash, destinationBlobPath);
+                        }
+                        CompleteFileUpload(
+                            inFlightMessage,
+                            fileIndex,
+                            result.Succeeded,
+                            std::string(),
+                            result.ContentCrc64);
+                    });
+                });
+        }
+
+        // An expired request leaves the rest of its files, including the last pack, to the notification.
+        if (!pack.empty() && !processMessage.HasExpired())
+        {
+            UploadPack(processMessage, inFlightMessage, std::move(pack), std::move(packFileIndexes), cancellationToken);
+        }
+
+        ReleasePendingFile(inFlightMessage);
+    }
+
+    bool UploadProcessor::GetPackEntry(
+        const UploadProcessMessage &processMessage,
+        const std::string &fileName,
+        PackEntry &entry) const
+    {
+        if (packFileSizeThreshold_ == 0 || !TarPackStream::CanPack(fileName))
+        {
+            return false;
+        }
+
+        struct stat fileInfo;
+        std::string localPath = processMessage.GetLocalPath(fileName);
+        if (stat(localPath.c_str(), &fileInfo) != 0 || !S_ISREG(fileInfo.st_mode) ||
+            (uint64_t)fileInfo.st_size >= packFileSizeThreshold_)
+        {
+            return false;
+        }
+
+        entry.FileName = fileName;
+        entry.LocalPath = localPath;
+        entry.Size = (uint64_t)fileInfo.st_size;
+        entry.ModifiedTime = (int64_t)fileInfo.st_mtime;
+
+        return true;
+    }
+
+    std::string UploadProcessor::FindDuplicateBlob(
+        const UploadProcessMessage &processMessage,
+        const std::string &fileName)
+    {
+        if (!dedupIndex_ || !dedupIndex_->IsContentEnabled())
+        {
+            return std::string();
+        }
+
+        struct stat fileInfo;
+        std::string localPath = processMessage.GetLocalPath(fileName);
+        if (stat(localPath.c_str(), &fileInfo) != 0 || !S_ISREG(fileInfo.st_mode) ||
+            !dedupIndex_->HasContentSize((uint64_t)fileInfo.st_size))
+        {
+            return std::string();
+        }
+
+        uint64_t fileSize = 0;
+        std::string contentHash;
+        if (!blobUploadHandler_.ComputeContentHash(localPath, fileSize, contentHash))
+        {
+            return std::string();
+        }
+
+        return dedupIndex_->FindContent(fileSize, contentHash);
+    }
+
+    void UploadProcessor::UploadPack(
+        UploadProcessMessage &processMessage,
+        const std::shared_ptr<InFlightUploadMessage> &inFlightMessage,
+        std::vector<PackEntry> entries,
+        std::vector<size_t> fileIndexes,
+        const CancellationToken::Ptr &cancellationToken)
+    {
+        CorrelationId correlationId = CorrelationId(processMessage.CorrelationId);
+
+        {
+            std::scoped_lock<std::mutex> inFlightLock(inFlightMessage->Mutex);
+            inFlightMessage->PendingFiles += fileIndexes.size();
+        }
+
+        // The pack is named after its first file, so a retry of the same files reuses its name.
+        std::string packName = PackDirectoryName + "/" + std::to_string(fileIndexes.front()) + ".tar";
+        std::string blobPath = processMessage.GetBlobPath(packName);
+        if (!blobUriHandler_->HasValidBlobUri(blobPath))
+        {
+            RequestBlobUri(blobPath, correlationId);
+        }
+
+        std::string blobUri = blobUriHandler_->WaitForBlobUri(blobPath, 120, correlationId, cancellationToken);
+        if (blobUri.empty())
+        {
+            CompletePackUpload(inFlightMessage, fileIndexes, blobPath, false);
+            return;
+        }
+
+        LogInfo(correlationId, "Upload %zu small files as the pack %s.", fileIndexes.size(), blobPath.c_str());
+
+        if (!AcquireUploadSlot(cancellationToken))
+        {
+            CompletePackUpload(inFlightMessage, fileIndexes, blobPath, false);
+            return;
+        }
+
+        blobUploadHandler_.UploadPackAsync(
+            std::move(entries),
+            blobUri,
+            processMessage.UploadRequestPayload.UploadId,
+            blobPath,
+            GetCompression(processMessage, packName),
+            processMessage.UploadRequestPayload.Priority,
+            [this, inFlightMessage, fileIndexes, blobPath](const BlobUploadResult &result) {
+                ReleaseUploadSlot();
+                PostCompletion([this, inFlightMessage, fileIndexes, blobPath, result]() {
+                    CompletePackUpload(inFlightMessage, fileIndexes, blobPath, result.Succeeded);
+                });
+            });
+    }
+
+    void UploadProcessor::AddExpandedFiles(
+        UploadProcessMessage &processMessage,
+        const std::shared_ptr<InFlightUploadMessage> &inFlightMessage,
+        const std::vector<std::string> &fileNames,
+        std::vector<size_t> &pendingFileIndexes)
+    {
+        // The files are journaled before they are uploaded, so the journaled file indexes refer to them.
+        if (journal_)
+        {
+            journal_->RecordFilesDiscovered(processMessage.UploadRequestPayload.UploadId, fileNames);
+        }
+
+        for (size_t fileIndex = processMessage.UploadFileList.size();
+             fileIndex < processMessage.UploadFileList.size() + fileNames.size();
+             fileIndex++)
+        {
+            pendingFileIndexes.push_back(fileIndex);
+        }
+
+        processMessage.AddFiles(fileNames);
+
+        std::scoped_lock<std::mutex> inFlightLock(inFlightMessage->Mutex);
+        inFlightMessage->ProcessMessage.AddFiles(fileNames);
+    }
+
+    void UploadProcessor::CompleteFileListExpansion(
+        UploadProcessMessage &processMessage,
+        const std::shared_ptr<InFlightUploadMessage> &inFlightMessage)
+    {
+        LogInfo(
+            CorrelationId(processMessage.CorrelationId),
+            "Expanded the file list of %s to %zu files.",
+            processMessage.UploadRequestPayload.UploadId.c_str(),
+            processMessage.UploadFileList.size());
+
+        if (journal_)
+        {
+            journal_->RecordFileListExpanded(processMessage.UploadRequestPayload.UploadId);
+        }
+
+        processMessage.FilePatterns.clear();
+
+        std::scoped_lock<std::mutex> inFlightLock(inFlightMessage->Mutex);
+        inFlightMessage->ProcessMessage.FilePatterns.clear();
+    }
+
+    void UploadProcessor::CompleteFileUpload(
+        const std::shared_ptr<InFlightUploadMessage> &inFlightMessage,
+        size_t fileIndex,
+        bool uploadResult,
+        const std::string &duplicateOf,
+        const std::string &contentCrc64)
+    {
+        if (uploadResult && journal_)
+        {
+            journal_->RecordFileUploaded(
+                inFlightMessage->ProcessMessage.UploadRequestPayload.UploadId,
+                fileIndex,
+                duplicateOf,
+                contentCrc64);
+        }
+
+        {
+            std::scoped_lock<std::mutex> inFlightLock(inFlightMessage->Mutex);
+            UploadProcessMessage &processMessage = inFlightMessage->ProcessMessage;
+            SetFileUploadResult(processMessage, fileIndex, uploadResult);
+            if (!duplicateOf.empty())
+            {
+                processMessage.DuplicateBlobs[fileIndex] = duplicateOf;
+            }
+            if (!contentCrc64.empty())
+            {
+                processMessage.ContentCrc64s[fileIndex] = contentCrc64;
             }
         }
 
+        ReleasePendingFile(inFlightMessage);
+    }
+
+    void UploadProcessor::CompletePackUpload(
+        const std::shared_ptr<InFlightUploadMessage> &inFlightMessage,
+        const std::vector<size_t> &fileIndexes,
+        const std::string &packBlobPath,
+        bool uploadResult)
+    {
+        if (uploadResult && journal_)
+        {
+            journal_->RecordPackUploaded(
+                inFlightMessage->ProcessMessage.UploadRequestPayload.UploadId,
+                fileIndexes,
+                packBlobPath);
+        }
+
+        {
+            std::scoped_lock<std::mutex> inFlightLock(inFlightMessage->Mutex);
+            for (size_t fileIndex : fileIndexes)
+            {
+                SetFileUploadResult(inFlightMessage->ProcessMessage, fileIndex, uploadResult);
+            }
+        }
+
+        ReleasePendingFile(inFlightMessage, fileIndexes.size());
+    }
+
+    void UploadProcessor::SetFileUploadResult(UploadProcessMessage &processMessage, size_t fileIndex, bool uploadResult)
+    {
+        processMessage.UploadFileList[fileIndex].UploadResult = uploadResult;
+        processMessage.LastUploadTime = std::chrono::system_clock::now();
+
+        if (!uploadResult)
+        {
+            processMessage.FileFailedAttempts.resize(processMessage.UploadFileList.size());
+            processMessage.FileFailedAttempts[fileIndex]++;
+            LogWarn(
+                CorrelationId(processMessage.CorrelationId),
+                "Upload of %s failed, %u failed attempts.",
+                processMessage.UploadFileList[fileIndex].FileName.c_str(),
+                processMessage.FileFailedAttempts[fileIndex]);
+        }
+    }
+
+    void UploadProcessor::ReleasePendingFile(
+        const std::shared_ptr<InFlightUploadMessage> &inFlightMessage,
+        size_t fileCount)
+    {
+        UploadProcessMessage processMessage;
+        {
+            std::scoped_lock<std::mutex> inFlightLock(inFlightMessage->Mutex);
+            inFlightMessage->PendingFiles -= fileCount;
+            if (inFlightMessage->PendingFiles > 0)
+            {
+                return;
+            }
+
+            processMessage = inFlightMessage->ProcessMessage;
+        }
+
+        // A message failed by the shutdown is neither retried nor notified, the journal resumes it after a restart.
+        if (cancellationToken_ && cancellationToken_->IsCancellationRequested())
+        {
+            LogInfo(
+                CorrelationId(processMessage.CorrelationId),
+                "Stopped uploading %s because the module is shutting down.",
+                processMessage.UploadRequestPayload.UploadId.c_str());
+            return;
+        }
+
+        processMessage.UploadResult = true;
+        for (const FileUploadResult &fileUpload : processMessage.UploadFileList)
+        {
+            processMessage.UploadResult = processMessage.UploadResult && fileUpload.UploadResult;
+        }
+
         ValidateUploadState(processMessage);
     }
 
+    bool UploadProcessor::AcquireUploadSlot(const CancellationToken::Ptr &cancellationToken)
+    {
+        std::unique_lock<std::mutex> uploadSlotLock(uploadSlotMutex_);
+        while (!uploadSlotCondition_.wait_for(
+            uploadSlotLock,
+            std::chrono::milliseconds(CancellationCheckIntervalInMs),
+            [this] { return activeFileUploads_ < maxConcurrentFileUploads_; }))
+        {
+            if (cancellationToken->IsCancellationRequested())
+            {
+                return false;
+            }
+        }
+
+        activeFileUploads_++;
+        return true;
+    }
+
+    void UploadProcessor::ReleaseUploadSlot()
+    {
+        {
+            std::scoped_lock<std::mutex> uploadSlotLock(uploadSlotMutex_);
+            activeFileUploads_--;
+        }
+
+        uploadSlotCondition_.notify_one();
+    }
+
+    std::chrono::milliseconds UploadProcessor::GetRetryDelay(const UploadProcessMessage &processMessage)
+    {
+        // Exponential backoff by the number of retries so far, with equal jitter: half of the delay
+        // is fixed and half is random, so retries of messages failed together spread out.
+        int retry = std::max(0, UploadProcessMessage::MaxRetries - processMessage.RetriesRemaining - 1);
+        uint64_t delayInMs = retryBaseDelay_.count() * (1ULL << std::min(retry, MaxBackoffExponent));
+        delayInMs = std::min<uint64_t>(delayInMs, retryMaxDelay_.count());
+
+        std::scoped_lock<std::mutex> randomLock(randomMutex_);
+        std::uniform_int_distribution<uint64_t> jitter(0, delayInMs / 2);
+
+        return std::chrono::milliseconds(delayInMs - delayInMs / 2 + jitter(randomEngine_));
+    }
+
+    std::string UploadProcessor::GetCompression(const UploadProcessMessage &processMessage, const std::string &fileName)
+        const
+    {
+        if (!processMessage.Compression.empty())
+        {
+            return processMessage.Compression;
+        }
+
+        for (const CompressionRule &rule : compressionRules_)
+        {
+            if (fnmatch(rule.Pattern.c_str(), fileName.c_str(), 0) == 0)
+            {
+                return rule.Encoding;
+            }
+        }
+
+        return defaultCompression_;
+    }
+
     void UploadProcessor::ValidateUploadState(UploadProcessMessage &processMessage)
     {
         CorrelationId correlationId = CorrelationId(processMessage.CorrelationId);
 
         if (processMessage.UploadResult || processMessage.HasExpired() || processMessage.RetriesRemaining <= 0)
         {
-            SendNotification(processMessage.CreateNotification(), correlationId);
+            for (const FileUploadResult &fileUpload : processMessage.UploadFileList)
+            {
+                if (!fileUpload.UploadResult)
+                {
+                    blobUploadHandler_.DiscardProgress(processMessage.GetBlobPath(fileUpload.FileName));
+                }
+            }
+
+            SendNotification(processMessage, correlationId);
+            if (journal_)
+            {
+                journal_->RecordNotified(processMessage.UploadRequestPayload.UploadId);
+            }
+
             deleteProcessor_->Delete(processMessage);
 
             if (processMessage.HasExpired() || processMessage.RetriesRemaining <= 0)
@@ -139,25 +846,34 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
         else
         {
             processMessage.RetriesRemaining--;
-            messageQueue_.push(processMessage);
-            LogTrace("Retry file upload for the message, %s.", processMessage.UploadRequestPayload.UploadId.c_str());
+            processMessage.UpdateTotalBytes();
+
+            // Only the failed files are uploaded again. The message is held out of the queue until the
+            // backoff elapsed, but not beyond its time to live, so it is still notified in time.
+            std::chrono::milliseconds retryDelay = GetRetryDelay(processMessage);
+            std::chrono::steady_clock::time_point readyTime = std::min(
+                std::chrono::steady_clock::now() + retryDelay,
+                processMessage.UploadRequestPayload.TimeToLiveExpiry);
+
+            messageQueue_.PushDelayed(processMessage, readyTime);
+            LogTrace(
+                "Retry file upload for the message, %s, in %lld ms.",
+                processMessage.UploadRequestPayload.UploadId.c_str(),
+                static_cast<long long>(retryDelay.count()));
         }
     }
 
     void UploadProcessor::PublishMessage(
-        const InternalMessage &internalMessage,
+        const std::string &message,
         const std::string &topic,
         const CorrelationId &correlationId)
     {
         try
         {
-            json j = internalMessage;
-            std::string serializedInternalMessage = j.dump();
-
             MqttProperties mqttProperties;
             mqttProperties.emplace_back(std::make_tuple(MqttPropertyId::CorrelationData, correlationId.ToString()));
 
-            mqttClient_->Publish(topic, serializedInternalMessage, Qos::AT_LEAST_ONCE, mqttProperties);
+            mqttClient_->Publish(topic, message, Qos::AT_LEAST_ONCE, mqttProperties);
         }
         catch (const MqttClientException &e)
         {
@@ -167,11 +883,10 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
 
     void UploadProcessor::RequestBlobUri(const std::string &blobPath, const CorrelationId &correlationId)
     {
-        InternalMessage internalMessage;
-        internalMessage.MessageType = InternalMessageTypes::ArbitraryToCloud;
-        internalMessage.Payload = blobPath;
-
-        PublishMessage(internalMessage, MqttConstants::Topics::RequestBlobUri, correlationId);
+        PublishMessage(
+            wireCodec_->EncodeBlobUriRequest({blobPath}, false),
+            MqttConstants::Topics::RequestBlobUri,
+            correlationId);
 
         LogInfo(
             correlationId,
@@ -180,22 +895,49 @@ namespace microsoft::azure::connectedcar::fileuploadmodule
             MqttConstants::Topics::RequestBlobUri.c_str());
     }
 
-    void UploadProcessor::SendNotification(
-        const FileUploadNotification &notification,
-        const CorrelationId &correlationId)
+    void UploadProcessor::RequestBlobUris(const std::vector<std::string> &blobPaths, const CorrelationId &correlationId)
     {
-        json json_data = notification;
+        if (blobUriRequestBatchSize_ <= 1)
+        {
+            for (const std::string &blobPath : blobPaths)
+            {
+                RequestBlobUri(blobPath, correlationId);
+            }
+            return;
+        }
 
-        InternalMessage internalMessage;
-        internalMessage.MessageType = InternalMessageTypes::ArbitraryToCloud;
-        internalMessage.Payload = json_data.dump();
+        for (size_t batchStart = 0; batchStart < blobPaths.size(); batchStart += blobUriRequestBatchSize_)
+        {
+            size_t batchEnd = std::min(blobPaths.size(), batchStart + blobUriRequestBatchSize_);
+            std::vector<std::string> batch(blobPaths.begin() + batchStart, blobPaths.begin() + batchEnd);
 
-        PublishMessage(internalMessage, MqttConstants::Topics::FileUploadNotification, correlationId);
+            PublishMessage(
+                wireCodec_->EncodeBlobUriRequest(batch, true),
+                MqttConstants::Topics::RequestBlobUri,
+                correlationId);
+
+            LogInfo(
+                correlationId,
+                "Successfully sent batched blob upload request for %zu blobs, %s.",
+                batchEnd - batchStart,
+                MqttConstants::Topics::RequestBlobUri.c_str());
+        }
+    }
+
+    void UploadProcessor::SendNotification(
+        const UploadProcessMessage &processMessage,
+        const CorrelationId &correlationId,
+        const std::string &evictionReason)
+    {
+        PublishMessage(
+            wireCodec_->EncodeNotification(processMessage, evictionReason),
+            MqttConstants::Topics::FileUploadNotification,
+            correlationId);
 
         LogInfo(
             correlationId,
             "Successfully sent notification message, %s, %s.",
-            notification.UploadId.c_str(),
+            processMessage.UploadRequestPayload.UploadId.c_str(),
             MqttConstants::Topics::FileUploadNotification.c_str());
     }
 } // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -0,0 +1,106 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <logging.h>
+
+#include "include/upload_scheduling_policy.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    std::shared_ptr<UploadSchedulingPolicy> UploadSchedulingPolicy::Create(const FileUploadSettings &settings)
+    {
+        if (settings.SchedulingPolicy == SchedulingPolicyNames::Priority)
+        {
+            return std::make_shared<PriorityFirstPolicy>();
+        }
+
+        if (settings.SchedulingPolicy != SchedulingPolicyNames::Deadline)
+        {
+            LogWarn(
+                "Unknown scheduling policy, %s. Use the %s policy.",
+                settings.SchedulingPolicy.c_str(),
+                SchedulingPolicyNames::Deadline.c_str());
+        }
+
+        return std::make_shared<DeadlineAwarePolicy>(
+            std::chrono::seconds(settings.SchedulingAgingIntervalInSeconds),
+            std::chrono::seconds(settings.SchedulingDeadlineBucketInSeconds));
+    }
+
+    bool PriorityFirstPolicy::RunsBefore(
+        const UploadProcessMessage &p1,
+        const UploadProcessMessage &p2,
+        std::chrono::steady_clock::time_point) const
+    {
+        if (p1.UploadRequestPayload.Priority != p2.UploadRequestPayload.Priority)
+        {
+            return p1.UploadRequestPayload.Priority < p2.UploadRequestPayload.Priority;
+        }
+
+        return p1.EnqueuedTime < p2.EnqueuedTime;
+    }
+
+    DeadlineAwarePolicy::DeadlineAwarePolicy(std::chrono::seconds agingInterval, std::chrono::seconds deadlineBucket)
+        : agingInterval_(agingInterval), deadlineBucket_(deadlineBucket)
+    {
+    }
+
+    bool DeadlineAwarePolicy::RunsBefore(
+        const UploadProcessMessage &p1,
+        const UploadProcessMessage &p2,
+        std::chrono::steady_clock::time_point now) const
+    {
+        long long priority1 = GetEffectivePriority(p1, now);
+        long long priority2 = GetEffectivePriority(p2, now);
+        if (priority1 != priority2)
+        {
+            return priority1 < priority2;
+        }
+
+        // Deadlines are compared by bucket, since requests rarely expire at the exact same time and the
+        // smaller request would otherwise never run first.
+        long long deadline1 = GetDeadlineBucket(p1);
+        long long deadline2 = GetDeadlineBucket(p2);
+        if (deadline1 != deadline2)
+        {
+            return deadline1 < deadline2;
+        }
+
+        if (p1.TotalBytes != p2.TotalBytes)
+        {
+            return p1.TotalBytes < p2.TotalBytes;
+        }
+
+        return p1.EnqueuedTime < p2.EnqueuedTime;
+    }
+
+    long long DeadlineAwarePolicy::GetEffectivePriority(
+        const UploadProcessMessage &processMessage,
+        std::chrono::steady_clock::time_point now) const
+    {
+        long long priority = processMessage.UploadRequestPayload.Priority;
+        if (agingInterval_.count() <= 0 || now <= processMessage.EnqueuedTime)
+        {
+            return priority;
+        }
+
+        // Waiting messages move up one priority level per aging interval, so a steady stream of
+        // higher priority requests can't starve them.
+        return priority - (now - processMessage.EnqueuedTime) / agingInterval_;
+    }
+
+    long long DeadlineAwarePolicy::GetDeadlineBucket(const UploadProcessMessage &processMessage) const
+    {
+        std::chrono::steady_clock::duration deadline =
+            processMessage.UploadRequestPayload.TimeToLiveExpiry.time_since_epoch();
+        if (deadlineBucket_.count() <= 0)
+        {
+            return deadline.count();
+        }
+
+        return deadline / deadlineBucket_;
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -0,0 +1,233 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+
+#include "bandwidth_governor.h"
+#include "file_upload_settings.h"
+#include "file_upload_wire.pb.h"
+#include "include/internal_message_reader.h"
+#include "include/wire_codec.h"
+#include "internal_message_types.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    using namespace microsoft::azure::connectedcar::mcvp::datacontracts;
+    using namespace microsoft::azure::connectedcar::vehicle::datacontracts;
+    using namespace nlohmann;
+
+    WireCodec::WireCodec(const std::string &wireFormat) :
+        followPeerFormat_(wireFormat == WireFormatNames::Auto),
+        publishFormat_(wireFormat == WireFormatNames::Protobuf ? WireFormat::Protobuf : WireFormat::Json)
+    {
+    }
+
+    WireFormat WireCodec::DetectFormat(const std::string &message)
+    {
+        size_t start = message.find_first_not_of(" \t\r\n");
+        return start != std::string::npos && message[start] == '{' ? WireFormat::Json : WireFormat::Protobuf;
+    }
+
+    InternalMessage WireCodec::DecodeInternalMessage(const std::string &message, WireFormat &format)
+    {
+        format = DetectFormat(message);
+        if (followPeerFormat_)
+        {
+            publishFormat_ = format;
+        }
+
+        if (format == WireFormat::Json)
+        {
+            return InternalMessageReader::ReadInternalMessage(message);
+        }
+
+        wire::InternalMessage wireMessage;
+        if (!wireMessage.ParseFromString(message) || wireMessage.message_type().empty())
+        {
+            throw std::invalid_argument("The message is neither JSON nor a protobuf internal message.");
+        }
+
+        InternalMessage internalMessage;
+        internalMessage.MessageType = std::move(*wireMessage.mutable_message_type());
+        internalMessage.Payload = std::move(*wireMessage.mutable_payload());
+
+        return internalMessage;
+    }
+
+    std::string WireCodec::DecodeFileUploadRequest(const std::string &payload, WireFormat format) const
+    {
+        if (format == WireFormat::Json)
+        {
+            return payload;
+        }
+
+        wire::FileUploadRequest request;
+        if (!request.ParseFromString(payload) || request.upload_id().empty())
+        {
+            throw std::invalid_argument("The payload is not a protobuf file upload request.");
+        }
+
+        json uploadRequest;
+        uploadRequest["UploadId"] = request.upload_id();
+        uploadRequest["TimeToLive"] = std::to_string(request.time_to_live_in_sec());
+        uploadRequest["FileList"] = std::vector<std::string>(request.file_list().begin(), request.file_list().end());
+        uploadRequest["Priority"] = request.priority();
+        uploadRequest["FileRetentionInSec"] = std::to_string(request.file_retention_in_sec());
+        uploadRequest["Metadata"] = request.metadata();
+        if (!request.compression().empty())
+        {
+            uploadRequest[UploadProcessMessage::RequestCompressionProperty] = request.compression();
+        }
+
+        return uploadRequest.dump();
+    }
+
+    std::vector<BlobUploadUriResponse> WireCodec::DecodeBlobUriResponses(const std::string &payload, WireFormat format)
+        const
+    {
+        if (format == WireFormat::Json)
+        {
+            return InternalMessageReader::ReadBlobUriResponses(payload);
+        }
+
+        wire::BlobUploadUriResponses wireResponses;
+        if (!wireResponses.ParseFromString(payload))
+        {
+            throw std::invalid_argument("The payload is not a protobuf blob uri response.");
+        }
+
+        std::vector<BlobUploadUriResponse> responses;
+        responses.reserve(wireResponses.responses_size());
+        for (wire::BlobUploadUriResponse &wireResponse : *wireResponses.mutable_responses())
+        {
+            BlobUploadUriResponse response;
+            response.RequestedFileName = std::move(*wireResponse.mutable_requested_file_name());
+            response.BlobSasUri = std::move(*wireResponse.mutable_blob_sas_uri());
+            responses.push_back(std::move(response));
+        }
+
+        return responses;
+    }
+
+    std::string WireCodec::DecodeBandwidthLimits(const std::string &payload, WireFormat format) const
+    {
+        if (format == WireFormat::Json)
+        {
+            return payload;
+        }
+
+        wire::BandwidthLimits limits;
+        if (!limits.ParseFromString(payload))
+        {
+            throw std::invalid_argument("The payload is not protobuf bandwidth limits.");
+        }
+
+        // Proto3 maps can't tell an empty map from a missing one, so an empty map keeps the weights.
+        json bandwidthLimits = json::object();
+        if (limits.has_limit_in_bytes_per_second())
+        {
+            bandwidthLimits[BandwidthLimits::LimitProperty] = limits.limit_in_bytes_per_second();
+        }
+        if (!limits.priority_weights().empty())
+        {
+            json priorityWeights = json::object();
+            for (const auto &[priority, weight] : limits.priority_weights())
+            {
+                priorityWeights[std::to_string(priority)] = weight;
+            }
+            bandwidthLimits[BandwidthLimits::PriorityWeightsProperty] = priorityWeights;
+        }
+
+        return bandwidthLimits.dump();
+    }
+
+    std::string WireCodec::EncodeBlobUriRequest(const std::vector<std::string> &blobPaths, bool batched) const
+    {
+        WireFormat format = publishFormat_;
+        if (format == WireFormat::Json)
+        {
+            std::string payload = batched || blobPaths.size() != 1 ? json(blobPaths).dump() : blobPaths.front();
+            return EncodeInternalMessage(InternalMessageTypes::ArbitraryToCloud, std::move(payload), format);
+        }
+
+        wire::BlobUploadUriRequest request;
+        request.mutable_requested_file_names()->Add(blobPaths.begin(), blobPaths.end());
+
+        return EncodeInternalMessage(InternalMessageTypes::ArbitraryToCloud, request.SerializeAsString(), format);
+    }
+
+    std::string WireCodec::EncodeNotification(
+        const UploadProcessMessage &processMessage,
+        const std::string &evictionReason) const
+    {
+        WireFormat format = publishFormat_;
+        if (format == WireFormat::Json)
+        {
+            json json_data = processMessage.CreateNotification();
+
+            // The notification contract has no eviction state, so it is sent as an additional property.
+            if (!evictionReason.empty())
+            {
+                json_data["EvictionReason"] = evictionReason;
+            }
+
+            return EncodeInternalMessage(InternalMessageTypes::ArbitraryToCloud, json_data.dump(), format);
+        }
+
+        // The upload results are structured messages here, instead of JSON text inside the notification.
+        wire::FileUploadNotification notification;
+        notification.set_upload_id(processMessage.UploadRequestPayload.UploadId);
+        notification.set_upload_result(processMessage.UploadResult);
+        notification.set_metadata(processMessage.UploadRequestPayload.Metadata);
+        for (size_t fileIndex = 0; fileIndex < processMessage.UploadFileList.size(); fileIndex++)
+        {
+            const FileUploadResult &uploadResult = processMessage.UploadFileList[fileIndex];
+            wire::FileUploadResult *wireResult = notification.add_upload_file_list();
+            wireResult->set_file_name(uploadResult.FileName);
+            wireResult->set_upload_result(uploadResult.UploadResult);
+
+            auto duplicate = processMessage.DuplicateBlobs.find(fileIndex);
+            if (duplicate != processMessage.DuplicateBlobs.end())
+            {
+                wireResult->set_duplicate_of(duplicate->second);
+            }
+
+            auto contentCrc64 = processMessage.ContentCrc64s.find(fileIndex);
+            if (contentCrc64 != processMessage.ContentCrc64s.end())
+            {
+                wireResult->set_content_crc64(contentCrc64->second);
+            }
+        }
+        notification.set_last_upload_time(processMessage.FormatLastUploadTime());
+        notification.set_eviction_reason(evictionReason);
+
+        return EncodeInternalMessage(InternalMessageTypes::ArbitraryToCloud, notification.SerializeAsString(), format);
+    }
+
+    WireFormat WireCodec::GetPublishFormat() const
+    {
+        return publishFormat_;
+    }
+
+    std::string WireCodec::EncodeInternalMessage(const std::string &messageType, std::string payload, WireFormat format)
+    {
+        if (format == WireFormat::Json)
+        {
+            InternalMessage internalMessage;
+            internalMessage.MessageType = messageType;
+            internalMessage.Payload = std::move(payload);
+
+            return json(internalMessage).dump();
+        }
+
+        wire::InternalMessage wireMessage;
+        wireMessage.set_message_type(messageType);
+        wireMessage.set_payload(std::move(payload));
+
+        return wireMessage.SerializeAsString();
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
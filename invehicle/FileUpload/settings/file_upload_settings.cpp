@@ -0,0 +1,208 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <logging.h>
+#include <stdexcept>
+
+#include "configuration.h"
+#include "include/file_upload_settings.h"
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    using namespace microsoft::azure::connectedcar::autoedge;
+
+    static uint64_t GetUnsignedConfigOrDefault(const std::string &key, uint64_t defaultValue)
+    {
+        std::string value = Configuration::GetEnvironmentConfigOrDefault(key, std::to_string(defaultValue));
+
+        try
+        {
+            return std::stoull(value);
+        }
+        catch (const std::exception &)
+        {
+            LogWarn(
+                "Invalid value, %s, for %s. Use the default value, %llu.",
+                value.c_str(),
+                key.c_str(),
+                static_cast<unsigned long long>(defaultValue));
+        }
+
+        return defaultValue;
+    }
+
+    FileUploadSettings FileUploadSettings::LoadFromEnvironment()
+    {
+        FileUploadSettings settings;
+
+        settings.ChunkedUploadThresholdInBytes = GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::ChunkedUploadThresholdInBytes,
+            settings.ChunkedUploadThresholdInBytes);
+        settings.BlockSizeInBytes =
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::BlockSizeInBytes, settings.BlockSizeInBytes);
+        settings.MaxParallelBlockUploads = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::MaxParallelBlockUploads,
+            settings.MaxParallelBlockUploads));
+        settings.MaxPooledCurlHandles = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::MaxPooledCurlHandles, settings.MaxPooledCurlHandles));
+        settings.MaxConcurrentTransfers = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::MaxConcurrentTransfers,
+            settings.MaxConcurrentTransfers));
+        settings.MaxConcurrentFileUploads = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::MaxConcurrentFileUploads,
+            settings.MaxConcurrentFileUploads));
+
+        settings.UploadBufferSizeInBytes = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::UploadBufferSizeInBytes,
+            settings.UploadBufferSizeInBytes));
+        settings.DropPageCacheAfterRead =
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::DropPageCacheAfterRead, 1) != 0;
+
+        settings.BlobUriRequestWindow = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::BlobUriRequestWindow, settings.BlobUriRequestWindow));
+        settings.BlobUriRequestBatchSize = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::BlobUriRequestBatchSize,
+            settings.BlobUriRequestBatchSize));
+        settings.BlobUriCacheCapacity = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::BlobUriCacheCapacity, settings.BlobUriCacheCapacity));
+        settings.BlobUriMinValidityInSeconds = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::BlobUriMinValidityInSeconds,
+            settings.BlobUriMinValidityInSeconds));
+        settings.UploadWorkerCount = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::UploadWorkerCount, settings.UploadWorkerCount));
+        settings.SchedulingPolicy = Configuration::GetEnvironmentConfigOrDefault(
+            FileUploadSettingsKeys::SchedulingPolicy,
+            settings.SchedulingPolicy);
+        settings.SchedulingAgingIntervalInSeconds = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::SchedulingAgingIntervalInSeconds,
+            settings.SchedulingAgingIntervalInSeconds));
+        settings.SchedulingDeadlineBucketInSeconds = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::SchedulingDeadlineBucketInSeconds,
+            settings.SchedulingDeadlineBucketInSeconds));
+        settings.RetryBaseDelayInSeconds = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::RetryBaseDelayInSeconds,
+            settings.RetryBaseDelayInSeconds));
+        settings.RetryMaxDelayInSeconds = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::RetryMaxDelayInSeconds,
+            settings.RetryMaxDelayInSeconds));
+        settings.JournalCompactionThreshold = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::JournalCompactionThreshold,
+            settings.JournalCompactionThreshold));
+        settings.DeleteThreadCount = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::DeleteThreadCount, settings.DeleteThreadCount));
+        settings.StorageHighWatermarkPercent = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::StorageHighWatermarkPercent,
+            settings.StorageHighWatermarkPercent));
+        settings.StorageLowWatermarkPercent = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::StorageLowWatermarkPercent,
+            settings.StorageLowWatermarkPercent));
+        settings.StorageCheckIntervalInSeconds = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::StorageCheckIntervalInSeconds,
+            settings.StorageCheckIntervalInSeconds));
+        settings.StorageEvictionPriorityFloor = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::StorageEvictionPriorityFloor,
+            settings.StorageEvictionPriorityFloor));
+        settings.FileListScanThreadCount = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::FileListScanThreadCount,
+            settings.FileListScanThreadCount));
+        settings.IngressQueueCapacity = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::IngressQueueCapacity, settings.IngressQueueCapacity));
+        settings.IngressOverflowPolicy = Configuration::GetEnvironmentConfigOrDefault(
+            FileUploadSettingsKeys::IngressOverflowPolicy,
+            settings.IngressOverflowPolicy);
+        settings.WatchRules =
+            Configuration::GetEnvironmentConfigOrDefault(FileUploadSettingsKeys::WatchRules, settings.WatchRules);
+        settings.WatchBatchWindowInMs = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::WatchBatchWindowInMs, settings.WatchBatchWindowInMs));
+        settings.WatchMaxBatchFiles = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::WatchMaxBatchFiles, settings.WatchMaxBatchFiles));
+        settings.WireFormat =
+            Configuration::GetEnvironmentConfigOrDefault(FileUploadSettingsKeys::WireFormat, settings.WireFormat);
+        settings.Compression =
+            Configuration::GetEnvironmentConfigOrDefault(FileUploadSettingsKeys::Compression, settings.Compression);
+        settings.CompressionLevel = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::CompressionLevel, settings.CompressionLevel));
+        settings.CompressionRules = Configuration::GetEnvironmentConfigOrDefault(
+            FileUploadSettingsKeys::CompressionRules,
+            settings.CompressionRules);
+        settings.PackFileSizeThresholdInBytes = GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::PackFileSizeThresholdInBytes,
+            settings.PackFileSizeThresholdInBytes);
+        settings.PackMaxSizeInBytes =
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::PackMaxSizeInBytes, settings.PackMaxSizeInBytes);
+        settings.PackMaxFiles = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::PackMaxFiles, settings.PackMaxFiles));
+        settings.DedupIndexCapacity = static_cast<unsigned int>(
+            GetUnsignedConfigOrDefault(FileUploadSettingsKeys::DedupIndexCapacity, settings.DedupIndexCapacity));
+        settings.DedupRetentionInSeconds = static_cast<unsigned int>(GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::DedupRetentionInSeconds,
+            settings.DedupRetentionInSeconds));
+        settings.ContentCrc64 = GetUnsignedConfigOrDefault(FileUploadSettingsKeys::ContentCrc64, 1) != 0;
+        settings.BandwidthLimitInBytesPerSecond = GetUnsignedConfigOrDefault(
+            FileUploadSettingsKeys::BandwidthLimitInBytesPerSecond,
+            settings.BandwidthLimitInBytesPerSecond);
+        settings.BandwidthPriorityWeights = Configuration::GetEnvironmentConfigOrDefault(
+            FileUploadSettingsKeys::BandwidthPriorityWeights,
+            settings.BandwidthPriorityWeights);
+        settings.BandwidthControlTopic = Configuration::GetEnvironmentConfigOrDefault(
+            FileUploadSettingsKeys::BandwidthControlTopic,
+            settings.BandwidthControlTopic);
+
+        if (settings.BlockSizeInBytes == 0 || settings.MaxParallelBlockUploads == 0 ||
+            settings.MaxConcurrentTransfers == 0 || settings.MaxConcurrentFileUploads == 0 ||
+            settings.BlobUriRequestWindow == 0 || settings.BlobUriRequestBatchSize == 0 ||
+            settings.UploadWorkerCount == 0 || settings.DeleteThreadCount == 0 ||
+            settings.FileListScanThreadCount == 0 || settings.IngressQueueCapacity == 0)
+        {
+            throw std::invalid_argument("Block size, parallel block uploads, concurrent uploads, blob uri requests, "
+                                        "upload workers, delete and scan threads and the ingress queue capacity "
+                                        "must be bigger than zero.");
+        }
+
+        // Every upload worker prefetches its own request window into the shared cache.
+        if (settings.BlobUriCacheCapacity <
+            static_cast<uint64_t>(settings.BlobUriRequestWindow) * std::max(1U, settings.UploadWorkerCount))
+        {
+            throw std::invalid_argument("The blob uri cache capacity must not be smaller than the request window "
+                                        "times the upload worker count.");
+        }
+
+        if (settings.IngressOverflowPolicy != IngressOverflowPolicyNames::Block &&
+            settings.IngressOverflowPolicy != IngressOverflowPolicyNames::Drop)
+        {
+            throw std::invalid_argument("Unknown ingress overflow policy, " + settings.IngressOverflowPolicy + ".");
+        }
+
+        if (settings.WireFormat != WireFormatNames::Json && settings.WireFormat != WireFormatNames::Protobuf &&
+            settings.WireFormat != WireFormatNames::Auto)
+        {
+            throw std::invalid_argument("Unknown wire format, " + settings.WireFormat + ".");
+        }
+
+        if (settings.Compression != CompressionNames::None && settings.Compression != CompressionNames::Zstd &&
+            settings.Compression != CompressionNames::Gzip)
+        {
+            throw std::invalid_argument("Unknown compression, " + settings.Compression + ".");
+        }
+
+        if (settings.PackFileSizeThresholdInBytes > 0 &&
+            (settings.PackMaxFiles == 0 || settings.PackMaxSizeInBytes < settings.PackFileSizeThresholdInBytes))
+        {
+            throw std::invalid_argument("Packing needs a maximum file count bigger than zero, and a maximum pack size "
+                                        "not below the pack file size threshold.");
+        }
+
+        if (settings.StorageLowWatermarkPercent >= settings.StorageHighWatermarkPercent ||
+            settings.StorageHighWatermarkPercent > 100)
+        {
+            throw std::invalid_argument("The storage low watermark must be below the high watermark, "
+                                        "which must not be above 100 percent.");
+        }
+
+        return settings;
+    }
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
@@ -0,0 +1,257 @@
+// ---------------------------------------------------------------------------------
+//  <copyright company="Microsoft">
+//    Copyright (c) Microsoft Corporation. All rights reserved.
+//  </copyright>
+// ---------------------------------------------------------------------------------
+
+#ifndef FILE_UPLOAD_SETTINGS_H
+#define FILE_UPLOAD_SETTINGS_H
+
+#include <cstdint>
+#include <string>
+
+namespace microsoft::azure::connectedcar::fileuploadmodule
+{
+    /**
+     * @brief Environment variables to override the default file upload settings
+     */
+    struct FileUploadSettingsKeys
+    {
+        static inline const std::string ChunkedUploadThresholdInBytes =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_CHUNKED_UPLOAD_THRESHOLD_IN_BYTES";
+        static inline const std::string BlockSizeInBytes = "AUTOEDGE_FILE_UPLOAD_MODULE_BLOCK_SIZE_IN_BYTES";
+        static inline const std::string MaxParallelBlockUploads = "AUTOEDGE_FILE_UPLOAD_MODULE_MAX_PARALLEL_BLOCK_UPLOADS";
+        static inline const std::string MaxPooledCurlHandles = "AUTOEDGE_FILE_UPLOAD_MODULE_MAX_POOLED_CURL_HANDLES";
+        static inline const std::string MaxConcurrentTransfers = "AUTOEDGE_FILE_UPLOAD_MODULE_MAX_CONCURRENT_TRANSFERS";
+        static inline const std::string MaxConcurrentFileUploads =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_MAX_CONCURRENT_FILE_UPLOADS";
+        static inline const std::string UploadBufferSizeInBytes =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_UPLOAD_BUFFER_SIZE_IN_BYTES";
+        static inline const std::string DropPageCacheAfterRead =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_DROP_PAGE_CACHE_AFTER_READ";
+        static inline const std::string BlobUriRequestWindow = "AUTOEDGE_FILE_UPLOAD_MODULE_BLOB_URI_REQUEST_WINDOW";
+        static inline const std::string BlobUriRequestBatchSize =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_BLOB_URI_REQUEST_BATCH_SIZE";
+        static inline const std::string BlobUriCacheCapacity = "AUTOEDGE_FILE_UPLOAD_MODULE_BLOB_URI_CACHE_CAPACITY";
+        static inline const std::string BlobUriMinValidityInSeconds =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_BLOB_URI_MIN_VALIDITY_IN_SECONDS";
+        static inline const std::string UploadWorkerCount = "AUTOEDGE_FILE_UPLOAD_MODULE_UPLOAD_WORKER_COUNT";
+        static inline const std::string SchedulingPolicy = "AUTOEDGE_FILE_UPLOAD_MODULE_SCHEDULING_POLICY";
+        static inline const std::string SchedulingAgingIntervalInSeconds =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_SCHEDULING_AGING_INTERVAL_IN_SECONDS";
+        static inline const std::string SchedulingDeadlineBucketInSeconds =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_SCHEDULING_DEADLINE_BUCKET_IN_SECONDS";
+        static inline const std::string RetryBaseDelayInSeconds =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_RETRY_BASE_DELAY_IN_SECONDS";
+        static inline const std::string RetryMaxDelayInSeconds =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_RETRY_MAX_DELAY_IN_SECONDS";
+        static inline const std::string JournalCompactionThreshold =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_JOURNAL_COMPACTION_THRESHOLD";
+        static inline const std::string DeleteThreadCount = "AUTOEDGE_FILE_UPLOAD_MODULE_DELETE_THREAD_COUNT";
+        static inline const std::string StorageHighWatermarkPercent =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_STORAGE_HIGH_WATERMARK_PERCENT";
+        static inline const std::string StorageLowWatermarkPercent =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_STORAGE_LOW_WATERMARK_PERCENT";
+        static inline const std::string StorageCheckIntervalInSeconds =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_STORAGE_CHECK_INTERVAL_IN_SECONDS";
+        static inline const std::string StorageEvictionPriorityFloor =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_STORAGE_EVICTION_PRIORITY_FLOOR";
+        static inline const std::string FileListScanThreadCount =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_FILE_LIST_SCAN_THREAD_COUNT";
+        static inline const std::string IngressQueueCapacity = "AUTOEDGE_FILE_UPLOAD_MODULE_INGRESS_QUEUE_CAPACITY";
+        static inline const std::string IngressOverflowPolicy = "AUTOEDGE_FILE_UPLOAD_MODULE_INGRESS_OVERFLOW_POLICY";
+        static inline const std::string WatchRules = "AUTOEDGE_FILE_UPLOAD_MODULE_WATCH_RULES";
+        static inline const std::string WatchBatchWindowInMs = "AUTOEDGE_FILE_UPLOAD_MODULE_WATCH_BATCH_WINDOW_IN_MS";
+        static inline const std::string WatchMaxBatchFiles = "AUTOEDGE_FILE_UPLOAD_MODULE_WATCH_MAX_BATCH_FILES";
+        static inline const std::string WireFormat = "AUTOEDGE_FILE_UPLOAD_MODULE_WIRE_FORMAT";
+        static inline const std::string Compression = "AUTOEDGE_FILE_UPLOAD_MODULE_COMPRESSION";
+        static inline const std::string CompressionLevel = "AUTOEDGE_FILE_UPLOAD_MODULE_COMPRESSION_LEVEL";
+        static inline const std::string CompressionRules = "AUTOEDGE_FILE_UPLOAD_MODULE_COMPRESSION_RULES";
+        static inline const std::string PackFileSizeThresholdInBytes =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_PACK_FILE_SIZE_THRESHOLD_IN_BYTES";
+        static inline const std::string PackMaxSizeInBytes = "AUTOEDGE_FILE_UPLOAD_MODULE_PACK_MAX_SIZE_IN_BYTES";
+        static inline const std::string PackMaxFiles = "AUTOEDGE_FILE_UPLOAD_MODULE_PACK_MAX_FILES";
+        static inline const std::string DedupIndexCapacity = "AUTOEDGE_FILE_UPLOAD_MODULE_DEDUP_INDEX_CAPACITY";
+        static inline const std::string DedupRetentionInSeconds =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_DEDUP_RETENTION_IN_SECONDS";
+        static inline const std::string ContentCrc64 = "AUTOEDGE_FILE_UPLOAD_MODULE_CONTENT_CRC64";
+        static inline const std::string BandwidthLimitInBytesPerSecond =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_BANDWIDTH_LIMIT_IN_BYTES_PER_SECOND";
+        static inline const std::string BandwidthPriorityWeights =
+            "AUTOEDGE_FILE_UPLOAD_MODULE_BANDWIDTH_PRIORITY_WEIGHTS";
+        static inline const std::string BandwidthControlTopic = "AUTOEDGE_FILE_UPLOAD_MODULE_BANDWIDTH_CONTROL_TOPIC";
+    };
+
+    /**
+     * @brief Names of the upload scheduling policies
+     */
+    struct SchedulingPolicyNames
+    {
+        static inline const std::string Priority = "priority";
+        static inline const std::string Deadline = "deadline";
+    };
+
+    /**
+     * @brief Names of the policies for messages received while the message queue is full
+     */
+    struct IngressOverflowPolicyNames
+    {
+        static inline const std::string Block = "block";
+        static inline const std::string Drop = "drop";
+    };
+
+    /**
+     * @brief Names of the encodings of published messages
+     */
+    struct WireFormatNames
+    {
+        static inline const std::string Json = "json";
+        static inline const std::string Protobuf = "protobuf";
+        static inline const std::string Auto = "auto";
+    };
+
+    /**
+     * @brief Names of the content encodings of uploaded files
+     */
+    struct CompressionNames
+    {
+        static inline const std::string None = "none";
+        static inline const std::string Zstd = "zstd";
+        static inline const std::string Gzip = "gzip";
+    };
+
+    /**
+     * @brief Tunable settings of the file upload module
+     *
+     */
+    struct FileUploadSettings
+    {
+        // Files of this size or bigger are uploaded in blocks (Put Block & Put Block List),
+        // smaller files with a single Put Blob request.
+        uint64_t ChunkedUploadThresholdInBytes = 32 * 1024 * 1024;
+        uint64_t BlockSizeInBytes = 8 * 1024 * 1024;
+        unsigned int MaxParallelBlockUploads = 4;
+
+        // Idle curl handles kept alive for reuse. Handles share one connection, DNS and TLS session cache.
+        unsigned int MaxPooledCurlHandles = 8;
+
+        // HTTP requests the upload engine keeps in flight, and files uploaded at the same time
+        // across all upload requests.
+        unsigned int MaxConcurrentTransfers = 8;
+        unsigned int MaxConcurrentFileUploads = 4;
+
+        // Size of the curl upload buffer, filled with one read per callback. Capped by curl at 2 MB.
+        unsigned int UploadBufferSizeInBytes = 512 * 1024;
+
+        // Evict file pages from the page cache once they are read, so large uploads don't push out
+        // the cache other modules rely on.
+        bool DropPageCacheAfterRead = true;
+
+        // Blob uris are requested for this many files ahead of the file being uploaded, so the cloud
+        // round trips overlap with uploads in progress.
+        unsigned int BlobUriRequestWindow = 8;
+
+        // Blob paths sent in one request message. 1 sends the plain blob path per message, bigger values
+        // send a JSON array of blob paths, which the cloud side must support.
+        unsigned int BlobUriRequestBatchSize = 1;
+
+        // Blob uris kept in the cache. Must be at least the request window times the upload worker count,
+        // so uris prefetched by the workers aren't evicted before they are used.
+        unsigned int BlobUriCacheCapacity = 64;
+
+        // Validity a cached blob uri must have left to be used again, such as by a retry. A token issued
+        // with a shorter lifetime is reused for half of its lifetime. A newly received uri is always used
+        // for the upload it was requested for.
+        unsigned int BlobUriMinValidityInSeconds = 300;
+
+        // Upload workers taking upload requests from the queue. Each worker acquires blob uris and
+        // hands files to the upload engine for one request at a time.
+        unsigned int UploadWorkerCount = 2;
+
+        // Order of queued upload requests, see SchedulingPolicyNames. A waiting request is raised by one
+        // priority level per aging interval, 0 disables aging. Deadlines within the same bucket count as
+        // equal, so the request with fewer bytes runs first, 0 compares deadlines exactly.
+        std::string SchedulingPolicy = SchedulingPolicyNames::Deadline;
+        unsigned int SchedulingAgingIntervalInSeconds = 60;
+        unsigned int SchedulingDeadlineBucketInSeconds = 60;
+
+        // A failed upload request is retried after the base delay, doubled for every further retry up to
+        // the maximum delay. Half of the delay is random jitter.
+        unsigned int RetryBaseDelayInSeconds = 10;
+        unsigned int RetryMaxDelayInSeconds = 300;
+
+        // Minimum number of upload journal records before the journal is compacted to the live requests.
+        unsigned int JournalCompactionThreshold = 10000;
+
+        // Threads deleting files in parallel, one directory per thread at a time.
+        unsigned int DeleteThreadCount = 2;
+
+        // Files are evicted before their retention expires once the used space or inodes of the data container
+        // path reach the high watermark, until both are below the low watermark. 0 seconds disables the checks.
+        unsigned int StorageHighWatermarkPercent = 90;
+        unsigned int StorageLowWatermarkPercent = 80;
+        unsigned int StorageCheckIntervalInSeconds = 10;
+
+        // Queued upload requests with a priority value at or below the floor are never evicted, the others are
+        // evicted lowest priority first.
+        unsigned int StorageEvictionPriorityFloor = 0;
+
+        // Threads walking the directories of FileList entries naming a directory or a glob pattern, per request.
+        unsigned int FileListScanThreadCount = 4;
+
+        // Received messages waiting for the dispatcher thread, rounded up to a power of two. When the queue is
+        // full, the MQTT callback either blocks until there is room or drops the message, see
+        // IngressOverflowPolicyNames.
+        unsigned int IngressQueueCapacity = 1024;
+        std::string IngressOverflowPolicy = IngressOverflowPolicyNames::Block;
+
+        // JSON array of watch rules, see WatchRule. Files written into a rule directory are requested for upload
+        // without a file upload request, in one request per rule and batch window. Empty disables watching.
+        std::string WatchRules;
+        unsigned int WatchBatchWindowInMs = 2000;
+        unsigned int WatchMaxBatchFiles = 100;
+
+        // Encoding of published messages, see WireFormatNames. Received messages are accepted in either
+        // encoding, and auto publishes in the encoding of the last received message.
+        std::string WireFormat = WireFormatNames::Json;
+
+        // Content encoding of uploaded files, see CompressionNames. The Compression property of an upload
+        // request, or else the first matching JSON compression rule, see CompressionRule, overrides the
+        // default encoding for a file.
+        std::string Compression = CompressionNames::None;
+        unsigned int CompressionLevel = 3;
+        std::string CompressionRules;
+
+        // Files smaller than the threshold are packed into tar blobs of up to the maximum size and file count,
+        // so they share one blob uri and upload. 0 disables packing.
+        uint64_t PackFileSizeThresholdInBytes = 0;
+        uint64_t PackMaxSizeInBytes = 32 * 1024 * 1024;
+        unsigned int PackMaxFiles = 1000;
+
+        // Uploaded content kept in the dedup index by size and content hash, so a file with the same content
+        // is not uploaded again but refers to the blob it was uploaded to. 0 disables content deduplication.
+        // Upload ids are always kept, so a repeated upload request is dropped within the retention.
+        unsigned int DedupIndexCapacity = 0;
+        unsigned int DedupRetentionInSeconds = 24 * 60 * 60;
+
+        // Compute the CRC64 of uploaded data while it is read, have the storage service verify it per request,
+        // and report the CRC64 of each blob in the notification.
+        bool ContentCrc64 = true;
+
+        // Upload rate of all transfers together, 0 is unlimited. The rate is shared among the request priorities
+        // with transfers in flight by the weights of the JSON object of weights by priority, see BandwidthGovernor.
+        // Bandwidth limits messages change both at runtime, and are also received on the control topic if set.
+        uint64_t BandwidthLimitInBytesPerSecond = 0;
+        std::string BandwidthPriorityWeights = R"({"0": 4, "1": 2})";
+        std::string BandwidthControlTopic;
+
+        /**
+         * @brief Load settings from the environment, falling back to the defaults above.
+         *
+         * @return The file upload settings
+         */
+        static FileUploadSettings LoadFromEnvironment();
+    };
+} // namespace microsoft::azure::connectedcar::fileuploadmodule
+
+#endif // FILE_UPLOAD_SETTINGS_H